@@ -0,0 +1,96 @@
+#!/bin/sh
+# Measures how many commands per second seashell gets through on a set of workloads,
+# printing the results as JSON. The scripts it runs are generated under bench/work.
+#
+# usage: bench/bench.sh [path to seashell]
+#
+# BENCH_SCALE multiplies the number of iterations of every workload (default 1).
+
+set -eu
+
+SHELL_BIN=${1:-./seashell}
+SCALE=${BENCH_SCALE:-1}
+WORK=$(dirname "$0")/work
+mkdir -p "$WORK"
+
+# Timestamps in nanoseconds
+now() {
+  date +%s%N
+}
+
+# Writes a script repeating one line a number of times
+repeat() {
+  awk -v n="$2" -v line="$1" 'BEGIN { for (i = 0; i < n; i++) print line }'
+}
+
+first=1
+
+# Runs seashell on a script and prints one JSON result.
+# usage: run name iterations unit script [seashell options]
+run() {
+  name=$1
+  iterations=$2
+  unit=$3
+  script=$4
+  shift 4
+  start=$(now)
+  "$SHELL_BIN" "$@" "$script" > /dev/null
+  end=$(now)
+  bytes=$(wc -c < "$script")
+  [ "$first" = 1 ] || printf ',\n'
+  first=0
+  awk -v name="$name" -v n="$iterations" -v unit="$unit" -v ns=$((end - start)) -v bytes="$bytes" 'BEGIN {
+    s = ns / 1e9
+    printf "    {\"name\": \"%s\", \"iterations\": %d, \"unit\": \"%s\", \"seconds\": %.6f, \"per_second\": %.1f, \"script_bytes\": %d}", name, n, unit, s, n / s, bytes
+  }'
+}
+
+# Process launch: each line forks and execs, or runs in-process for builtins
+externals=$((2000 * SCALE))
+builtins=$((200000 * SCALE))
+pipelines=$((1000 * SCALE))
+repeat /bin/true "$externals" > "$WORK/external.sh"
+repeat true "$builtins" > "$WORK/builtin.sh"
+repeat '/bin/true | /bin/true | /bin/true' "$pipelines" > "$WORK/pipeline.sh"
+
+# Parsing only, with -n: a large script of mixed syntax...
+blocks=$((20000 * SCALE))
+awk -v n="$blocks" 'BEGIN {
+  for (i = 0; i < n; i++) {
+    print "# block " i
+    print "if test -f /etc/passwd && true; then"
+    print "  echo \"found it\" '\''quoted words'\'' > /dev/null 2>&1"
+    print "elif false || : ; then printf \"%s\\n\" a b c | sort | uniq -c; fi"
+    print "for word in one two three four five; do echo $word; done"
+    print "while false; do cat < /dev/null >> /tmp/out & done"
+  }
+}' > "$WORK/parse.sh"
+
+# ...and commands with huge argument lists, parsed and then run by a builtin
+args=$((100000 * SCALE))
+awk -v n="$args" 'BEGIN {
+  for (line = 0; line < 10; line++) {
+    printf ":"
+    for (i = 0; i < n / 10; i++)
+      printf " argument%d", i
+    printf "\n"
+  }
+}' > "$WORK/args.sh"
+
+# Pathname expansion over a large directory, again and again as build scripts do
+files=$((10000 * SCALE))
+globs=$((200 * SCALE))
+rm -rf "$WORK/glob"
+mkdir -p "$WORK/glob"
+awk -v n="$files" -v dir="$WORK/glob" 'BEGIN { for (i = 0; i < n; i++) printf "%s/file%d.o\n", dir, i }' | xargs touch
+repeat ": $WORK/glob/*.o" "$globs" > "$WORK/glob.sh"
+
+printf '{\n  "seashell": "%s",\n  "benchmarks": [\n' "$SHELL_BIN"
+run external "$externals" commands "$WORK/external.sh"
+run builtin "$builtins" commands "$WORK/builtin.sh"
+run pipeline "$pipelines" pipelines "$WORK/pipeline.sh"
+run parse "$((blocks * 6))" lines "$WORK/parse.sh" -n
+run arguments_parse "$args" words "$WORK/args.sh" -n
+run arguments_run "$args" words "$WORK/args.sh"
+run glob "$globs" globs "$WORK/glob.sh"
+printf '\n  ]\n}\n'
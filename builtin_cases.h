@@ -0,0 +1,64 @@
+// Generated from the builtins table by tools/builtin_cases.awk; do not edit.
+  case 1 << 8 | ':':
+    i = 0;
+    break;
+  case 1 << 8 | '[':
+    i = 1;
+    break;
+  case 2 << 8 | 'b':
+    i = 2;
+    break;
+  case 2 << 8 | 'c':
+    i = 3;
+    break;
+  case 2 << 8 | 'f':
+    i = 4;
+    break;
+  case 3 << 8 | 'c':
+    i = 5;
+    break;
+  case 3 << 8 | 'p':
+    i = 6;
+    break;
+  case 3 << 8 | 's':
+    i = 7;
+    break;
+  case 3 << 8 | 't':
+    i = 8;
+    break;
+  case 4 << 8 | 'e':
+    i = name[1] == 'c' ? 9 : 10;
+    break;
+  case 4 << 8 | 'h':
+    i = 11;
+    break;
+  case 4 << 8 | 'j':
+    i = 12;
+    break;
+  case 4 << 8 | 't':
+    i = name[1] == 'e' ? 13 : name[1] == 'r' ? 14 : 15;
+    break;
+  case 4 << 8 | 'w':
+    i = 16;
+    break;
+  case 5 << 8 | 'f':
+    i = 17;
+    break;
+  case 5 << 8 | 's':
+    i = 18;
+    break;
+  case 5 << 8 | 'u':
+    i = 19;
+    break;
+  case 6 << 8 | 'e':
+    i = 20;
+    break;
+  case 6 << 8 | 'p':
+    i = 21;
+    break;
+  case 7 << 8 | 'h':
+    i = 22;
+    break;
+  case 8 << 8 | 'p':
+    i = 23;
+    break;
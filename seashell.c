@@ -6,238 +6,9289 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pwd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 // Return status codes
+#define INTERRUPTED -4
 #define EMPTY_ARGS -3
 #define EOF_REACHED -2
 #define ERROR -1
 
 // Magic numbers and stuff
-#define MAX_LINE 1024
-#define MAX_ARGS 64
-#define DELIM " \t\r\n\a"
+#define INITIAL_ARGS 16
+#define HASH_BUCKETS 256
+#define ENV_BUCKETS 256
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define ARENA_INITIAL 4096
+#define ARENA_ALIGN 16
+#define SCRIPT_BLOCK 65536
+#define PIPE_SIZE_VAR "SEASHELL_PIPE_SIZE"
+#define PARALLEL_MAX_STATUS 101
+#define HISTORY_FILE ".seashell_history"
+#define HISTORY_MAX_LINE 65536
+#define HISTORY_TRIGRAMS 65536 // Buckets of the trigram index of the history
+#define COMPLETION_LIST_MAX 200
+#define RC_FILE ".seashellrc"
+#define PROMPT_VAR "SEASHELL_PROMPT"
+#define DEFAULT_PROMPT "seashell> "
+#define SUBSTITUTION_DEPTH_MAX 32
+#define SERVER_HEADER_MAX 64
+#define SERVER_REQUEST_MAX (16 << 20)
+#define EVENT_BATCH 64
+#define OUTPUT_BUFFER (64 << 10)
+#define COPY_CHUNK (1 << 24) // Most bytes moved by one copy_file_range, sendfile or splice
+#define COPY_BUFFER (64 << 10)
+#define GLOB_READ_BUFFER (1 << 20) // Bytes of directory entries fetched by one getdents64
+#define GLOB_BUCKETS 64
+#define GLOB_CACHE_DIRS 256 // Directory listings kept by globbing before the cache is emptied
+#define PARSE_AHEAD_MIN (256 << 10) // Mapped scripts this big are parsed ahead in a thread
+#define PARSE_QUEUE 64              // Lines parsed ahead at most, a power of two
+#define PARSE_SPIN 1000             // Checks for a parsed line before the main thread sleeps
+#define SORT_SMALL 12       // Below this many strings sort_names falls back to insertion sort
+
+// Ways of moving data between descriptors, tried in order until the kernel takes one
+#define COPY_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_READ 3
+#define TRACE_VAR "SEASHELL_TRACE"
+#define TRACE_SUB_BITS 4 // Histogram buckets per power of two are 1 << TRACE_SUB_BITS
+#define TRACE_BUCKETS (64 << TRACE_SUB_BITS)
+
+// Phases of running a command that `set -o trace` times
+#define TRACE_READ 0
+#define TRACE_TOKENIZE 1
+#define TRACE_EXPAND 2
+#define TRACE_RESOLVE 3
+#define TRACE_SPAWN 4
+#define TRACE_WAIT 5
+#define TRACE_PHASES 6
+
+// Bytes the lexer leaves in words to mark where they are expanded
+#define EXPAND_MARK '\x01'   // Starts an unquoted $ expansion, whose result is split into fields
+#define EXPAND_QUOTED '\x02' // Starts a $ expansion inside double quotes
+#define EXPAND_END '\x03'    // Ends the command text of a $(...), or a $name joined to text by quoting
+#define GLOB_STAR '\x04'     // An unquoted *, matching any string in a file name
+#define GLOB_ANY '\x05'      // An unquoted ?, matching any one character
+#define GLOB_BRACKET '\x06'  // An unquoted [ that opens a bracket expression
+
+// Elements of a compiled glob pattern
+#define MATCH_TEXT 0
+#define MATCH_ANY 1
+#define MATCH_STAR 2
+#define MATCH_SET 3
+
+// Token types produced by the lexer
+#define TOKEN_END 0
+#define TOKEN_WORD 1
+#define TOKEN_PIPE 2
+#define TOKEN_REDIRECT 3
+#define TOKEN_AMP 4
+#define TOKEN_SEMI 5
+#define TOKEN_ERROR 6
+#define TOKEN_AND 7
+#define TOKEN_OR 8
+
+// Character classes used by the lexer
+#define CC_SPACE 1
+#define CC_OPERATOR 2
+#define CC_QUOTE 4
+#define CC_END 8
+#define CC_GLOB 16
+#define CC_WORD_END (CC_SPACE | CC_OPERATOR | CC_END)
+
+// Node types of the syntax tree
+#define NODE_PIPELINE 0
+#define NODE_AND 1
+#define NODE_OR 2
+#define NODE_IF 3
+#define NODE_WHILE 4
+#define NODE_UNTIL 5
+#define NODE_FOR 6
+
+// Redirection types
+#define REDIR_IN 0
+#define REDIR_OUT 1
+#define REDIR_APPEND 2
+#define REDIR_DUP 3
+#define REDIR_STRING 4
+#define REDIR_FD_BASE 10
+
+// Process and job states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+// A redirection of one of a command's descriptors
+typedef struct
+{
+  int fd;       // Descriptor being redirected
+  int type;     // One of the REDIR_* types
+  char *target; // File name, here-string text, or source descriptor for REDIR_DUP
+  int source;   // Descriptor to be moved onto fd once opened, or -1 to close fd
+  int saved;    // Copy of fd kept while a builtin runs with the redirection applied
+} Redirect;
 
 typedef struct
 {
   char *name;
   char **args;
-  char arg_count;
+  size_t arg_count;
+  Redirect *redirects;
+  size_t redirect_count;
+  char **assigns; // Leading NAME=value words, which only the command gets in its environment
+  size_t assign_count;
 } Command;
 
-ssize_t read_line(char *line);
-int parse_line(char *line, Command *cmd);
+// One or more commands connected by pipes, run and waited for as one job
+typedef struct
+{
+  Command *commands;
+  size_t count;
+  int background;
+  int timed; // Prefixed with the `time` keyword
+  int expand; // Whether any word has expansions, so it is expanded before every run
+  int exec;   // Whether the shell has nothing left to do after it, so it can exec the command
+  int runs;   // Whether it has been run before, so its tree was reused
+} Pipeline;
+
+// A node of the syntax tree. A line, or a block of lines for compound commands, is
+// parsed once into nodes laid out in an arena and then executed as often as needed.
+typedef struct Node
+{
+  int type;            // One of the NODE_* types
+  struct Node *next;   // Next node of the same list, run after this one
+  Pipeline *pipeline;  // NODE_PIPELINE
+  struct Node *left;   // Condition of if, while and until, or the first operand of && and ||
+  struct Node *right;  // Then branch or loop body, or the second operand of && and ||
+  struct Node *orelse; // Else branch of if, where an elif is a nested if
+  char *name;          // Variable set by NODE_FOR
+  char **words;        // Words iterated over by NODE_FOR
+  size_t word_count;
+  int expand;          // Whether the words of NODE_FOR have expansions
+} Node;
+
+// A process belonging to a job
+typedef struct
+{
+  pid_t pid;
+  int state;  // One of the JOB_* states
+  int status; // Raw wait status once stopped or done
+} Process;
+
+// A pipeline's processes. Foreground jobs live in the per-pipeline arena and only move
+// into the job table when they are stopped; background jobs go there right away.
+typedef struct
+{
+  int id;             // Job number shown as %id, or 0 while the job is not in the table
+  pid_t pgid;         // Process group with job control, otherwise 0
+  Process *procs;
+  size_t count;
+  int background;
+  unsigned long seq;  // When the job was last started or stopped, to find the current job
+  char *text;         // Command text shown by `jobs`
+  struct rusage usage; // Resources used by the reaped processes, maxrss is the largest
+} Job;
+
+// A descriptor watched by the event loop, and what to do once it is ready
+typedef struct EventSource
+{
+  int fd;
+  void (*ready)(struct EventSource *source, unsigned int events);
+  void *data;
+} EventSource;
+
+// Lookup table classifying every byte for the lexer; plain word characters are 0
+static const unsigned char char_class[256] = {
+    ['\0'] = CC_END,
+    [' '] = CC_SPACE,
+    ['\t'] = CC_SPACE,
+    ['\r'] = CC_SPACE,
+    ['\n'] = CC_SPACE,
+    ['\a'] = CC_SPACE,
+    ['|'] = CC_OPERATOR,
+    ['&'] = CC_OPERATOR,
+    [';'] = CC_OPERATOR,
+    ['<'] = CC_OPERATOR,
+    ['>'] = CC_OPERATOR,
+    ['\''] = CC_QUOTE,
+    ['"'] = CC_QUOTE,
+    ['\\'] = CC_QUOTE,
+    ['$'] = CC_QUOTE,
+    ['*'] = CC_GLOB,
+    ['?'] = CC_GLOB,
+    ['['] = CC_GLOB,
+};
+
+// Scanning state over a line that is being tokenized in place
+typedef struct
+{
+  char *pos;         // Next character to be scanned
+  char pending;      // Operator character that terminated the previous word, or NUL
+  int redirect_fd;   // Descriptor of the last TOKEN_REDIRECT
+  int redirect_type; // Type of the last TOKEN_REDIRECT
+  int quoted;        // Whether the last TOKEN_WORD was quoted, so it cannot be a reserved word
+  int expand;        // Whether the last TOKEN_WORD has expansions, marked for expand_word
+  int assign;        // Whether the last TOKEN_WORD starts with an unquoted NAME=
+} Lexer;
+
+// An oversized allocation that did not fit in the arena's main block
+typedef struct ArenaSpill
+{
+  struct ArenaSpill *next;
+  char data[];
+} ArenaSpill;
+
+// A bump allocator for per-line or per-pipeline data, reset instead of freed
+typedef struct
+{
+  char *base;
+  size_t size;
+  size_t used;
+  size_t spilled;
+  ArenaSpill *spill;
+} Arena;
+
+// A source of script lines: a memory-mapped file, a -c string or a block-buffered descriptor
+typedef struct
+{
+  int fd;         // Descriptor refilled by block reads, or -1 when all data is in memory
+  char *data;     // Start of the input data
+  size_t len;     // Number of valid bytes in data
+  size_t pos;     // Offset of the next unread line
+  size_t cap;     // Capacity of data when it is a heap block buffer, otherwise 0
+  size_t mapped;  // Length of the mapping when data is mmap'd, otherwise 0
+  char *tail;     // Copy of an unterminated last line that cannot be NUL terminated in place
+} Input;
+
+// Where lines are read from: the terminal, or an Input for scripts, -c strings and pipes
+typedef struct
+{
+  Input *input;
+  int interactive;
+  char *line;     // getline buffer of the terminal, reused across lines
+  size_t cap;
+  int exec_last;  // Whether the last command may replace the shell, as nothing runs after it
+} Source;
+
+// State of the parser while it reads a line, and any further lines of open compound commands
+typedef struct
+{
+  Lexer lex;
+  int token;    // Current token, one of the TOKEN_* types
+  char *word;   // Text of the current TOKEN_WORD
+  int depth;    // Number of compound commands still open, which continue past the end of a line
+  int copy;     // Whether lines must be copied into the arena because the source reuses its buffer
+  int cancelled; // Set when a continuation line was abandoned with ^C
+  int expand;   // Whether a word of the pipeline being parsed has expansions
+  Source *src;
+  Arena *arena;
+} Parser;
+
+// The history entries holding a trigram, or another trigram of the same bucket, oldest first
+typedef struct
+{
+  unsigned int *entries;
+  size_t count;
+  size_t cap;
+} Posting;
+
+// Command history: an append-only file shared by every shell, mapped for reading
+typedef struct
+{
+  int fd;         // History file opened with O_APPEND, or -1 if there is none
+  char *data;     // Shared read-only mapping of the file, or NULL until it is first read
+  size_t mapped;  // Length of the mapping
+  size_t *lines;  // Offsets of the entries indexed so far, the oldest first
+  size_t count;
+  size_t cap;
+  size_t indexed; // Offset up to which the mapping has been indexed
+  Posting *trigrams; // Trigram index of the entries for ^R, or NULL if it could not be kept
+  char *last;     // Previous line added by this shell, so repeats are skipped
+} History;
+
+// A growable byte buffer, kept NUL terminated
+typedef struct
+{
+  char *data;
+  size_t len;
+  size_t cap;
+} Buffer;
+
+// A client of the server, with what it has sent that is not handled yet
+typedef struct Client
+{
+  EventSource source;
+  Buffer in;
+  size_t pos;          // Start of the next request in the buffer
+  int queued;          // Whether it waits in the run queue
+  int running;         // Whether one of its requests is running
+  int closed;          // Whether nothing more is read from it
+  struct Client *next; // Next in the run queue or the pool
+} Client;
+
+// A line of a script parsed ahead by the parser thread, in an arena of its own
+typedef struct
+{
+  Arena arena;
+  Node *tree;
+  int status;                  // What parse_line returned, or EOF_REACHED after the last line
+  int last;                    // Whether only blank lines follow, so the last command may exec
+  Buffer errors;               // Messages of parse errors, printed once the line is reached
+  unsigned long long parse_ns; // Time taken to read and parse the line
+} ParsedLine;
+
+// Lines handed from the parser thread to the main thread. It is a single-producer,
+// single-consumer ring: each side only moves its own index, and a side that finds the
+// ring empty or full sleeps on the other's index with a futex.
+typedef struct
+{
+  ParsedLine lines[PARSE_QUEUE];
+  _Atomic unsigned int head;    // Next line to be run, moved by the main thread
+  _Atomic unsigned int tail;    // Next line to be parsed, moved by the parser thread
+  _Atomic int runner_waiting;   // Whether the main thread sleeps on tail
+  _Atomic int parser_waiting;   // Whether the parser thread sleeps on head
+  _Atomic int stop;             // Set by the main thread when it runs no more lines
+  int taken;                    // Whether the main thread still uses the line at head
+  Source *src;
+  pthread_t thread;
+} ParseQueue;
+
+// State of the line editor. It lives from line to line, keeping its buffers and any keys typed ahead.
+typedef struct
+{
+  const char *prompt;
+  Buffer text;     // Line being edited
+  size_t pos;      // Byte offset of the cursor in text
+  Buffer view;     // What the terminal should show: the prompt and the line
+  Buffer shown;    // What the terminal does show
+  size_t cursor;   // Column of the terminal cursor, counted from the start of the prompt
+  size_t cols;     // Width of the terminal
+  Buffer out;      // Terminal output still to be written
+  size_t entry;    // History entry shown, where newest stands for the line being typed
+  size_t newest;   // Number of history entries when the line was started
+  Buffer draft;    // Line being typed, kept while history entries are shown
+  int searching;   // Whether a ^R search is going on
+  Buffer query;    // Text being searched for
+  ssize_t match;   // History entry matching the query, or -1
+  char keys[256];  // Input read from the terminal
+  size_t key_len;
+  size_t key_pos;  // Next key in keys still to be handled
+} Editor;
+
+// Segments of the prompt, each kept until what it shows may have changed
+typedef struct
+{
+  Buffer text;             // Last rendered prompt
+  char *cwd;               // Working directory
+  int cwd_stale;           // Set by cd
+  char *head;              // HEAD of the git repository containing cwd, or NULL
+  int head_stale;          // Whether the repository must be looked for again
+  ino_t head_ino;          // Identity and modification time of HEAD when it was read
+  struct timespec head_mtime;
+  char branch[256];
+  char user[64];
+  char host[256];
+} Prompt;
+
+// Latencies of one traced phase in nanoseconds. Buckets are exact below 16 ns and then
+// split every power of two 16 ways, so any value is kept within 1/16 of itself.
+typedef struct
+{
+  unsigned long long count;
+  unsigned long long total;
+  unsigned long long max;
+  unsigned long long buckets[TRACE_BUCKETS];
+} Histogram;
+
+// Output of a command substitution, collected in an arena
+typedef struct
+{
+  Arena *arena;
+  char *data;
+  size_t len;
+  size_t cap;
+} Capture;
+
+// Fields produced by expanding words, built in an arena
+typedef struct
+{
+  Arena *arena;
+  int split;       // Whether unquoted expansions are split into fields at blanks
+  char *text;      // Field being built
+  size_t len;
+  size_t cap;
+  int keep;        // Whether the field is kept even if empty, because it has quotes or text
+  char **fields;   // Finished fields, NULL terminated
+  size_t count;
+  size_t field_cap;
+} Expansion;
+
+// One element of a compiled glob pattern
+typedef struct
+{
+  int type;              // One of the MATCH_* types
+  const char *text;      // Literal text for MATCH_TEXT
+  size_t len;
+  unsigned char set[32]; // Bytes a MATCH_SET takes, one bit each
+} GlobOp;
+
+// One component of a glob pattern, between slashes
+typedef struct
+{
+  const char *text; // Text of the component, taken as it is without pattern characters
+  size_t len;
+  GlobOp *ops;      // Compiled pattern, or NULL for a plain name
+  size_t count;
+  int tree;         // Whether the component is **, matching any depth of directories
+  size_t slashes;   // Slashes before the component, kept as many as the pattern has
+} GlobPart;
+
+// A pathname expansion under way
+typedef struct
+{
+  Expansion *e;
+  GlobPart *parts;
+  size_t count;
+  int dirs;    // Whether the pattern ends in a slash, so only directories match
+  Buffer path; // Directory being searched, or a candidate in it
+} Glob;
+
+// The sorted names of a directory globbing has read, valid while its identity and mtime stay the same
+typedef struct GlobDir
+{
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int stable;          // Whether the mtime was old enough to be trusted when the names were read
+  unsigned long glob;  // Last glob that used the listing, which must not read it again
+  char **names;        // Sorted names, pointing into pool, each just after its d_type byte
+  size_t count;
+  char *pool;
+  struct GlobDir *next;
+} GlobDir;
+
+// Candidates for completing a word
+typedef struct
+{
+  char **items;
+  size_t count;
+  size_t cap;
+} Matches;
+
+// A command run inside the shell instead of in a child process
+typedef struct
+{
+  const char *name;
+  int (*run)(Command *cmd); // Returns 1 to keep the shell running, or 0 to exit it
+  int pure;                 // Only writes output, so $(...) can run it without a subshell
+  int (*handles)(Command *cmd); // Whether it runs this form of the command, or NULL for all of them
+} Builtin;
+
+// An entry of the command hash table, mapping a command name to its absolute path
+typedef struct HashEntry
+{
+  char *name;
+  char *path;
+  unsigned int hits;
+  struct HashEntry *next;
+} HashEntry;
+
+// A variable of the environment, kept as the NAME=value string commands are given
+typedef struct EnvVar
+{
+  char *entry;
+  size_t name_len;
+  size_t index; // Slot of the entry in the environment block
+  struct EnvVar *next;
+} EnvVar;
+
+// The executables of one PATH directory, sorted by name, for completing command names
+typedef struct
+{
+  char *dir;
+  dev_t dev;             // Identity and modification time of the directory when it was scanned
+  ino_t ino;
+  struct timespec mtime;
+  int scanned;
+  int stable;            // Whether the mtime was old enough to be trusted when the names were read
+  char **names;          // Sorted names, pointing into pool
+  size_t count;
+  char *pool;
+} PathDir;
+
+ssize_t read_line(char **line, size_t *cap);
+ssize_t edit_line(const char *prompt, char **line, size_t *cap);
+int buffer_insert(Buffer *b, size_t at, const char *data, size_t len);
+int buffer_add(Buffer *b, const char *data, size_t len);
+ssize_t source_line(Source *src, const char *prompt, char **line);
+const char *render_prompt(void);
+int run_source(Source *source, Arena *arena, Arena *run_arena);
+int run_rc(Arena *arena, Arena *run_arena);
+void mark_exec(Node *list);
+int exec_command(Command *cmd, const char *path);
+void startup_phase(const char *name);
+void startup_done(void);
+void trace_begin(struct timespec *start);
+void trace_end(int phase, const struct timespec *start);
+int run_server(const char *path);
+int open_script(Input *in, const char *path);
+void open_string(Input *in, char *text);
+ssize_t next_line(Input *in, char **line);
+void close_input(Input *in);
+int input_done(Input *in);
+void history_open(void);
+void history_add(const char *line, size_t len);
+size_t history_count(void);
+const char *history_entry(size_t index, size_t *len);
+ssize_t history_search(const char *needle, size_t before);
+void history_close(void);
+int next_token(Lexer *lex, char **word);
+int parse_line(char *line, Source *src, Node **tree, Arena *arena);
+int parse_string(const char *text, size_t len, Arena *arena, Node **tree);
+int execute_list(Node *list, Arena *arena);
+int execute_node(Node *node, Arena *arena);
+int execute_pipeline(Pipeline *pipeline, Arena *arena);
 int execute_command(Command *cmd);
-void free_command(Command *cmd);
+int is_builtin(const char *name);
+int runs_builtin(Command *cmd);
+const Builtin *find_builtin(const char *name);
+int run_builtin(Command *cmd);
+int open_redirects(Command *cmd);
+void close_redirects(Command *cmd);
+int apply_redirects(Command *cmd);
+void restore_redirects(Command *cmd);
+void restore_signals(Job *job);
+pid_t spawn_process(Command *cmd, int fd_in, int fd_out, Job *job);
+pid_t fork_process(Command *cmd, int fd_in, int fd_out, Job *job);
+void init_jobs(int interactive);
+void env_init(void);
+const char *env_lookup(const char *name, size_t len);
+const char *env_get(const char *name);
+int env_set(const char *name, const char *value);
+int env_put(char *entry);
+void env_unset(const char *name);
+int env_assign(Command *cmd);
+char **env_overlay(Command *cmd);
+void env_restore(Command *cmd);
+int event_init(void);
+int event_add(EventSource *source, unsigned int events);
+void event_remove(EventSource *source);
+int event_wait(int timeout);
+int event_wait_readable(int fd);
+void check_jobs(void);
+void reap_children(int options);
+int wait_job(Job *job);
+int job_state(Job *job);
+Job *adopt_job(Job *job, Pipeline *pipeline);
+char *describe_pipeline(Pipeline *pipeline);
+void free_job(Job *job);
+Job *find_job(const char *spec, const char *builtin);
+int jobs_builtin(Command *cmd);
+int wait_builtin(Command *cmd);
+int fg_builtin(Command *cmd);
+int bg_builtin(Command *cmd);
+int parallel_builtin(Command *cmd);
+int set_builtin(Command *cmd);
+int exit_builtin(Command *cmd);
+int cd_builtin(Command *cmd);
+int pwd_builtin(Command *cmd);
+int true_builtin(Command *cmd);
+int false_builtin(Command *cmd);
+int echo_builtin(Command *cmd);
+int printf_builtin(Command *cmd);
+int test_builtin(Command *cmd);
+int export_builtin(Command *cmd);
+int unset_builtin(Command *cmd);
+int type_builtin(Command *cmd);
+int history_builtin(Command *cmd);
+int cat_builtin(Command *cmd);
+int cat_handles(Command *cmd);
+int tee_builtin(Command *cmd);
+int tee_handles(Command *cmd);
+int stats_builtin(Command *cmd);
+void print_timing(const char *text, const struct timespec *start, const struct rusage *usage, int keyword);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+const char *hash_lookup(const char *name);
+void hash_forget(const char *name);
+void hash_clear(void);
+char *search_path(const char *name, const char *path);
+int compare_names(const void *a, const void *b);
+int glob_tree(Glob *g, size_t part, size_t slashes);
+void parse_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+ssize_t write_diagnostic(void *cookie, const char *data, size_t len);
+void trace_record(int phase, unsigned long long value);
+void scratch_free(void);
+void path_index_refresh(void);
+char *path_index_locate(const char *name);
+void path_index_free(void);
+void path_index_complete(const char *prefix, Matches *m);
+void add_match(Matches *m, const char *text, size_t len);
+int hash_builtin(Command *cmd);
+
+extern char **environ;
+
+// Exit status of the last command, returned by the shell when it finishes
+static int last_status = 0;
+
+// Set when a foreground job dies of SIGINT, which stops the rest of the line like a ^C to the shell
+static int interrupted = 0;
+
+// Job control is only enabled for interactive shells
+static int job_control = 0;
+static pid_t shell_pgid = 0;
+static struct termios shell_tmodes;
 
-int main(void)
+// signalfd reporting SIGCHLD, and the jobs it is reaped into (job id = index + 1)
+static int child_fd = -1;
+
+// The event loop: one epoll instance watching the signalfd and whatever else the shell waits on
+static int event_fd = -1;
+static EventSource child_source;
+
+// Clients of the server waiting to have a request run, and ones kept for reuse
+static struct
 {
-  int status = 1;
+  Client *head;
+  Client *tail;
+  Client *pool;
+} server = {NULL, NULL, NULL};
+static Job **job_table = NULL;
+static size_t job_slots = 0;
+static Job *foreground_job = NULL;
+static unsigned long job_seq = 0;
 
-  // Ignore SIGINT (Ctrl+C) in the parent shell
-  struct sigaction sa;
-  sa.sa_handler = SIG_IGN;
-  sigaction(SIGINT, &sa, NULL);
+// History of the lines typed at the terminal
+static History history = {-1, NULL, 0, NULL, 0, 0, 0, NULL, NULL};
+static Editor editor;
+static Prompt prompt_cache;
 
-  // Initialize command structure
-  Command cmd = {NULL, NULL, 0};
+// Arenas for the syntax tree and the pipelines of each level of nested command substitution
+static Arena substitution_arenas[SUBSTITUTION_DEPTH_MAX][2];
+static int substitution_depth = 0;
 
-  while (status)
+// Where the parser thread collects the messages of a line's syntax errors, or NULL
+// in the main thread, which prints them right away
+static __thread Buffer *parse_messages = NULL;
+
+// Set by -n: commands are parsed but not run, to check the syntax of scripts
+static int opt_noexec = 0;
+
+// Whether stdout was a terminal at startup, where output is flushed after every line and command
+static int output_tty = 0;
+
+// Set by --startup-profile: when main was entered, and when the last phase of startup ended
+static int opt_startup_profile = 0;
+static struct timespec startup_start;
+static struct timespec startup_mark;
+
+// Options toggled with `set -o name` and `set +o name`
+static int opt_timing = 0;
+
+// Set by `set -o trace` or SEASHELL_TRACE=1: per-phase latencies, shown by `stats`.
+// The cache counters are kept all the time, being a single increment.
+static int opt_trace = 0;
+static Histogram trace_phases[TRACE_PHASES];
+static const char *const trace_names[TRACE_PHASES] = {"read", "tokenize", "expand", "resolve", "spawn", "wait"};
+static struct
+{
+  unsigned long long path_hits;   // Command names found in the hash table
+  unsigned long long path_misses; // Command names PATH had to be searched for
+  unsigned long long ast_hits;    // Pipelines run again from a tree parsed before
+  unsigned long long ast_misses;  // Pipelines run for the first time after parsing
+} trace_counts;
+static const struct
+{
+  const char *name;
+  int *flag;
+} shell_options[] = {
+    {"timing", &opt_timing},
+    {"trace", &opt_trace},
+};
+
+// Builtins, which are found before PATH is searched. They are kept sorted by length and
+// then name; the cases of find_builtin's switch, which refer to them by index, are
+// generated from this table into builtin_cases.h by make.
+static const Builtin builtins[] = {
+    {":", true_builtin, 1, NULL},
+    {"[", test_builtin, 1, NULL},
+    {"bg", bg_builtin, 0, NULL},
+    {"cd", cd_builtin, 0, NULL},
+    {"fg", fg_builtin, 0, NULL},
+    {"cat", cat_builtin, 0, cat_handles},
+    {"pwd", pwd_builtin, 1, NULL},
+    {"set", set_builtin, 0, NULL},
+    {"tee", tee_builtin, 0, tee_handles},
+    {"echo", echo_builtin, 1, NULL},
+    {"exit", exit_builtin, 0, NULL},
+    {"hash", hash_builtin, 0, NULL},
+    {"jobs", jobs_builtin, 0, NULL},
+    {"test", test_builtin, 1, NULL},
+    {"true", true_builtin, 1, NULL},
+    {"type", type_builtin, 1, NULL},
+    {"wait", wait_builtin, 0, NULL},
+    {"false", false_builtin, 1, NULL},
+    {"stats", stats_builtin, 0, NULL},
+    {"unset", unset_builtin, 0, NULL},
+    {"export", export_builtin, 0, NULL},
+    {"printf", printf_builtin, 1, NULL},
+    {"history", history_builtin, 1, NULL},
+    {"parallel", parallel_builtin, 0, NULL},
+};
+
+int main(int argc, char **argv)
+{
+  clock_gettime(CLOCK_MONOTONIC, &startup_start);
+  startup_mark = startup_start;
+
+  // Output is flushed with one write when the buffer is full, when something else is about
+  // to write, or on a terminal once each command line has run
+  output_tty = isatty(STDOUT_FILENO);
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
+
+  // The shell's own messages go out through write_diagnostic, behind the output before them
+  FILE *diagnostics = fopencookie(NULL, "w", (cookie_io_functions_t){.write = write_diagnostic});
+  if (diagnostics)
   {
-    printf("seashell> ");
+    setvbuf(diagnostics, NULL, _IONBF, 0);
+    stderr = diagnostics;
+  }
 
-    char line[MAX_LINE];
-    ssize_t len = read_line(line);
-    if (len == EOF_REACHED)
+  // Options come before -c or the script
+  const char *server_path = NULL;
+  int arg = 1;
+  for (; arg < argc && (strcmp(argv[arg], "-n") == 0 || strncmp(argv[arg], "--", 2) == 0); arg++)
+  {
+    if (strcmp(argv[arg], "-n") == 0)
+      opt_noexec = 1;
+    else if (strcmp(argv[arg], "--startup-profile") == 0)
+      opt_startup_profile = 1;
+    else if (strcmp(argv[arg], "--server") == 0)
+    {
+      if (++arg == argc)
+      {
+        fprintf(stderr, "seashell: --server: option requires an argument\n");
+        return 2;
+      }
+      server_path = argv[arg];
+    }
+    else if (strcmp(argv[arg], "--") == 0)
     {
-      printf("EOF reached.\n");
+      arg++;
       break;
     }
-    if (len == ERROR)
+    else
     {
-      perror("Error reading input.");
-      continue;
+      fprintf(stderr, "seashell: %s: invalid option\n", argv[arg]);
+      return 2;
     }
+  }
 
-    // Free previously allocated command data
-    free_command(&cmd);
+  // Every later change to the environment goes through the shell's own table
+  env_init();
+  const char *trace = env_get(TRACE_VAR);
+  opt_trace = trace && strcmp(trace, "1") == 0;
+  startup_phase("environ");
 
-    // Allocate fresh memory for command arguments
-    cmd.args = malloc(MAX_ARGS * sizeof(char *));
-    if (!cmd.args)
+  // Pick the input: `-c string`, a script file, or stdin (interactive only on a terminal)
+  Input input = {-1, NULL, 0, 0, 0, 0, NULL};
+  int interactive = 0;
+  if (arg < argc && strcmp(argv[arg], "-c") == 0)
+  {
+    if (arg + 1 >= argc)
     {
-      perror("Error allocating memory for command args.");
-      exit(ERROR);
+      fprintf(stderr, "seashell: -c: option requires an argument\n");
+      return 2;
     }
-
-    cmd.name = malloc(MAX_LINE * sizeof(char));
-    if (!cmd.name)
+    open_string(&input, argv[arg + 1]);
+  }
+  else if (arg < argc)
+  {
+    if (open_script(&input, argv[arg]) == ERROR)
     {
-      perror("Error allocating memory for command name.");
-      free(cmd.args);
-      exit(ERROR);
+      fprintf(stderr, "seashell: %s: %s\n", argv[arg], strerror(errno));
+      return 127;
     }
+  }
+  else if (!server_path && isatty(STDIN_FILENO))
+    interactive = 1;
+  else
+    input.fd = STDIN_FILENO;
+  startup_phase("input");
 
-    cmd.arg_count = 0;
+  // As in other shells, -n does nothing at a terminal, where it would make the shell useless
+  if (interactive)
+    opt_noexec = 0;
 
-    // Parse the input into the Command structure
-    int parse_status = parse_line(line, &cmd);
-    if (parse_status == EMPTY_ARGS)
-      continue;
-    if (parse_status == ERROR)
-    {
-      fprintf(stderr, "Error parsing command.\n");
-      continue;
-    }
+  // Ignore SIGINT (Ctrl+C) in the parent shell
+  struct sigaction sa;
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &sa, NULL);
 
-    // Handle built-in exit command
-    if (strcmp(cmd.name, "exit") == 0)
-      break;
+  // Take the terminal for job control and start watching for finished children
+  init_jobs(interactive);
+  startup_phase("jobs");
 
-    // Execute the command
-    status = execute_command(&cmd);
-  }
+  // A server takes its commands from clients instead
+  if (server_path)
+    return run_server(server_path) == ERROR ? 1 : 0;
+
+  // Only the history file is opened here; it is mapped when first searched or listed,
+  // and PATH is only indexed when a command name is first completed
+  if (interactive)
+    history_open();
+  startup_phase("history");
+
+  // The syntax tree of each line lives in one arena, the pipelines it runs in another
+  Arena arena = {0};
+  Arena run_arena = {0};
+  int status = 1;
+  if (interactive)
+    status = run_rc(&arena, &run_arena);
+  startup_phase("rc");
+
+  // The first prompt is rendered here so the profile covers it; its segments stay cached
+  if (interactive)
+    render_prompt();
+  startup_done();
+
+  Source source = {&input, interactive, NULL, 0, !interactive};
+  if (status)
+    run_source(&source, &arena, &run_arena);
 
   // Cleanup
-  free_command(&cmd);
-  return 0;
+  arena_free(&arena);
+  arena_free(&run_arena);
+  close_input(&input);
+  history_close();
+  free(source.line);
+  return last_status;
 }
 
 /**
- * Reads a line of input from standard input.
+ * Sleeps until a futex word no longer holds a value, or until it is woken.
  *
- * @param line A pointer to a fixed-size buffer where the read line will be stored.
- * @return The number of characters read, or a status code indicating an error or EOF.
+ * @param word A pointer to the futex word.
+ * @param value The value it held when the caller decided to sleep.
  */
-ssize_t read_line(char *line)
+static void futex_wait(_Atomic unsigned int *word, unsigned int value)
 {
-  if (!line)
-    return ERROR;
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
 
-  if (fgets(line, MAX_LINE, stdin) != NULL)
-  {
-    size_t len = strlen(line);
+/**
+ * Wakes the thread sleeping on a futex word, if any.
+ *
+ * @param word A pointer to the futex word.
+ */
+static void futex_wake(_Atomic unsigned int *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-    // Check if the input was truncated and exceeds our buffer size
-    if (len == MAX_LINE - 1 && line[len - 1] != '\n')
+/**
+ * Runs the parser thread: reads and parses one line after another into the free
+ * slots of the queue, waiting while all of them are taken. Parsing does not depend
+ * on anything the commands do, so it can run any number of lines ahead.
+ *
+ * @param data A pointer to the ParseQueue.
+ * @return NULL.
+ */
+static void *parse_ahead_run(void *data)
+{
+  ParseQueue *q = data;
+  for (;;)
+  {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head;
+    while ((head = atomic_load_explicit(&q->head, memory_order_acquire)) + PARSE_QUEUE == tail &&
+           !atomic_load(&q->stop))
     {
-      fprintf(stderr, "Input too long!\n");
-
-      // Clear the input buffer to prevent corruption
-      int ch;
-      while ((ch = getchar()) != '\n' && ch != EOF)
-        ;
-      return ERROR;
+      atomic_store(&q->parser_waiting, 1);
+      if (atomic_load(&q->head) == head && !atomic_load(&q->stop))
+        futex_wait(&q->head, head);
+      atomic_store(&q->parser_waiting, 0);
     }
-    return len;
+    if (atomic_load(&q->stop))
+      break;
+
+    ParsedLine *item = &q->lines[tail % PARSE_QUEUE];
+    arena_reset(&item->arena);
+    item->tree = NULL;
+    item->errors.len = 0;
+    parse_messages = &item->errors;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *line;
+    ssize_t len = source_line(q->src, "", &line);
+    if (len == ERROR)
+      parse_error("Error reading input.: %s\n", strerror(errno));
+    item->status = len < 0 ? EOF_REACHED : parse_line(line, q->src, &item->tree, &item->arena);
+    if (item->status == EMPTY_ARGS)
+      continue;
+    item->last = q->src->exec_last && input_done(q->src->input);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    item->parse_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+    // Publishing the line also publishes everything written into its slot. A main thread
+    // that ran out of lines is woken once there is a batch of them, or at the end.
+    atomic_store(&q->tail, tail + 1);
+    if (atomic_load(&q->runner_waiting) &&
+        (tail + 1 - atomic_load(&q->head) >= PARSE_QUEUE / 2 || item->status == EOF_REACHED))
+      futex_wake(&q->tail);
+    if (item->status == EOF_REACHED)
+      break;
   }
-  return feof(stdin) ? EOF_REACHED : ERROR;
+  parse_messages = NULL;
+  scratch_free();
+  return NULL;
 }
 
 /**
- * Parses a given line of input and fills the provided Command structure.
+ * Starts parsing a script ahead in a thread, if it is a mapped file large enough
+ * for that to pay off. Signals stay with the main thread.
  *
- * @param line A pointer to the input line to be parsed.
- * @param cmd A pointer to the Command to be filled with parsed data.
- * @return 1 if the command was successfully parsed, otherwise an appropriate status code.
+ * @param src A pointer to the Source of the script.
+ * @return A pointer to the ParseQueue, or NULL to parse the script line by line as it runs.
  */
-int parse_line(char *line, Command *cmd)
+static ParseQueue *parse_ahead_start(Source *src)
 {
-  if (!line || !cmd || !cmd->args || !cmd->name)
-    return ERROR;
+  // With a single CPU there is nothing for the parse to overlap with
+  if (src->interactive || src->input->fd != -1 || src->input->mapped < PARSE_AHEAD_MIN ||
+      sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    return NULL;
 
-  int position = 0;
-  char *token = strtok(line, DELIM);
+  ParseQueue *q = calloc(1, sizeof(ParseQueue));
+  if (!q)
+    return NULL;
+  q->src = src;
 
-  while (token)
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  int error = pthread_create(&q->thread, NULL, parse_ahead_run, q);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (error)
   {
-    cmd->args[position] = strdup(token); // Allocate memory for each argument
-    if (!cmd->args[position])
-    {
-      perror("Error allocating memory for argument");
-      return ERROR;
-    }
-
-    if (++position >= MAX_ARGS)
-    {
-      fprintf(stderr, "Too many arguments\n");
-      return ERROR;
-    }
-    token = strtok(NULL, DELIM);
+    free(q);
+    return NULL;
   }
+  return q;
+}
 
-  cmd->args[position] = NULL;
-  if (position == 0)
-    return EMPTY_ARGS;
-
-  strncpy(cmd->name, cmd->args[0], MAX_LINE - 1);
-  cmd->name[MAX_LINE - 1] = '\0';
-  cmd->arg_count = position;
+/**
+ * Takes the next parsed line from the queue, first handing the previous one back
+ * to the parser thread, and waiting if it is not parsed yet.
+ *
+ * @param q A pointer to the ParseQueue.
+ * @return A pointer to the ParsedLine, valid until the next call.
+ */
+static ParsedLine *parse_ahead_next(ParseQueue *q)
+{
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (q->taken)
+  {
+    // A parser waiting for a free slot is only woken once half of them are, so that
+    // it does not wake up, parse one line and go back to sleep for every line run
+    atomic_store(&q->head, ++head);
+    if (atomic_load(&q->parser_waiting) && atomic_load(&q->tail) - head <= PARSE_QUEUE / 2)
+      futex_wake(&q->head);
+  }
+  q->taken = 1;
 
-  return 1;
+  // The parser is usually ahead; when it is not, the line is often only moments away
+  unsigned int tail;
+  for (int spin = 0; spin < PARSE_SPIN && atomic_load_explicit(&q->tail, memory_order_relaxed) == head; spin++)
+    ;
+  while ((tail = atomic_load_explicit(&q->tail, memory_order_acquire)) == head)
+  {
+    atomic_store(&q->runner_waiting, 1);
+    if (atomic_load(&q->tail) == tail)
+      futex_wait(&q->tail, tail);
+    atomic_store(&q->runner_waiting, 0);
+  }
+  return &q->lines[head % PARSE_QUEUE];
 }
 
 /**
- * Frees the memory allocated for a Command.
+ * Stops the parser thread, which may still be ahead if `exit` ended the script,
+ * and frees the queue.
  *
- * @param cmd A pointer to the Command to be freed.
+ * @param q A pointer to the ParseQueue, or NULL.
  */
-void free_command(Command *cmd)
+static void parse_ahead_stop(ParseQueue *q)
 {
-  if (!cmd)
+  if (!q)
     return;
 
-  for (int i = 0; i < cmd->arg_count; i++)
+  // Moving head also ends a wait for a free slot that began before stop was set
+  atomic_store(&q->stop, 1);
+  atomic_store(&q->head, atomic_load(&q->tail));
+  futex_wake(&q->head);
+  pthread_join(q->thread, NULL);
+
+  for (size_t i = 0; i < PARSE_QUEUE; i++)
   {
-    free(cmd->args[i]);
+    arena_free(&q->lines[i].arena);
+    free(q->lines[i].errors.data);
   }
-  free(cmd->args);
-  free(cmd->name);
+  free(q);
 }
 
 /**
- * Executes the given command.
+ * Gets the syntax tree of the next line of a source, along with the rest of any
+ * compound command it opens: from the parser thread when it parses ahead,
+ * otherwise by reading and parsing the line right here.
  *
- * @param cmd A pointer to a Command that contains the details of the command to be executed.
- * @return 1 if the command was successfully executed, otherwise ERROR.
+ * @param src A pointer to the Source to read from.
+ * @param q A pointer to the ParseQueue of the parser thread, or NULL.
+ * @param arena A pointer to the Arena the tree is built in without a parser thread.
+ * @param tree Set to the first Node of the parsed list.
+ * @param last Set when only blank lines follow, so the last command may replace the shell.
+ * @return 1 if a line was parsed, otherwise EMPTY_ARGS, INTERRUPTED, EOF_REACHED or ERROR.
  */
-int execute_command(Command *cmd)
+static int next_tree(Source *src, ParseQueue *q, Arena *arena, Node **tree, int *last)
 {
-  // Handle built-in `cd` command
-  if (strcmp(cmd->name, "cd") == 0)
+  struct timespec start;
+  trace_begin(&start);
+  if (q)
   {
-    if (cmd->arg_count < 2)
-      fprintf(stderr, "cd: missing argument\n");
-    else if (chdir(cmd->args[1]) != 0)
-      perror("cd");
-    return 1;
+    ParsedLine *item = parse_ahead_next(q);
+    trace_end(TRACE_READ, &start);
+    trace_record(TRACE_TOKENIZE, item->parse_ns);
+    if (item->errors.len)
+      fputs(item->errors.data, stderr);
+    *tree = item->tree;
+    *last = item->last;
+    return item->status;
   }
 
-  // Create a child process to execute the given command
-  pid_t pid = fork();
-  if (pid == -1)
+  char *current;
+  ssize_t len = source_line(src, src->interactive ? render_prompt() : "", &current);
+  trace_end(TRACE_READ, &start);
+  if (len == INTERRUPTED || len == EOF_REACHED)
+    return len;
+  if (len == ERROR)
   {
-    perror("fork");
-    return ERROR;
+    perror("Error reading input.");
+    return src->interactive ? EMPTY_ARGS : EOF_REACHED;
   }
 
-  if (pid == 0)
-  {
-    signal(SIGINT, SIG_DFL); // Restore default SIGINT behavior in child
-    execvp(cmd->name, cmd->args);
-    perror("execvp");
-    exit(ERROR);
-  }
+  // Recycle the previous line's memory
+  arena_reset(arena);
 
-  // Wait for the child process to finish executing
-  int status;
-  do
+  trace_begin(&start);
+  int status = parse_line(current, src, tree, arena);
+  trace_end(TRACE_TOKENIZE, &start);
+  *last = src->exec_last && input_done(src->input);
+  return status;
+}
+
+/**
+ * Reads, parses and runs the lines of a source until it ends or `exit` is run.
+ *
+ * @param source A pointer to the Source to read from.
+ * @param arena A pointer to the Arena the syntax tree of each line is built in.
+ * @param run_arena A pointer to the Arena pipelines are run from.
+ * @return 1 if the source ended, or 0 if the shell should exit.
+ */
+int run_source(Source *source, Arena *arena, Arena *run_arena)
+{
+  // Large scripts are parsed ahead in a thread while their first commands run
+  ParseQueue *queue = parse_ahead_start(source);
+  Node *tree = NULL;
+  int status = 1;
+  while (status)
   {
-    if (waitpid(pid, &status, WUNTRACED) == -1)
+    // Report background jobs that changed state since the last line
+    check_jobs();
+
+    // Parse the input, and the rest of any compound command it opens, into a syntax tree
+    int last = 0;
+    int parse_status = next_tree(source, queue, arena, &tree, &last);
+    if (parse_status == EOF_REACHED)
     {
-      perror("waitpid");
-      return ERROR;
+      if (source->interactive)
+        printf("EOF reached.\n");
+      break;
+    }
+    if (parse_status == EMPTY_ARGS)
+      continue;
+    if (parse_status == INTERRUPTED)
+    {
+      last_status = 130;
+      continue;
     }
-  } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    if (parse_status == ERROR)
+    {
+      fprintf(stderr, "Error parsing command.\n");
+      last_status = 2;
+      continue;
+    }
+
+    // Execute the tree, unless only checking the syntax
+    if (opt_noexec)
+      continue;
+    if (last)
+      mark_exec(tree);
+    interrupted = 0;
+    status = execute_list(tree, run_arena);
+    if (output_tty)
+      fflush(stdout);
+  }
+  parse_ahead_stop(queue);
+  return status;
+}
+
+/**
+ * Checks whether an Input has nothing left but blank lines.
+ *
+ * @param in A pointer to the Input.
+ * @return 1 if it has not, otherwise 0.
+ */
+int input_done(Input *in)
+{
+  if (in->fd != -1)
+    return 0;
+  for (size_t i = in->pos; i < in->len; i++)
+  {
+    if (!(char_class[(unsigned char)in->data[i]] & CC_SPACE))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Marks the pipelines a list can end with, which may exec their command since the
+ * shell has nothing left to do after them: the last of the list, the right side of
+ * && and ||, and either branch of if. Loops always go back to their condition.
+ *
+ * @param list A pointer to the first Node of the list.
+ */
+void mark_exec(Node *list)
+{
+  Node *node = list;
+  while (node && node->next)
+    node = node->next;
+  if (!node)
+    return;
 
+  if (node->type == NODE_PIPELINE)
+    node->pipeline->exec = 1;
+  else if (node->type == NODE_AND || node->type == NODE_OR)
+    mark_exec(node->right);
+  else if (node->type == NODE_IF)
+  {
+    mark_exec(node->right);
+    mark_exec(node->orelse);
+  }
+}
+
+/**
+ * Runs `~/.seashellrc` if there is one. Like a script, it is mapped rather than read,
+ * and each command is parsed just before it runs.
+ *
+ * @param arena A pointer to the Arena the syntax tree of each line is built in.
+ * @param run_arena A pointer to the Arena pipelines are run from.
+ * @return 1 if the shell should go on, or 0 if the rc file ran `exit`.
+ */
+int run_rc(Arena *arena, Arena *run_arena)
+{
+  const char *home = env_get("HOME");
+  char *path;
+  if (!home || !*home || asprintf(&path, "%s/%s", home, RC_FILE) == -1)
+    return 1;
+
+  Input input = {-1, NULL, 0, 0, 0, 0, NULL};
+  int status = 1;
+  if (open_script(&input, path) == ERROR)
+  {
+    if (errno != ENOENT)
+      fprintf(stderr, "seashell: %s: %s\n", path, strerror(errno));
+  }
+  else
+  {
+    Source source = {&input, 0, NULL, 0, 0};
+    status = run_source(&source, arena, run_arena);
+    close_input(&input);
+  }
+  free(path);
+  return status;
+}
+
+/**
+ * Ends a phase of startup, printing how long it took if --startup-profile was given.
+ *
+ * @param name The name of the phase.
+ */
+void startup_phase(const char *name)
+{
+  if (!opt_startup_profile)
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = (now.tv_sec - startup_mark.tv_sec) * 1e3 + (now.tv_nsec - startup_mark.tv_nsec) / 1e6;
+  fprintf(stderr, "startup: %-8s %9.3f ms\n", name, ms);
+  startup_mark = now;
+}
+
+/**
+ * Ends startup once the first prompt is ready or, without a terminal, the first line
+ * is about to be read, printing the time taken since main was entered if --startup-profile was given.
+ */
+void startup_done(void)
+{
+  if (!opt_startup_profile)
+    return;
+  startup_phase("prompt");
+  double ms = (startup_mark.tv_sec - startup_start.tv_sec) * 1e3 +
+              (startup_mark.tv_nsec - startup_start.tv_nsec) / 1e6;
+  fprintf(stderr, "startup: %-8s %9.3f ms\n", "total", ms);
+  opt_startup_profile = 0;
+}
+
+/**
+ * Notes when a traced phase starts. Without tracing nothing is read, so the clock
+ * is only paid for while tracing.
+ *
+ * @param start Set to the time, or zeroed without tracing.
+ */
+void trace_begin(struct timespec *start)
+{
+  if (opt_trace)
+    clock_gettime(CLOCK_MONOTONIC, start);
+  else
+    start->tv_sec = start->tv_nsec = 0;
+}
+
+/**
+ * Records how long a traced phase took in its histogram.
+ *
+ * @param phase One of the TRACE_* phases.
+ * @param start When the phase started, from trace_begin.
+ */
+void trace_end(int phase, const struct timespec *start)
+{
+  if (!opt_trace || (start->tv_sec == 0 && start->tv_nsec == 0))
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long ns = (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+  trace_record(phase, ns > 0 ? ns : 0);
+}
+
+/**
+ * Records a latency measured elsewhere, such as in the parser thread, in the histogram of a phase.
+ *
+ * @param phase One of the TRACE_* phases.
+ * @param value The latency in nanoseconds.
+ */
+void trace_record(int phase, unsigned long long value)
+{
+  if (!opt_trace)
+    return;
+
+  // The top bits of the value pick the bucket: the power of two, then the next TRACE_SUB_BITS bits
+  size_t bucket = value;
+  if (value >= 1u << TRACE_SUB_BITS)
+  {
+    int exponent = 63 - __builtin_clzll(value);
+    bucket = ((size_t)(exponent - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) +
+             ((value >> (exponent - TRACE_SUB_BITS)) & ((1u << TRACE_SUB_BITS) - 1));
+  }
+
+  Histogram *h = &trace_phases[phase];
+  h->count++;
+  h->total += value;
+  if (value > h->max)
+    h->max = value;
+  h->buckets[bucket]++;
+}
+
+/**
+ * Finds the latency below which a share of the values recorded in a histogram fall,
+ * as the middle of the bucket holding it.
+ *
+ * @param h A pointer to the Histogram.
+ * @param share The share, from 0 to 1.
+ * @return The latency in nanoseconds, or 0 if nothing was recorded.
+ */
+static unsigned long long trace_percentile(const Histogram *h, double share)
+{
+  unsigned long long rank = (unsigned long long)(share * h->count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  unsigned long long seen = 0;
+  for (size_t i = 0; i < TRACE_BUCKETS; i++)
+  {
+    seen += h->buckets[i];
+    if (seen < rank || h->count == 0)
+      continue;
+    if (i < 1u << TRACE_SUB_BITS)
+      return i;
+    int exponent = (i >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+    unsigned long long width = 1ULL << (exponent - TRACE_SUB_BITS);
+    unsigned long long low = ((1ULL << TRACE_SUB_BITS) + (i & ((1u << TRACE_SUB_BITS) - 1))) * width;
+    unsigned long long mid = low + width / 2;
+    return mid < h->max ? mid : h->max;
+  }
+  return 0;
+}
+
+/**
+ * Sends the whole of a reply to a client, without raising SIGPIPE if it has gone.
+ *
+ * @param fd The client socket.
+ * @param data The bytes to be sent.
+ * @param len The number of bytes.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return ERROR;
+    data += sent;
+    len -= sent;
+  }
+  return 1;
+}
+
+/**
+ * Runs one request of a client and sends back its reply. With capture, stdout of the
+ * commands goes to an anonymous memory file, which builtins and children alike write
+ * to without the shell having to read a pipe while they run, and which is then sent
+ * with sendfile.
+ *
+ * @param fd The client socket.
+ * @param text The command text of the request.
+ * @param len The length of the text.
+ * @param capture Whether the output is sent back.
+ * @param arena A pointer to the Arena the syntax tree is built in.
+ * @param run_arena A pointer to the Arena pipelines are run from.
+ * @return 1 to go on serving the client, 0 if the commands ran `exit`, or ERROR.
+ */
+static int serve_request(int fd, const char *text, size_t len, int capture, Arena *arena, Arena *run_arena)
+{
+  arena_reset(arena);
+  Node *tree;
+  if (parse_string(text, len, arena, &tree) == ERROR)
+    last_status = 2;
+
+  int out = -1;
+  int saved = -1;
+  if (capture)
+  {
+    fflush(stdout);
+    if ((out = memfd_create("seashell-output", MFD_CLOEXEC)) == -1)
+    {
+      perror("memfd_create");
+      return ERROR;
+    }
+    saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, REDIR_FD_BASE);
+    dup2(out, STDOUT_FILENO);
+  }
+
+  int result = 1;
+  if (tree)
+  {
+    interrupted = 0;
+    result = execute_list(tree, run_arena);
+  }
+
+  char header[64];
+  int reply = 1;
+  if (capture)
+  {
+    fflush(stdout);
+    if (saved == -1)
+      close(STDOUT_FILENO);
+    else
+    {
+      dup2(saved, STDOUT_FILENO);
+      close(saved);
+    }
+    off_t size = lseek(out, 0, SEEK_CUR);
+    off_t offset = 0;
+    reply = send_all(fd, header, snprintf(header, sizeof(header), "output %lld\n", (long long)size));
+    // SIGPIPE is ignored, so a client that hangs up midway only makes this fail with
+    // EPIPE or ECONNRESET, and is dropped like any other client that has gone away
+    while (reply == 1 && offset < size)
+    {
+      if (sendfile(fd, out, &offset, size - offset) <= 0 && errno != EINTR)
+        reply = ERROR;
+    }
+    close(out);
+  }
+  if (reply == 1)
+    reply = send_all(fd, header, snprintf(header, sizeof(header), "status %d\n", last_status));
+  return reply == ERROR ? ERROR : result;
+}
+
+/**
+ * Finds the next request of a client once all of it has arrived. Each one is a header
+ * line, `run <length>` or `capture <length>`, followed by that many bytes of command
+ * text, which may hold any number of lines.
+ *
+ * @param client A pointer to the Client.
+ * @param capture Set to whether the output is sent back.
+ * @param start Set to the offset of the command text in the client's buffer.
+ * @param len Set to the length of the command text.
+ * @return 1 if a whole request is there, 0 if more is needed, or ERROR for a bad request.
+ */
+static int next_request(Client *client, int *capture, size_t *start, size_t *len)
+{
+  char *text = client->in.data + client->pos;
+  size_t avail = client->in.len - client->pos;
+  char *newline = avail ? memchr(text, '\n', avail) : NULL;
+  size_t header_len = newline ? (size_t)(newline - text) : avail;
+  if (header_len >= SERVER_HEADER_MAX)
+    return ERROR;
+  if (!newline)
+    return 0;
+
+  char header[SERVER_HEADER_MAX];
+  char mode[16];
+  char extra;
+  memcpy(header, text, header_len);
+  header[header_len] = '\0';
+  if (sscanf(header, "%15s %zu %c", mode, len, &extra) != 2 ||
+      (strcmp(mode, "run") != 0 && strcmp(mode, "capture") != 0) || *len > SERVER_REQUEST_MAX)
+    return ERROR;
+  *capture = mode[0] == 'c';
+  *start = client->pos + header_len + 1;
+  return avail - header_len - 1 >= *len;
+}
+
+/**
+ * Puts a client at the back of the run queue, unless it is already waiting there.
+ *
+ * @param client A pointer to the Client.
+ */
+static void queue_client(Client *client)
+{
+  if (client->queued)
+    return;
+  client->queued = 1;
+  client->next = NULL;
+  if (server.tail)
+    server.tail->next = client;
+  else
+    server.head = client;
+  server.tail = client;
+}
+
+/**
+ * Hangs up on a client, keeping it and its buffer for the next one to connect.
+ *
+ * @param client A pointer to the Client.
+ */
+static void drop_client(Client *client)
+{
+  event_remove(&client->source);
+  close(client->source.fd);
+  client->in.len = 0;
+  client->pos = 0;
+  client->closed = 0;
+  client->next = server.pool;
+  server.pool = client;
+}
+
+/**
+ * Reads what a client has sent, queueing it once a whole request is there.
+ * Reading goes on while other requests run, so no client holds up the others.
+ *
+ * @param source A pointer to the EventSource of the client socket, whose data is the Client.
+ * @param events The epoll events that are ready.
+ */
+static void client_ready(EventSource *source, unsigned int events)
+{
+  (void)events;
+  Client *client = source->data;
+  static char block[SCRIPT_BLOCK];
+
+  // Move the unhandled part to the front of the buffer, unless a request in it is running
+  if (client->pos && !client->running)
+  {
+    memmove(client->in.data, client->in.data + client->pos, client->in.len - client->pos);
+    client->in.len -= client->pos;
+    client->pos = 0;
+  }
+  ssize_t got = read(source->fd, block, sizeof(block));
+  if (got == -1 && errno == EINTR)
+    return;
+  if (got <= 0 || buffer_add(&client->in, block, got) == ERROR)
+  {
+    // Nothing more is read, what has arrived is still served
+    event_remove(source);
+    client->closed = 1;
+  }
+
+  int capture;
+  size_t start, len;
+  if (!client->running && (client->closed || next_request(client, &capture, &start, &len) != 0))
+    queue_client(client);
+}
+
+/**
+ * Accepts a client of the server and starts watching it.
+ *
+ * @param source A pointer to the EventSource of the listening socket.
+ * @param events The epoll events that are ready.
+ */
+static void listener_ready(EventSource *source, unsigned int events)
+{
+  (void)events;
+  int fd = accept4(source->fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1)
+  {
+    if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+      perror("accept");
+    return;
+  }
+
+  Client *client = server.pool;
+  if (client)
+    server.pool = client->next;
+  else if (!(client = calloc(1, sizeof(Client))))
+  {
+    perror("Error allocating memory for client");
+    close(fd);
+    return;
+  }
+  client->source = (EventSource){fd, client_ready, client};
+  if (event_add(&client->source, EPOLLIN) == ERROR)
+    drop_client(client);
+}
+
+/**
+ * Serves the next request of a client from the run queue, then queues it again if
+ * it has sent more, or hangs up if it is done.
+ *
+ * @param client A pointer to the Client.
+ * @param arena A pointer to the Arena the syntax tree is built in.
+ * @param run_arena A pointer to the Arena pipelines are run from.
+ */
+static void serve_client(Client *client, Arena *arena, Arena *run_arena)
+{
+  int capture;
+  size_t start, len;
+  int next = next_request(client, &capture, &start, &len);
+  if (next == ERROR)
+  {
+    send_all(client->source.fd, "error bad request\n", 18);
+    drop_client(client);
+    return;
+  }
+  if (next == 0)
+  {
+    // The client hung up partway through a request
+    if (client->closed)
+      drop_client(client);
+    return;
+  }
+
+  // The text is copied before anything runs, so the buffer may grow meanwhile
+  check_jobs();
+  client->running = 1;
+  int result = serve_request(client->source.fd, client->in.data + start, len, capture, arena, run_arena);
+  client->running = 0;
+  client->pos = start + len;
+  if (result != 1)
+    drop_client(client);
+  else if (client->closed || next_request(client, &capture, &start, &len) != 0)
+    queue_client(client);
+}
+
+/**
+ * Runs the shell as a server on a Unix domain socket, serving its clients' requests in turn.
+ * Every request goes through the same parser and executor as script lines, in this
+ * one long-lived shell, so it costs no more than the children it starts.
+ *
+ * @param path The path of the socket, replaced if it already exists.
+ * @return ERROR if the socket could not be set up, otherwise it does not return.
+ */
+int run_server(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "seashell: %s: socket path too long\n", path);
+    return ERROR;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener, SOMAXCONN) == -1)
+  {
+    fprintf(stderr, "seashell: %s: %s\n", path, strerror(errno));
+    if (listener != -1)
+      close(listener);
+    return ERROR;
+  }
+
+  // Writing to a client that has hung up must not kill the server; children get SIGPIPE back
+  signal(SIGPIPE, SIG_IGN);
+
+  // Connections are read as data arrives, requests are run one at a time in order
+  EventSource listen_source = {listener, listener_ready, NULL};
+  if (event_add(&listen_source, EPOLLIN) == ERROR)
+    return ERROR;
+  Arena arena = {0};
+  Arena run_arena = {0};
+  for (;;)
+  {
+    while (!server.head)
+      event_wait(-1);
+    Client *client = server.head;
+    if (!(server.head = client->next))
+      server.tail = NULL;
+    client->queued = 0;
+    serve_client(client, &arena, &run_arena);
+  }
+}
+
+/**
+ * Reads a line of input from standard input.
+ *
+ * @param line A pointer to a heap buffer that is grown as needed and reused across calls.
+ * @param cap A pointer to the capacity of the buffer.
+ * @return The number of characters read, or a status code indicating an error or EOF.
+ */
+ssize_t read_line(char **line, size_t *cap)
+{
+  if (!line || !cap)
+    return ERROR;
+
+  // getline grows the buffer geometrically and keeps it for the next call
+  ssize_t len = getline(line, cap, stdin);
+  if (len != -1)
+    return len;
+  return feof(stdin) ? EOF_REACHED : ERROR;
+}
+
+/**
+ * Reads the next line from a source, prompting for it on a terminal.
+ *
+ * @param src A pointer to the Source to read from.
+ * @param prompt The prompt shown on a terminal.
+ * @param line Set to the start of the line, valid until the next call.
+ * @return The length of the line, or a status code indicating an error or EOF.
+ */
+ssize_t source_line(Source *src, const char *prompt, char **line)
+{
+  if (!src->interactive)
+    return next_line(src->input, line);
+
+  ssize_t len = edit_line(prompt, &src->line, &src->cap);
+  *line = src->line;
+  if (len > 0)
+    history_add(src->line, len);
+  return len;
+}
+
+/**
+ * Finds the HEAD file of the git repository containing a directory, looking upwards
+ * for a `.git` directory, or for a `.git` file saying where the repository is.
+ *
+ * @param cwd The directory to start from.
+ * @return The newly allocated path of HEAD, or NULL if the directory is not in a repository.
+ */
+static char *find_git_head(const char *cwd)
+{
+  char *dir = strdup(cwd);
+  char *head = NULL;
+  while (dir)
+  {
+    char *git;
+    if (asprintf(&git, "%s/.git", strcmp(dir, "/") == 0 ? "" : dir) == -1)
+      break;
+
+    struct stat st;
+    if (stat(git, &st) == 0)
+    {
+      if (S_ISDIR(st.st_mode))
+      {
+        if (asprintf(&head, "%s/HEAD", git) == -1)
+          head = NULL;
+      }
+      else
+      {
+        // Worktrees and submodules have a file pointing to their repository instead
+        char line[PATH_MAX];
+        FILE *file = fopen(git, "re");
+        if (file && fgets(line, sizeof(line), file) && strncmp(line, "gitdir: ", 8) == 0)
+        {
+          line[strcspn(line, "\n")] = '\0';
+          const char *target = line + 8;
+          int len = target[0] == '/' ? asprintf(&head, "%s/HEAD", target) : asprintf(&head, "%s/%s/HEAD", dir, target);
+          if (len == -1)
+            head = NULL;
+        }
+        if (file)
+          fclose(file);
+      }
+      free(git);
+      break;
+    }
+    free(git);
+
+    // Go up a directory, stopping after the root
+    char *slash = strrchr(dir, '/');
+    if (!slash || strcmp(dir, "/") == 0)
+      break;
+    slash[slash == dir] = '\0';
+  }
+  free(dir);
+  return head;
+}
+
+/**
+ * Gets the working directory for the prompt. It is only asked for again after cd.
+ *
+ * @return The working directory, or "?" if it cannot be found.
+ */
+static const char *prompt_cwd(void)
+{
+  if (prompt_cache.cwd_stale || !prompt_cache.cwd)
+  {
+    free(prompt_cache.cwd);
+    prompt_cache.cwd = getcwd(NULL, 0);
+    prompt_cache.cwd_stale = 0;
+    prompt_cache.head_stale = 1;
+  }
+  return prompt_cache.cwd ? prompt_cache.cwd : "?";
+}
+
+/**
+ * Gets the current git branch for the prompt. HEAD is only read again when its
+ * modification time or inode has changed, and the repository is only looked for
+ * again after the working directory has changed.
+ *
+ * @return The branch name, a short commit id when HEAD is detached, or "" outside a repository.
+ */
+static const char *prompt_branch(void)
+{
+  if (prompt_cache.head_stale)
+  {
+    free(prompt_cache.head);
+    prompt_cache.head = prompt_cache.cwd ? find_git_head(prompt_cache.cwd) : NULL;
+    prompt_cache.head_stale = 0;
+    prompt_cache.head_ino = 0;
+    prompt_cache.branch[0] = '\0';
+  }
+
+  struct stat st;
+  if (!prompt_cache.head || stat(prompt_cache.head, &st) == -1)
+  {
+    prompt_cache.branch[0] = '\0';
+    return prompt_cache.branch;
+  }
+  if (st.st_ino == prompt_cache.head_ino && st.st_mtim.tv_sec == prompt_cache.head_mtime.tv_sec &&
+      st.st_mtim.tv_nsec == prompt_cache.head_mtime.tv_nsec)
+    return prompt_cache.branch;
+
+  prompt_cache.branch[0] = '\0';
+  char line[256];
+  int fd = open(prompt_cache.head, O_RDONLY | O_CLOEXEC);
+  ssize_t got = fd == -1 ? -1 : read(fd, line, sizeof(line) - 1);
+  if (fd != -1)
+    close(fd);
+  if (got > 0)
+  {
+    line[got] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: refs/heads/", 16) == 0)
+      snprintf(prompt_cache.branch, sizeof(prompt_cache.branch), "%s", line + 16);
+    else
+      snprintf(prompt_cache.branch, sizeof(prompt_cache.branch), "%.7s", line);
+  }
+  prompt_cache.head_ino = st.st_ino;
+  prompt_cache.head_mtime = st.st_mtim;
+  return prompt_cache.branch;
+}
+
+/**
+ * Renders the prompt from `$SEASHELL_PROMPT`. Each escape is filled in from a cached
+ * segment, and only the segments the prompt uses are ever computed:
+ *
+ *   \w  working directory, with $HOME shown as ~     \W  its last component
+ *   \g  git branch, read from HEAD without running git
+ *   \?  exit status of the last command              \t  time as HH:MM:SS
+ *   \u  user name    \h  host name    \$  # for root, otherwise $
+ *   \e  escape, for colors    \\  a backslash    \[ \]  ignored, as bash needs them
+ *
+ * @return The prompt, valid until the next call.
+ */
+const char *render_prompt(void)
+{
+  const char *format = env_get(PROMPT_VAR);
+  if (!format)
+    return DEFAULT_PROMPT;
+
+  Buffer *out = &prompt_cache.text;
+  out->len = 0;
+  for (const char *p = format; *p; p++)
+  {
+    if (*p != '\\' || !p[1])
+    {
+      buffer_add(out, p, 1);
+      continue;
+    }
+
+    char text[64];
+    const char *segment = text;
+    text[0] = '\0';
+    switch (*++p)
+    {
+    case 'w':
+    case 'W':
+      segment = prompt_cwd();
+      if (*p == 'W' && strcmp(segment, "/") != 0 && strrchr(segment, '/'))
+        segment = strrchr(segment, '/') + 1;
+      else if (*p == 'w')
+      {
+        const char *home = env_get("HOME");
+        size_t home_len = home ? strlen(home) : 0;
+        if (home_len > 1 && strncmp(segment, home, home_len) == 0 &&
+            (segment[home_len] == '/' || segment[home_len] == '\0'))
+        {
+          buffer_add(out, "~", 1);
+          segment += home_len;
+        }
+      }
+      break;
+    case 'g':
+      prompt_cwd();
+      segment = prompt_branch();
+      break;
+    case '?':
+      snprintf(text, sizeof(text), "%d", last_status);
+      break;
+    case 't':
+    {
+      time_t now = time(NULL);
+      struct tm tm;
+      strftime(text, sizeof(text), "%H:%M:%S", localtime_r(&now, &tm));
+      break;
+    }
+    case 'u':
+      if (!prompt_cache.user[0])
+      {
+        struct passwd *pw = getpwuid(geteuid());
+        snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s", pw ? pw->pw_name : "?");
+      }
+      segment = prompt_cache.user;
+      break;
+    case 'h':
+      if (!prompt_cache.host[0] && gethostname(prompt_cache.host, sizeof(prompt_cache.host) - 1) == 0)
+        prompt_cache.host[strcspn(prompt_cache.host, ".")] = '\0';
+      segment = prompt_cache.host;
+      break;
+    case '$':
+      segment = geteuid() == 0 ? "#" : "$";
+      break;
+    case 'e':
+      segment = "\x1b";
+      break;
+    case '\\':
+      segment = "\\";
+      break;
+    case '[':
+    case ']':
+      // bash marks where escape sequences start and end, which is not needed here
+      segment = "";
+      break;
+    default:
+      text[0] = '\\';
+      text[1] = *p;
+      text[2] = '\0';
+    }
+    buffer_add(out, segment, strlen(segment));
+  }
+  return out->data ? out->data : "";
+}
+
+/**
+ * Opens a script file for reading. Regular files are memory-mapped whole,
+ * anything else is read in large blocks.
+ *
+ * @param in A pointer to the Input to be set up.
+ * @param path The path of the script file.
+ * @return 1 on success, otherwise ERROR with errno set.
+ */
+int open_script(Input *in, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return ERROR;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    // A private writable mapping lets the tokenizer terminate lines in place
+    void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+      close(fd);
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      in->data = data;
+      in->len = in->mapped = st.st_size;
+      return 1;
+    }
+  }
+  in->fd = fd;
+  return 1;
+}
+
+/**
+ * Sets up input from an in-memory string, as given to `-c`.
+ *
+ * @param in A pointer to the Input to be set up.
+ * @param text The NUL terminated script text. It is modified in place.
+ */
+void open_string(Input *in, char *text)
+{
+  in->data = text;
+  in->len = strlen(text);
+}
+
+/**
+ * Finds the next line of a script without copying it.
+ * The newline is replaced with a NUL, so the line can be tokenized in place.
+ * The line stays valid until the next call.
+ *
+ * @param in A pointer to the Input to read from.
+ * @param line Set to the start of the line.
+ * @return The length of the line, or a status code indicating an error or EOF.
+ */
+ssize_t next_line(Input *in, char **line)
+{
+  for (;;)
+  {
+    char *start = in->data + in->pos;
+    size_t avail = in->len - in->pos;
+    char *newline = avail ? memchr(start, '\n', avail) : NULL;
+
+    if (newline)
+    {
+      *newline = '\0';
+      in->pos += newline - start + 1;
+      *line = start;
+      return newline - start;
+    }
+
+    if (in->fd == -1)
+    {
+      if (avail == 0)
+        return EOF_REACHED;
+
+      // Unterminated last line: mappings may end exactly on a page boundary
+      in->pos = in->len;
+      if (!in->mapped)
+      {
+        start[avail] = '\0';
+        *line = start;
+        return avail;
+      }
+      if (!(in->tail = malloc(avail + 1)))
+        return ERROR;
+      memcpy(in->tail, start, avail);
+      in->tail[avail] = '\0';
+      *line = in->tail;
+      return avail;
+    }
+
+    // Move the partial line to the front, growing the buffer if it is already full
+    if (in->pos > 0)
+    {
+      memmove(in->data, start, avail);
+      in->len = avail;
+      in->pos = 0;
+    }
+    if (in->len + 1 >= in->cap)
+    {
+      size_t cap = in->cap ? in->cap * 2 : SCRIPT_BLOCK;
+      char *data = realloc(in->data, cap);
+      if (!data)
+        return ERROR;
+      in->data = data;
+      in->cap = cap;
+    }
+
+    ssize_t got = read(in->fd, in->data + in->len, in->cap - in->len - 1);
+    if (got == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return ERROR;
+    }
+    if (got == 0)
+    {
+      if (in->fd > STDIN_FILENO)
+        close(in->fd);
+      in->fd = -1;
+      continue;
+    }
+    in->len += got;
+  }
+}
+
+/**
+ * Releases the resources held by an Input.
+ *
+ * @param in A pointer to the Input to be closed.
+ */
+void close_input(Input *in)
+{
+  if (in->mapped)
+    munmap(in->data, in->mapped);
+  else if (in->cap)
+    free(in->data);
+  if (in->fd > STDIN_FILENO)
+    close(in->fd);
+  free(in->tail);
+  in->tail = NULL;
+}
+
+/**
+ * Opens the history file, `$HISTFILE` or `~/.seashell_history`, for appending.
+ * It is only mapped once the history is first read.
+ */
+void history_open(void)
+{
+  const char *path = env_get("HISTFILE");
+  char *built = NULL;
+  if (!path || !*path)
+  {
+    const char *home = env_get("HOME");
+    if (!home || !*home || asprintf(&built, "%s/%s", home, HISTORY_FILE) == -1)
+      return;
+    path = built;
+  }
+
+  // Every entry is appended with one write, so concurrent shells never interleave or truncate
+  history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (history.fd == -1)
+    fprintf(stderr, "seashell: %s: %s\n", path, strerror(errno));
+  free(built);
+}
+
+/**
+ * Picks the bucket of the trigram index for the three bytes at some text.
+ *
+ * @param text The trigram.
+ * @return The bucket.
+ */
+static unsigned int trigram_bucket(const char *text)
+{
+  unsigned int trigram = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+  return (trigram * 2654435761u) >> 16;
+}
+
+/**
+ * Drops the trigram index of the history, which sends searches back to scanning every entry.
+ */
+static void history_drop_trigrams(void)
+{
+  if (!history.trigrams)
+    return;
+  for (size_t i = 0; i < HISTORY_TRIGRAMS; i++)
+    free(history.trigrams[i].entries);
+  free(history.trigrams);
+  history.trigrams = NULL;
+}
+
+/**
+ * Adds a history entry to the posting of each of its trigrams, once per posting.
+ * Entries are indexed in order, so every posting stays sorted.
+ *
+ * @param index The index of the entry.
+ * @param text The text of the entry.
+ * @param len The length of the entry.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int history_index(size_t index, const char *text, size_t len)
+{
+  for (size_t i = 0; i + 3 <= len; i++)
+  {
+    Posting *posting = &history.trigrams[trigram_bucket(text + i)];
+    if (posting->count && posting->entries[posting->count - 1] == index)
+      continue;
+    if (posting->count == posting->cap)
+    {
+      size_t cap = posting->cap ? posting->cap * 2 : 4;
+      unsigned int *entries = realloc(posting->entries, cap * sizeof(unsigned int));
+      if (!entries)
+        return ERROR;
+      posting->entries = entries;
+      posting->cap = cap;
+    }
+    posting->entries[posting->count++] = index;
+  }
+  return 1;
+}
+
+/**
+ * Maps whatever has been appended to the history file since it was last read,
+ * by this shell or any other, and indexes the new entries: their offsets, and the
+ * trigrams they hold, so a ^R search only looks at entries that can match.
+ *
+ * @return 1 on success, otherwise ERROR.
+ */
+static int history_sync(void)
+{
+  struct stat st;
+  if (history.fd == -1 || fstat(history.fd, &st) == -1)
+    return ERROR;
+  size_t size = st.st_size;
+  if (size <= history.mapped)
+    return 1;
+
+  void *data = history.data ? mremap(history.data, history.mapped, size, MREMAP_MAYMOVE)
+                            : mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+  if (data == MAP_FAILED)
+    return ERROR;
+  history.data = data;
+  history.mapped = size;
+  if (history.count == 0 && !history.trigrams)
+    history.trigrams = calloc(HISTORY_TRIGRAMS, sizeof(Posting));
+
+  // Only complete entries are indexed; one still being written is picked up next time
+  for (;;)
+  {
+    char *start = history.data + history.indexed;
+    char *newline = memchr(start, '\n', size - history.indexed);
+    if (!newline)
+      break;
+    if (history.count == history.cap)
+    {
+      size_t cap = history.cap ? history.cap * 2 : 1024;
+      size_t *lines = realloc(history.lines, cap * sizeof(size_t));
+      if (!lines)
+        return ERROR;
+      history.lines = lines;
+      history.cap = cap;
+    }
+    // Without room for its trigrams, the index is dropped rather than left incomplete
+    if (history.trigrams && history_index(history.count, start, newline - start) == ERROR)
+      history_drop_trigrams();
+    history.lines[history.count++] = history.indexed;
+    history.indexed = newline + 1 - history.data;
+  }
+  return 1;
+}
+
+/**
+ * Appends a line typed at the terminal to the history. Blank lines and repeats of
+ * the previous line are skipped.
+ *
+ * @param line The line, with or without its newline.
+ * @param len The length of the line.
+ */
+void history_add(const char *line, size_t len)
+{
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    len--;
+  if (history.fd == -1 || len == strspn(line, " \t") || len >= HISTORY_MAX_LINE)
+    return;
+  if (history.last && strlen(history.last) == len && memcmp(history.last, line, len) == 0)
+    return;
+
+  struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+  if (writev(history.fd, iov, 2) != (ssize_t)len + 1)
+    return;
+
+  free(history.last);
+  history.last = strndup(line, len);
+}
+
+/**
+ * Gets the number of history entries, including those added by other shells.
+ *
+ * @return The number of entries.
+ */
+size_t history_count(void)
+{
+  history_sync();
+  return history.count;
+}
+
+/**
+ * Gets a history entry. It points into the mapping and is not NUL terminated.
+ *
+ * @param index The index of the entry, the oldest being 0.
+ * @param len Set to the length of the entry.
+ * @return A pointer to the text of the entry.
+ */
+const char *history_entry(size_t index, size_t *len)
+{
+  size_t start = history.lines[index];
+  size_t end = index + 1 < history.count ? history.lines[index + 1] : history.indexed;
+  *len = end - start - 1;
+  return history.data + start;
+}
+
+/**
+ * Finds the newest history entry before the given one that contains some text.
+ * The entries holding every trigram of the text are among those of the trigram
+ * with the shortest posting, so only those are checked. Text too short to have a
+ * trigram is looked for in every entry, where it usually turns up soon.
+ *
+ * @param needle The text to be searched for.
+ * @param before The index to search back from, exclusive.
+ * @return The index of the matching entry, or -1 if there is none.
+ */
+ssize_t history_search(const char *needle, size_t before)
+{
+  size_t needle_len = strlen(needle);
+  if (before > history.count)
+    before = history.count;
+
+  const Posting *shortest = NULL;
+  for (size_t i = 0; history.trigrams && i + 3 <= needle_len; i++)
+  {
+    const Posting *posting = &history.trigrams[trigram_bucket(needle + i)];
+    if (!shortest || posting->count < shortest->count)
+      shortest = posting;
+  }
+  if (shortest)
+  {
+    // Binary search for the first candidate not before the starting entry
+    size_t lo = 0, hi = shortest->count;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (shortest->entries[mid] < before)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    while (lo-- > 0)
+    {
+      size_t len;
+      const char *entry = history_entry(shortest->entries[lo], &len);
+      if (memmem(entry, len, needle, needle_len))
+        return shortest->entries[lo];
+    }
+    return -1;
+  }
+
+  while (before-- > 0)
+  {
+    size_t len;
+    const char *entry = history_entry(before, &len);
+    if (memmem(entry, len, needle, needle_len))
+      return before;
+  }
+  return -1;
+}
+
+/**
+ * Releases the history mapping and index.
+ */
+void history_close(void)
+{
+  if (history.data)
+    munmap(history.data, history.mapped);
+  if (history.fd != -1)
+    close(history.fd);
+  free(history.lines);
+  free(history.last);
+  history_drop_trigrams();
+  history = (History){-1, NULL, 0, NULL, 0, 0, 0, NULL, NULL};
+}
+
+/**
+ * Inserts bytes into a buffer, growing it as needed. The buffer stays NUL terminated.
+ *
+ * @param b A pointer to the Buffer.
+ * @param at The offset to insert at.
+ * @param data The bytes to be inserted.
+ * @param len The number of bytes.
+ * @return 1 on success, otherwise ERROR.
+ */
+int buffer_insert(Buffer *b, size_t at, const char *data, size_t len)
+{
+  if (b->len + len + 1 > b->cap)
+  {
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + len + 1)
+      cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (!grown)
+      return ERROR;
+    b->data = grown;
+    b->cap = cap;
+  }
+  memmove(b->data + at + len, b->data + at, b->len - at);
+  memcpy(b->data + at, data, len);
+  b->len += len;
+  b->data[b->len] = '\0';
+  return 1;
+}
+
+/**
+ * Appends bytes to a buffer.
+ *
+ * @param b A pointer to the Buffer.
+ * @param data The bytes to be appended.
+ * @param len The number of bytes.
+ * @return 1 on success, otherwise ERROR.
+ */
+int buffer_add(Buffer *b, const char *data, size_t len)
+{
+  return buffer_insert(b, b->len, data, len);
+}
+
+/**
+ * Measures the terminal escape sequence starting at some text, such as a color
+ * change in the prompt.
+ *
+ * @param s The text.
+ * @param len The length of the text in bytes.
+ * @return The length of the escape sequence, or 0 if the text does not start with one.
+ */
+static size_t escape_length(const char *s, size_t len)
+{
+  if (len < 2 || s[0] != '\x1b')
+    return 0;
+  if (s[1] != '[')
+    return 2;
+
+  // A CSI sequence runs up to its final byte
+  size_t i = 2;
+  while (i < len && (s[i] < 0x40 || s[i] > 0x7e))
+    i++;
+  return i < len ? i + 1 : len;
+}
+
+/**
+ * Counts the terminal columns taken by UTF-8 text, one per character. Escape
+ * sequences take none.
+ *
+ * @param s The text.
+ * @param len The length of the text in bytes.
+ * @return The number of columns.
+ */
+static size_t text_columns(const char *s, size_t len)
+{
+  size_t cols = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    size_t escape = escape_length(s + i, len - i);
+    if (escape)
+      i += escape - 1;
+    else
+      cols += (s[i] & 0xc0) != 0x80;
+  }
+  return cols;
+}
+
+/**
+ * Finds the start of the character before an offset of the edited line.
+ *
+ * @param pos The offset.
+ * @return The offset of the previous character, or 0.
+ */
+static size_t editor_prev(size_t pos)
+{
+  while (pos > 0 && (editor.text.data[--pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+/**
+ * Finds the start of the character after an offset of the edited line.
+ *
+ * @param pos The offset.
+ * @return The offset of the next character, or the length of the line.
+ */
+static size_t editor_next(size_t pos)
+{
+  while (pos < editor.text.len && (editor.text.data[++pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+/**
+ * Writes out the pending terminal output in one call.
+ */
+static void editor_flush(void)
+{
+  size_t done = 0;
+  while (done < editor.out.len)
+  {
+    ssize_t wrote = write(STDOUT_FILENO, editor.out.data + done, editor.out.len - done);
+    if (wrote == -1 && errno == EINTR)
+      continue;
+    if (wrote <= 0)
+      break;
+    done += wrote;
+  }
+  editor.out.len = 0;
+}
+
+/**
+ * Queues the escape sequences that move the terminal cursor to a column, counted
+ * from the start of the prompt across wrapped rows.
+ *
+ * @param to The column to move to.
+ */
+static void editor_move(size_t to)
+{
+  size_t cols = editor.cols;
+  size_t from = editor.cursor;
+  char seq[32];
+  int len = 0;
+  if (to == from)
+    return;
+
+  if (to / cols == from / cols)
+    len = snprintf(seq, sizeof(seq), to < from ? "\x1b[%zuD" : "\x1b[%zuC", to < from ? from - to : to - from);
+  else
+  {
+    size_t up = from / cols > to / cols ? from / cols - to / cols : 0;
+    size_t down = to / cols > from / cols ? to / cols - from / cols : 0;
+    len = snprintf(seq, sizeof(seq), up ? "\x1b[%zuA\r" : "\x1b[%zuB\r", up ? up : down);
+    if (to % cols)
+      len += snprintf(seq + len, sizeof(seq) - len, "\x1b[%zuC", to % cols);
+  }
+  buffer_add(&editor.out, seq, len);
+  editor.cursor = to;
+}
+
+/**
+ * Brings the terminal up to date with the line. Only the part after the first
+ * character that differs from what is shown is rewritten, and everything goes out
+ * in a single write.
+ */
+static void editor_refresh(void)
+{
+  Buffer *view = &editor.view;
+  view->len = 0;
+  if (editor.searching)
+  {
+    const char *failed = editor.match == -1 && editor.query.len ? "failed " : "";
+    buffer_add(view, "(", 1);
+    buffer_add(view, failed, strlen(failed));
+    buffer_add(view, "reverse-i-search)`", 18);
+    buffer_add(view, editor.query.data ? editor.query.data : "", editor.query.len);
+    buffer_add(view, "': ", 3);
+  }
+  else
+    buffer_add(view, editor.prompt, strlen(editor.prompt));
+  size_t target = view->len + editor.pos;
+  buffer_add(view, editor.text.data ? editor.text.data : "", editor.text.len);
+
+  // Skip what the terminal already shows, backing up to the start of a character
+  Buffer *shown = &editor.shown;
+  size_t same = 0;
+  while (same < shown->len && same < view->len && shown->data[same] == view->data[same])
+    same++;
+  while (same > 0 && same < view->len && (view->data[same] & 0xc0) == 0x80)
+    same--;
+
+  // or of an escape sequence
+  for (size_t i = 0; i < same; i++)
+  {
+    size_t escape = escape_length(view->data + i, view->len - i);
+    if (escape && i + escape > same)
+      same = i;
+    else if (escape)
+      i += escape - 1;
+  }
+
+  if (same < view->len || same < shown->len)
+  {
+    size_t shown_cols = text_columns(shown->data, shown->len);
+    editor_move(text_columns(view->data, same));
+    buffer_add(&editor.out, view->data + same, view->len - same);
+    editor.cursor = text_columns(view->data, view->len);
+
+    // Ending on the last column leaves the cursor there until the next character, so wrap now
+    if (same < view->len && editor.cursor % editor.cols == 0)
+      buffer_add(&editor.out, "\n", 1);
+    if (shown_cols > editor.cursor)
+      buffer_add(&editor.out, "\x1b[J", 3);
+
+    shown->len = 0;
+    buffer_add(shown, view->data, view->len);
+  }
+  editor_move(text_columns(view->data, target));
+  editor_flush();
+}
+
+/**
+ * Gets the next byte typed, reading a whole batch of input at a time.
+ *
+ * @return The byte, or -1 at EOF or on errors.
+ */
+static int editor_key(void)
+{
+  if (editor.key_pos == editor.key_len)
+  {
+    // Background jobs are reaped while the shell waits for keys
+    ssize_t got = -1;
+    while (event_wait_readable(STDIN_FILENO) == 1 &&
+           (got = read(STDIN_FILENO, editor.keys, sizeof(editor.keys))) == -1 && errno == EINTR)
+      ;
+    if (got <= 0)
+      return -1;
+    editor.key_len = got;
+    editor.key_pos = 0;
+  }
+  return (unsigned char)editor.keys[editor.key_pos++];
+}
+
+/**
+ * Replaces the edited line, leaving the cursor at its end.
+ *
+ * @param text The new text.
+ * @param len The length of the text.
+ */
+static void editor_set(const char *text, size_t len)
+{
+  editor.text.len = 0;
+  buffer_add(&editor.text, text, len);
+  editor.pos = editor.text.len;
+}
+
+/**
+ * Shows the previous or next history entry, keeping the line being typed for when
+ * the newest entry is passed again.
+ *
+ * @param older Whether to go back in the history.
+ */
+static void editor_history(int older)
+{
+  if (older ? editor.entry == 0 : editor.entry >= editor.newest)
+    return;
+  if (editor.entry == editor.newest)
+  {
+    editor.draft.len = 0;
+    buffer_add(&editor.draft, editor.text.data ? editor.text.data : "", editor.text.len);
+  }
+
+  editor.entry += older ? -1 : 1;
+  if (editor.entry == editor.newest)
+    editor_set(editor.draft.data, editor.draft.len);
+  else
+  {
+    size_t len;
+    const char *entry = history_entry(editor.entry, &len);
+    editor_set(entry, len);
+  }
+}
+
+/**
+ * Searches back from a history entry for the ^R query, showing the match.
+ *
+ * @param before The entry to search back from, exclusive.
+ */
+static void editor_search(size_t before)
+{
+  ssize_t found = history_search(editor.query.data ? editor.query.data : "", before);
+  if (found == -1)
+  {
+    editor.match = -1;
+    return;
+  }
+
+  size_t len;
+  const char *entry = history_entry(found, &len);
+  editor_set(entry, len);
+  editor.match = found;
+  const char *at = memmem(entry, len, editor.query.data, editor.query.len);
+  editor.pos = at ? (size_t)(at - entry) : len;
+}
+
+/**
+ * Handles a key typed during a ^R search.
+ *
+ * @param c The key.
+ * @return 1 if the search consumed the key, 0 if it ended and the key is still to be handled.
+ */
+static int editor_search_key(int c)
+{
+  if (c == 18) // ^R finds the next older match
+    editor_search(editor.match == -1 ? editor.newest : (size_t)editor.match);
+  else if (c == 7 || c == 3) // ^G and ^C give up, bringing the line back
+  {
+    editor.searching = 0;
+    editor_set(editor.draft.data, editor.draft.len);
+  }
+  else if (c == 127 || c == 8)
+  {
+    editor.query.len = editor.query.len ? editor.query.len - 1 : 0;
+    editor.query.data[editor.query.len] = '\0';
+    editor.match = -1;
+    if (editor.query.len)
+      editor_search(editor.newest);
+    else
+      editor_set(editor.draft.data, editor.draft.len);
+  }
+  else if (c >= 32 && c != 127)
+  {
+    char ch = c;
+    buffer_add(&editor.query, &ch, 1);
+    editor_search(editor.match == -1 ? editor.newest : (size_t)editor.match + 1);
+  }
+  else
+  {
+    // Any other key keeps the match for editing and then does what it normally does
+    editor.searching = 0;
+    if (editor.match != -1)
+      editor.entry = editor.match;
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Decodes the rest of an escape sequence sent by a cursor or editing key.
+ *
+ * @return The control key the sequence stands for, or 0 if it is not bound.
+ */
+static int editor_escape(void)
+{
+  int c = editor_key();
+  if (c != '[' && c != 'O')
+    return 0;
+
+  int final = editor_key();
+  int number = 0;
+  while (final >= '0' && final <= '9')
+  {
+    number = number * 10 + final - '0';
+    final = editor_key();
+  }
+  switch (final)
+  {
+  case 'A':
+    return 16; // Like ^P
+  case 'B':
+    return 14; // ^N
+  case 'C':
+    return 6; // ^F
+  case 'D':
+    return 2; // ^B
+  case 'H':
+    return 1; // ^A
+  case 'F':
+    return 5; // ^E
+  case '~':
+    return number == 1 || number == 7 ? 1 : number == 4 || number == 8 ? 5 : number == 3 ? 4 : 0;
+  }
+  return 0;
+}
+
+/**
+ * Adds a candidate to a set of completion matches.
+ *
+ * @param m A pointer to the Matches.
+ * @param text The candidate.
+ * @param len The length of the candidate.
+ */
+void add_match(Matches *m, const char *text, size_t len)
+{
+  if (m->count == m->cap)
+  {
+    size_t cap = m->cap ? m->cap * 2 : 64;
+    char **items = realloc(m->items, cap * sizeof(char *));
+    if (!items)
+      return;
+    m->items = items;
+    m->cap = cap;
+  }
+  char *item = strndup(text, len);
+  if (item)
+    m->items[m->count++] = item;
+}
+
+/**
+ * Collects the files whose paths start with a word. Directories get a trailing slash.
+ *
+ * @param word The word to be completed.
+ * @param m A pointer to the Matches the paths are added to.
+ */
+static void complete_files(const char *word, Matches *m)
+{
+  const char *slash = strrchr(word, '/');
+  size_t dir_len = slash ? (size_t)(slash - word + 1) : 0;
+  const char *base = word + dir_len;
+  size_t base_len = strlen(base);
+
+  char *dir_name = dir_len ? strndup(word, dir_len) : NULL;
+  DIR *dir = opendir(dir_name ? dir_name : ".");
+  if (!dir)
+  {
+    free(dir_name);
+    return;
+  }
+
+  Buffer item = {NULL, 0, 0};
+  struct dirent *ent;
+  while ((ent = readdir(dir)))
+  {
+    const char *name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (name[0] == '.' && base[0] != '.') ||
+        strncmp(name, base, base_len) != 0)
+      continue;
+
+    item.len = 0;
+    buffer_add(&item, word, dir_len);
+    buffer_add(&item, name, strlen(name));
+
+    struct stat st;
+    int is_dir = ent->d_type == DT_DIR;
+    if ((ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) && stat(item.data, &st) == 0)
+      is_dir = S_ISDIR(st.st_mode);
+    if (is_dir)
+      buffer_add(&item, "/", 1);
+    add_match(m, item.data, item.len);
+  }
+  closedir(dir);
+  free(item.data);
+  free(dir_name);
+}
+
+/**
+ * Lists completion matches below the line, in columns, and has the line drawn again under them.
+ *
+ * @param m A pointer to the sorted Matches.
+ */
+static void editor_list(Matches *m)
+{
+  editor_move(text_columns(editor.shown.data, editor.shown.len));
+  buffer_add(&editor.out, "\n", 1);
+
+  if (m->count > COMPLETION_LIST_MAX)
+  {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%zu possibilities\n", m->count);
+    buffer_add(&editor.out, line, len);
+  }
+  else
+  {
+    // Items are shown without their directory, and laid out down the columns
+    size_t width = 0;
+    for (size_t i = 0; i < m->count; i++)
+    {
+      const char *slash = strrchr(m->items[i], '/');
+      const char *shown = slash && slash[1] ? slash + 1 : m->items[i];
+      size_t len = text_columns(shown, strlen(shown));
+      width = len > width ? len : width;
+    }
+    width += 2;
+    size_t per_row = editor.cols / width ? editor.cols / width : 1;
+    size_t rows = (m->count + per_row - 1) / per_row;
+    for (size_t r = 0; r < rows; r++)
+    {
+      for (size_t i = r; i < m->count; i += rows)
+      {
+        const char *slash = strrchr(m->items[i], '/');
+        const char *shown = slash && slash[1] ? slash + 1 : m->items[i];
+        size_t len = strlen(shown);
+        buffer_add(&editor.out, shown, len);
+        for (size_t pad = text_columns(shown, len); i + rows < m->count && pad < width; pad++)
+          buffer_add(&editor.out, " ", 1);
+      }
+      buffer_add(&editor.out, "\n", 1);
+    }
+  }
+  editor.shown.len = 0;
+  editor.cursor = 0;
+}
+
+/**
+ * Completes the word before the cursor: a command name at the start of a command,
+ * otherwise a file name. The common prefix of the matches is inserted, and when
+ * there is nothing left to insert the matches are listed.
+ */
+static void editor_complete(void)
+{
+  const char *text = editor.text.data ? editor.text.data : "";
+
+  // Find where the word before the cursor starts, scanning as the lexer would
+  size_t start = 0;
+  char quote = '\0';
+  for (size_t i = 0; i < editor.pos; i++)
+  {
+    if (quote)
+      quote = text[i] == quote ? '\0' : quote;
+    else if (text[i] == '\\')
+      i++;
+    else if (text[i] == '\'' || text[i] == '"')
+      quote = text[i];
+    else if (char_class[(unsigned char)text[i]] & (CC_SPACE | CC_OPERATOR))
+      start = i + 1;
+  }
+  size_t before = start;
+  while (before > 0 && char_class[(unsigned char)text[before - 1]] & CC_SPACE)
+    before--;
+  int command = before == 0 || (char_class[(unsigned char)text[before - 1]] & CC_OPERATOR &&
+                                text[before - 1] != '<' && text[before - 1] != '>');
+
+  // The matches are compared against the word with its quoting removed
+  char *word = malloc(editor.pos - start + 1);
+  if (!word)
+    return;
+  size_t len = 0;
+  quote = '\0';
+  for (size_t i = start; i < editor.pos; i++)
+  {
+    if (quote ? text[i] == quote : text[i] == '\'' || text[i] == '"')
+      quote = quote ? '\0' : text[i];
+    else if (!quote && text[i] == '\\' && i + 1 < editor.pos)
+      word[len++] = text[++i];
+    else
+      word[len++] = text[i];
+  }
+  word[len] = '\0';
+
+  Matches m = {NULL, 0, 0};
+  if (command && !strchr(word, '/'))
+  {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+      if (strncmp(builtins[i].name, word, len) == 0)
+        add_match(&m, builtins[i].name, strlen(builtins[i].name));
+    }
+    path_index_refresh();
+    path_index_complete(word, &m);
+  }
+  else
+    complete_files(word, &m);
+
+  // The same command may be in several directories
+  qsort(m.items, m.count, sizeof(char *), compare_names);
+  size_t unique = 0;
+  for (size_t i = 0; i < m.count; i++)
+  {
+    if (unique && strcmp(m.items[unique - 1], m.items[i]) == 0)
+      free(m.items[i]);
+    else
+      m.items[unique++] = m.items[i];
+  }
+  m.count = unique;
+
+  if (m.count == 0)
+    buffer_add(&editor.out, "\a", 1);
+  else
+  {
+    size_t common = strlen(m.items[0]);
+    for (size_t i = 1; i < m.count; i++)
+    {
+      size_t j = 0;
+      while (j < common && m.items[i][j] == m.items[0][j])
+        j++;
+      common = j;
+    }
+
+    // Insert the rest of the common prefix, quoting what the lexer would split on
+    const char *done = m.items[0];
+    for (size_t i = len; i < common; i++)
+    {
+      if (!quote && (char_class[(unsigned char)done[i]] || (i == 0 && done[i] == '#')))
+        buffer_insert(&editor.text, editor.pos++, "\\", 1);
+      buffer_insert(&editor.text, editor.pos++, &done[i], 1);
+    }
+    if (m.count == 1 && done[common - 1] != '/')
+    {
+      if (quote)
+        buffer_insert(&editor.text, editor.pos++, &quote, 1);
+      buffer_insert(&editor.text, editor.pos++, " ", 1);
+    }
+    else if (m.count > 1 && common == len)
+      editor_list(&m);
+  }
+
+  for (size_t i = 0; i < m.count; i++)
+    free(m.items[i]);
+  free(m.items);
+  free(word);
+}
+
+/**
+ * Reads a line from the terminal with the built-in line editor. The terminal is put
+ * into raw mode for as long as the line is edited. Without a usable terminal the
+ * line is read in cooked mode instead.
+ *
+ * @param prompt The prompt shown in front of the line.
+ * @param line A pointer to a heap buffer that receives the line and its newline.
+ * @param cap A pointer to the capacity of the buffer.
+ * @return The length of the line, INTERRUPTED after ^C, or a status code indicating an error or EOF.
+ */
+ssize_t edit_line(const char *prompt, char **line, size_t *cap)
+{
+  const char *term = env_get("TERM");
+  struct termios cooked, raw;
+  struct winsize ws;
+  fflush(stdout);
+  if (!isatty(STDOUT_FILENO) || (term && strcmp(term, "dumb") == 0) || tcgetattr(STDIN_FILENO, &cooked) == -1)
+  {
+    printf("%s", prompt);
+    fflush(stdout);
+    return read_line(line, cap);
+  }
+
+  // Keys, ^C and ^Z included, arrive one by one and unechoed; output processing stays on
+  raw = cooked;
+  raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  editor.prompt = prompt;
+  editor.text.len = editor.shown.len = editor.cursor = editor.pos = 0;
+  editor.searching = 0;
+  editor.newest = editor.entry = history_count();
+
+  ssize_t result = 0;
+  for (;;)
+  {
+    // Redraw only once the keys read so far, a whole paste say, have been handled
+    if (editor.key_pos == editor.key_len)
+      editor_refresh();
+    int c = editor_key();
+    if (c == -1)
+    {
+      result = EOF_REACHED;
+      break;
+    }
+    if (editor.searching && editor_search_key(c))
+      continue;
+    if (c == 27)
+      c = editor_escape();
+
+    if (c == '\r' || c == '\n')
+      break;
+    else if (c == 3) // ^C throws the line away
+    {
+      result = INTERRUPTED;
+      break;
+    }
+    else if (c == 4 && editor.text.len == 0) // ^D on an empty line
+    {
+      result = EOF_REACHED;
+      break;
+    }
+    else if (c == 4 && editor.pos < editor.text.len)
+    {
+      size_t next = editor_next(editor.pos);
+      memmove(editor.text.data + editor.pos, editor.text.data + next, editor.text.len - next + 1);
+      editor.text.len -= next - editor.pos;
+    }
+    else if ((c == 127 || c == 8) && editor.pos > 0)
+    {
+      size_t prev = editor_prev(editor.pos);
+      memmove(editor.text.data + prev, editor.text.data + editor.pos, editor.text.len - editor.pos + 1);
+      editor.text.len -= editor.pos - prev;
+      editor.pos = prev;
+    }
+    else if (c == 23 && editor.pos > 0) // ^W deletes the word before the cursor
+    {
+      size_t start = editor.pos;
+      while (start > 0 && editor.text.data[start - 1] == ' ')
+        start--;
+      while (start > 0 && editor.text.data[start - 1] != ' ')
+        start--;
+      memmove(editor.text.data + start, editor.text.data + editor.pos, editor.text.len - editor.pos + 1);
+      editor.text.len -= editor.pos - start;
+      editor.pos = start;
+    }
+    else if (c == 21 && editor.pos > 0) // ^U deletes before the cursor
+    {
+      memmove(editor.text.data, editor.text.data + editor.pos, editor.text.len - editor.pos + 1);
+      editor.text.len -= editor.pos;
+      editor.pos = 0;
+    }
+    else if (c == 11 && editor.pos < editor.text.len) // ^K deletes after it
+    {
+      editor.text.len = editor.pos;
+      editor.text.data[editor.pos] = '\0';
+    }
+    else if (c == 1)
+      editor.pos = 0;
+    else if (c == 5)
+      editor.pos = editor.text.len;
+    else if (c == 2)
+      editor.pos = editor_prev(editor.pos);
+    else if (c == 6 && editor.pos < editor.text.len)
+      editor.pos = editor_next(editor.pos);
+    else if (c == 16 || c == 14)
+      editor_history(c == 16);
+    else if (c == 18)
+    {
+      editor.draft.len = 0;
+      buffer_add(&editor.draft, editor.text.data ? editor.text.data : "", editor.text.len);
+      editor.query.len = 0;
+      buffer_add(&editor.query, "", 0);
+      editor.searching = 1;
+      editor.match = -1;
+    }
+    else if (c == '\t')
+      editor_complete();
+    else if (c == 12) // ^L clears the screen
+    {
+      buffer_add(&editor.out, "\x1b[H\x1b[2J", 7);
+      editor.shown.len = editor.cursor = 0;
+    }
+    else if (c >= 32 && c != 127)
+    {
+      char ch = c;
+      buffer_insert(&editor.text, editor.pos++, &ch, 1);
+    }
+  }
+
+  // Leave the cursor below the line, the way a cooked terminal would
+  editor.searching = 0;
+  editor_refresh();
+  editor_move(text_columns(editor.shown.data, editor.shown.len));
+  if (result == INTERRUPTED)
+    buffer_add(&editor.out, "^C", 2);
+  buffer_add(&editor.out, "\n", 1);
+  editor_flush();
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+  if (result < 0)
+    return result;
+
+  if (editor.text.len + 2 > *cap)
+  {
+    char *grown = realloc(*line, editor.text.len + 2);
+    if (!grown)
+      return ERROR;
+    *line = grown;
+    *cap = editor.text.len + 2;
+  }
+  if (editor.text.len)
+    memcpy(*line, editor.text.data, editor.text.len);
+  (*line)[editor.text.len] = '\n';
+  (*line)[editor.text.len + 1] = '\0';
+  return editor.text.len + 1;
+}
+
+/**
+ * Measures the variable name at the start of some text.
+ *
+ * @param s The text.
+ * @return The length of the name, or 0 if the text does not start with one.
+ */
+static size_t name_length(const char *s)
+{
+  if (*s >= '0' && *s <= '9')
+    return 0;
+  return strspn(s, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+}
+
+/**
+ * Writes a message of the shell to its stderr, the descriptor and not the startup
+ * stream, so redirections of builtins apply. Output still buffered for stdout is
+ * flushed first, so the two stay in order when they go to the same place.
+ *
+ * @param cookie Unused.
+ * @param data The bytes of the message.
+ * @param len The number of bytes.
+ * @return The number of bytes written, or -1 on an error.
+ */
+ssize_t write_diagnostic(void *cookie, const char *data, size_t len)
+{
+  (void)cookie;
+  fflush(stdout);
+  size_t done = 0;
+  while (done < len)
+  {
+    ssize_t wrote = write(STDERR_FILENO, data + done, len - done);
+    if (wrote == -1 && errno == EINTR)
+      continue;
+    if (wrote <= 0)
+      return done ? (ssize_t)done : -1;
+    done += wrote;
+  }
+  return done;
+}
+
+/**
+ * Reports a syntax error. A line parsed ahead keeps the message until the main
+ * thread reaches it, so errors still come out in order with the output of the
+ * commands before them.
+ *
+ * @param format The printf format of the message.
+ */
+void parse_error(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  if (!parse_messages)
+    vfprintf(stderr, format, args);
+  else
+  {
+    char *text;
+    int len = vasprintf(&text, format, args);
+    if (len >= 0)
+    {
+      buffer_add(parse_messages, text, len);
+      free(text);
+    }
+  }
+  va_end(args);
+}
+
+/**
+ * Finds the parenthesis closing a command substitution, skipping over quotes and
+ * nested parentheses in the command.
+ *
+ * @param p The first character of the command, just after `$(`.
+ * @return The closing parenthesis, or NULL if the line has none.
+ */
+static char *find_close_paren(char *p)
+{
+  int depth = 1;
+  for (;; p++)
+  {
+    if (*p == '\0')
+      return NULL;
+    if (*p == '\\' && p[1] != '\0')
+      p++;
+    else if (*p == '\'' && !(p = strchr(p + 1, '\'')))
+      return NULL;
+    else if (*p == '"')
+    {
+      for (p++; *p != '"'; p++)
+      {
+        if (*p == '\0')
+          return NULL;
+        if (*p == '\\' && p[1] != '\0')
+          p++;
+      }
+    }
+    else if (*p == '(')
+      depth++;
+    else if (*p == ')' && --depth == 0)
+      return p;
+  }
+}
+
+/**
+ * Copies a `$` expansion of a word, marking it for expand_word: `$name`, `${name}`,
+ * `$?`, `$$` or `$(command)`. Command text is kept as written, to be parsed when it
+ * runs. A `$` starting none of these stays literal.
+ *
+ * Once quotes are removed, text after a `$name` could run on into the name, so the
+ * name is ended with EXPAND_END where quote removal has left room for it. Where it
+ * has not, the name is left open for end_name to close.
+ *
+ * @param p The `$`.
+ * @param out Where the marked expansion is written, at or before p.
+ * @param quoted Whether the expansion is inside double quotes.
+ * @param end Set to the character just after the expansion.
+ * @param open Set to 1 if a `$name` was written without its EXPAND_END, otherwise 0.
+ * @return The end of the written text, or NULL on a syntax error.
+ */
+static char *mark_expansion(char *p, char *out, int quoted, char **end, int *open)
+{
+  *open = 0;
+  char *start = p + 1;
+  char *stop = start;
+  if (*start == '(')
+  {
+    if (!(stop = find_close_paren(start + 1)))
+    {
+      parse_error("unexpected end of line while looking for matching `)'\n");
+      return NULL;
+    }
+    stop++;
+  }
+  else if (*start == '{')
+  {
+    stop = start + 1;
+    stop += *stop == '?' || *stop == '$' ? 1 : name_length(stop);
+    if (stop == start + 1 || *stop != '}')
+    {
+      parse_error("${%.*s}: bad substitution\n", (int)strcspn(start + 1, "}"), start + 1);
+      return NULL;
+    }
+    stop++;
+  }
+  else if (*start == '?' || *start == '$')
+    stop++;
+  else
+    stop += name_length(start);
+
+  if (stop == start)
+  {
+    *out++ = '$';
+    *end = start;
+    return out;
+  }
+
+  int command = *start == '(';
+  int name = !command && *start != '{' && *start != '?' && *start != '$';
+  *out++ = quoted ? EXPAND_QUOTED : EXPAND_MARK;
+  memmove(out, start, stop - start);
+  out += stop - start;
+  if (command)
+    out[-1] = EXPAND_END;
+  else if (name && out < stop)
+    *out++ = EXPAND_END;
+  else
+    *open = name;
+  *end = stop;
+  return out;
+}
+
+/**
+ * Closes a `$name` that mark_expansion left open, before the next character of the
+ * word is written. Only a quote or backslash, which is removed, can let the text that
+ * follows join the name; any other character written in place already ends it.
+ *
+ * @param out Where the next character of the word is written.
+ * @param p The next character to be read, past any quote character just removed.
+ * @param open Whether a `$name` is open, cleared once nothing more can join it.
+ * @return Where the next character is to be written.
+ */
+static char *end_name(char *out, const char *p, int *open)
+{
+  if (!*open)
+    return out;
+  if (out < p)
+  {
+    *out++ = EXPAND_END;
+    *open = 0;
+  }
+  else if (*p != '\\' && *p != '\'' && *p != '"')
+    *open = 0;
+  return out;
+}
+
+/**
+ * Removes the quoting from the rest of a word, shifting it left in place over the
+ * quote characters. Single quotes keep everything literally; inside double quotes
+ * a backslash only escapes $, `, " and itself. Expansions and unquoted pattern characters
+ * are marked, not expanded.
+ *
+ * @param p The first quote or pattern character of the word.
+ * @param out Where the unquoted characters are written, at or before p.
+ * @param end Set to the character just after the word.
+ * @param expand Set when the word has expansions or pattern characters.
+ * @return The end of the unquoted word, or NULL if a quote is unterminated.
+ */
+static char *unquote_word(char *p, char *out, char **end, int *expand)
+{
+  int open = 0;
+  for (;;)
+  {
+    out = end_name(out, p, &open);
+    int cls = char_class[(unsigned char)*p];
+    if (cls == 0)
+    {
+      *out++ = *p++;
+      continue;
+    }
+    if (cls & CC_WORD_END)
+      break;
+
+    if (*p == '\\')
+    {
+      // A trailing backslash stays literal
+      if (p[1] != '\0')
+        p++;
+      out = end_name(out, p, &open);
+      *out++ = *p++;
+    }
+    else if (*p == '$')
+    {
+      char *mark = out;
+      if (!(out = mark_expansion(p, out, 0, &p, &open)))
+        return NULL;
+      *expand |= *mark != '$';
+    }
+    else if (cls & CC_GLOB)
+    {
+      // A [ opens a bracket expression only if a ] follows in the word, so `[ -f x ]` is left alone
+      const char *close = p + 1;
+      if (*p == '[')
+      {
+        while (*close != ']' && !(char_class[(unsigned char)*close] & CC_WORD_END))
+          close++;
+      }
+      if (*p == '[' && *close != ']')
+        *out++ = *p++;
+      else
+      {
+        *out++ = *p == '*' ? GLOB_STAR : *p == '?' ? GLOB_ANY : GLOB_BRACKET;
+        p++;
+        *expand = 1;
+      }
+    }
+    else if (*p == '\'')
+    {
+      char *close = strchr(p + 1, '\'');
+      if (!close)
+      {
+        parse_error("unexpected end of line while looking for matching `''\n");
+        return NULL;
+      }
+      size_t len = close - p - 1;
+      out = end_name(out, p + 1, &open);
+      memmove(out, p + 1, len);
+      out += len;
+      p = close + 1;
+    }
+    else
+    {
+      for (p++; *p != '"';)
+      {
+        out = end_name(out, p, &open);
+        if (*p == '\0')
+        {
+          parse_error("unexpected end of line while looking for matching `\"'\n");
+          return NULL;
+        }
+        if (*p == '$')
+        {
+          char *mark = out;
+          if (!(out = mark_expansion(p, out, 1, &p, &open)))
+            return NULL;
+          *expand |= *mark != '$';
+          continue;
+        }
+        if (*p == '\\' && (p[1] == '$' || p[1] == '`' || p[1] == '"' || p[1] == '\\'))
+        {
+          p++;
+          out = end_name(out, p, &open);
+        }
+        *out++ = *p++;
+      }
+      p++;
+    }
+  }
+  *end = p;
+  return out;
+}
+
+/**
+ * Returns the next token of a line in a single pass, unquoting and NUL terminating
+ * words in place. Bytes are classified through a lookup table, so runs of blanks and
+ * plain word characters are skipped without any per-character branching on their value.
+ *
+ * @param lex A pointer to the Lexer scanning the line.
+ * @param word Set to the start of the word when a TOKEN_WORD is returned.
+ * @return The type of the token. For TOKEN_REDIRECT the details are left in the Lexer.
+ */
+int next_token(Lexer *lex, char **word)
+{
+  char *p = lex->pos;
+  lex->redirect_fd = -1;
+
+  // A word that ran into an operator may have overwritten its first character
+  char op = lex->pending;
+  lex->pending = '\0';
+
+  if (op == '\0')
+  {
+    while (char_class[(unsigned char)*p] & CC_SPACE)
+      p++;
+
+    // Comments run to the end of the line
+    if (*p == '#')
+      p += strlen(p);
+
+    if (*p == '\0')
+    {
+      lex->pos = p;
+      return TOKEN_END;
+    }
+
+    if (char_class[(unsigned char)*p] & CC_OPERATOR)
+      op = *p++;
+    else
+    {
+      // Plain characters are already in place; only quoting forces a copy
+      *word = p;
+      while (char_class[(unsigned char)*p] == 0)
+        p++;
+      size_t name_len = name_length(*word);
+      lex->assign = name_len > 0 && *word + name_len < p && (*word)[name_len] == '=';
+
+      char *out = p;
+      int special = char_class[(unsigned char)*p];
+      int quoted = special & CC_QUOTE;
+      int expand = 0;
+      if ((special & (CC_QUOTE | CC_GLOB)) && !(out = unquote_word(p, out, &p, &expand)))
+        return TOKEN_ERROR;
+
+      char end = *p;
+      *out = '\0';
+      if (end != '\0')
+        p++;
+      lex->pos = p;
+      lex->quoted = quoted;
+      lex->expand = expand;
+
+      if (!(char_class[(unsigned char)end] & CC_OPERATOR))
+        return TOKEN_WORD;
+
+      // An unquoted all-digit word directly before a redirection is the descriptor it applies to
+      if ((end != '<' && end != '>') || quoted || (*word)[strspn(*word, "0123456789")] != '\0')
+      {
+        lex->pending = end;
+        return TOKEN_WORD;
+      }
+      lex->redirect_fd = atoi(*word);
+      op = end;
+    }
+  }
+
+  if (op == '|' || op == '&' || op == ';')
+  {
+    // Doubled, `&&` and `||` run the next pipeline depending on the status of the previous one
+    if (op != ';' && *p == op)
+    {
+      lex->pos = p + 1;
+      return op == '&' ? TOKEN_AND : TOKEN_OR;
+    }
+    lex->pos = p;
+    return op == '|' ? TOKEN_PIPE : op == '&' ? TOKEN_AMP : TOKEN_SEMI;
+  }
+
+  if (op == '<')
+  {
+    if (lex->redirect_fd == -1)
+      lex->redirect_fd = STDIN_FILENO;
+    if (p[0] == '<' && p[1] == '<')
+    {
+      lex->redirect_type = REDIR_STRING;
+      p += 2;
+    }
+    else if (*p == '&')
+    {
+      lex->redirect_type = REDIR_DUP;
+      p++;
+    }
+    else
+      lex->redirect_type = REDIR_IN;
+  }
+  else
+  {
+    if (lex->redirect_fd == -1)
+      lex->redirect_fd = STDOUT_FILENO;
+    if (*p == '>')
+    {
+      lex->redirect_type = REDIR_APPEND;
+      p++;
+    }
+    else if (*p == '&')
+    {
+      lex->redirect_type = REDIR_DUP;
+      p++;
+    }
+    else
+    {
+      lex->redirect_type = REDIR_OUT;
+      if (*p == '|')
+        p++;
+    }
+  }
+  lex->pos = p;
+  return TOKEN_REDIRECT;
+}
+
+// Growable vectors a command is collected in before it is copied into the arena at its final size.
+// The parser thread has its own, as the main thread still parses command substitutions.
+static __thread struct
+{
+  char **args;
+  size_t arg_cap;
+  Redirect *redirects;
+  size_t redirect_cap;
+  char **assigns;
+  size_t assign_cap;
+  Command *commands;
+  size_t command_cap;
+} scratch;
+
+/**
+ * Frees the scratch vectors of the calling thread.
+ */
+void scratch_free(void)
+{
+  free(scratch.args);
+  free(scratch.redirects);
+  free(scratch.assigns);
+  free(scratch.commands);
+}
+
+/**
+ * Makes room for one more element in one of the scratch vectors.
+ *
+ * @param vec A pointer to the vector, which may be moved.
+ * @param cap A pointer to its capacity in elements.
+ * @param count The number of elements in use.
+ * @param size The size of an element.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int reserve(void **vec, size_t *cap, size_t count, size_t size)
+{
+  if (count < *cap)
+    return 1;
+
+  size_t grown = *cap ? *cap * 2 : INITIAL_ARGS;
+  void *bigger = realloc(*vec, grown * size);
+  if (!bigger)
+  {
+    perror("Error allocating memory for command args");
+    return ERROR;
+  }
+  *vec = bigger;
+  *cap = grown;
+  return 1;
+}
+
+/**
+ * Reports the current token as unexpected.
+ *
+ * @param p A pointer to the Parser.
+ * @return ERROR, for the caller to pass on.
+ */
+static int syntax_error(Parser *p)
+{
+  static const char *ops[] = {"", "", "|", "", "&", ";", "", "&&", "||"};
+
+  if (p->token == TOKEN_WORD)
+    parse_error("syntax error near unexpected token `%s'\n", p->word);
+  else if (p->token == TOKEN_END)
+    parse_error("syntax error near unexpected end of line\n");
+  else if (p->token == TOKEN_REDIRECT)
+    parse_error("syntax error near unexpected redirection\n");
+  else if (p->token != TOKEN_ERROR) // The lexer has already said what is wrong
+    parse_error("syntax error near unexpected token `%s'\n", ops[p->token]);
+  return ERROR;
+}
+
+/**
+ * Moves the parser on to the next token.
+ *
+ * @param p A pointer to the Parser.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int advance(Parser *p)
+{
+  p->token = next_token(&p->lex, &p->word);
+  return p->token == TOKEN_ERROR ? ERROR : 1;
+}
+
+/**
+ * Starts tokenizing a line, first copying it into the arena when the source would overwrite it.
+ *
+ * @param p A pointer to the Parser.
+ * @param line The line to be parsed.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int load_line(Parser *p, char *line)
+{
+  if (p->copy)
+  {
+    size_t len = strlen(line) + 1;
+    char *copy = arena_alloc(p->arena, len);
+    if (!copy)
+    {
+      perror("Error allocating memory for command line");
+      return ERROR;
+    }
+    line = memcpy(copy, line, len);
+  }
+  p->lex = (Lexer){line, '\0', -1, REDIR_IN, 0, 0, 0};
+  return advance(p);
+}
+
+/**
+ * Reads on past the end of a line where a command cannot end: inside compound
+ * commands and after `|`, `&&` and `||`.
+ *
+ * @param p A pointer to the Parser.
+ * @return 1 once a token other than TOKEN_END is current, otherwise ERROR.
+ */
+static int skip_newlines(Parser *p)
+{
+  while (p->token == TOKEN_END)
+  {
+    char *line;
+    ssize_t len = source_line(p->src, "> ", &line);
+    if (len == INTERRUPTED)
+    {
+      p->cancelled = 1;
+      return ERROR;
+    }
+    if (len == EOF_REACHED)
+    {
+      parse_error("syntax error: unexpected end of file\n");
+      return ERROR;
+    }
+    if (len == ERROR)
+    {
+      perror("Error reading input.");
+      return ERROR;
+    }
+    if (load_line(p, line) == ERROR)
+      return ERROR;
+  }
+  return 1;
+}
+
+/**
+ * Checks whether the current token is the given reserved word. Reserved words are
+ * only recognized unquoted, and only where a command could start.
+ *
+ * @param p A pointer to the Parser.
+ * @param word The reserved word.
+ * @return 1 if it is, otherwise 0.
+ */
+static int is_keyword(Parser *p, const char *word)
+{
+  return p->token == TOKEN_WORD && !p->lex.quoted && strcmp(p->word, word) == 0;
+}
+
+/**
+ * Checks whether a word is reserved where a command could start.
+ *
+ * @param word The word to be checked.
+ * @return 1 if it is, otherwise 0.
+ */
+static int is_reserved(const char *word)
+{
+  static const char *reserved[] = {"if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for", "in"};
+  for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++)
+  {
+    if (strcmp(word, reserved[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Checks whether a word can name a variable: letters, digits and underscores, not starting with a digit.
+ *
+ * @param word The word to be checked.
+ * @return 1 if it can, otherwise 0.
+ */
+static int is_name(const char *word)
+{
+  return word[0] != '\0' && word[name_length(word)] == '\0';
+}
+
+/**
+ * Checks whether the current token is a reserved word that ends a list of commands.
+ *
+ * @param p A pointer to the Parser.
+ * @return 1 if it is, otherwise 0.
+ */
+static int list_end(Parser *p)
+{
+  return is_keyword(p, "then") || is_keyword(p, "elif") || is_keyword(p, "else") || is_keyword(p, "fi") ||
+         is_keyword(p, "do") || is_keyword(p, "done");
+}
+
+/**
+ * Expects the current token to be the given reserved word and moves past it.
+ *
+ * @param p A pointer to the Parser.
+ * @param word The reserved word.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expect(Parser *p, const char *word)
+{
+  if (!is_keyword(p, word))
+    return syntax_error(p);
+  return advance(p);
+}
+
+/**
+ * Allocates a zeroed syntax tree node.
+ *
+ * @param p A pointer to the Parser.
+ * @param type One of the NODE_* types.
+ * @return A pointer to the Node, or NULL if the allocation failed.
+ */
+static Node *new_node(Parser *p, int type)
+{
+  Node *node = arena_alloc(p->arena, sizeof(Node));
+  if (!node)
+  {
+    perror("Error allocating memory for syntax tree");
+    return NULL;
+  }
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  return node;
+}
+
+static int parse_list(Parser *p, Node **list);
+
+/**
+ * Parses a simple command: its words and redirections.
+ *
+ * @param p A pointer to the Parser.
+ * @param cmd A pointer to the Command to be filled in.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_simple(Parser *p, Command *cmd)
+{
+  size_t args = 0;
+  size_t redirects = 0;
+  size_t assigns = 0;
+  for (;;)
+  {
+    if (p->token == TOKEN_WORD && args == 0 && p->lex.assign)
+    {
+      if (reserve((void **)&scratch.assigns, &scratch.assign_cap, assigns, sizeof(char *)) == ERROR)
+        return ERROR;
+      scratch.assigns[assigns++] = p->word;
+      p->expand |= p->lex.expand;
+    }
+    else if (p->token == TOKEN_WORD)
+    {
+      // Reserved words cannot name a command
+      if (args == 0 && !p->lex.quoted && is_reserved(p->word))
+        return syntax_error(p);
+      if (reserve((void **)&scratch.args, &scratch.arg_cap, args, sizeof(char *)) == ERROR)
+        return ERROR;
+      scratch.args[args++] = p->word;
+      p->expand |= p->lex.expand;
+    }
+    else if (p->token == TOKEN_REDIRECT)
+    {
+      Lexer op = p->lex;
+      if (advance(p) == ERROR)
+        return ERROR;
+      if (p->token != TOKEN_WORD)
+      {
+        parse_error("syntax error near unexpected redirection\n");
+        return ERROR;
+      }
+      // Expanded targets are checked once they are known
+      p->expand |= p->lex.expand;
+      if (op.redirect_type == REDIR_DUP && !p->lex.expand && strcmp(p->word, "-") != 0 &&
+          p->word[strspn(p->word, "0123456789")] != '\0')
+      {
+        parse_error("%s: ambiguous redirect\n", p->word);
+        return ERROR;
+      }
+      if (reserve((void **)&scratch.redirects, &scratch.redirect_cap, redirects, sizeof(Redirect)) == ERROR)
+        return ERROR;
+      scratch.redirects[redirects++] = (Redirect){op.redirect_fd, op.redirect_type, p->word, -1, -1};
+    }
+    else
+      break;
+
+    if (advance(p) == ERROR)
+      return ERROR;
+  }
+
+  // A command needs at least a word, an assignment or a redirection
+  if (args == 0 && redirects == 0 && assigns == 0)
+    return syntax_error(p);
+
+  char **argv = arena_alloc(p->arena, (args + 1) * sizeof(char *));
+  Redirect *redirv = redirects ? arena_alloc(p->arena, redirects * sizeof(Redirect)) : NULL;
+  char **assignv = assigns ? arena_alloc(p->arena, assigns * sizeof(char *)) : NULL;
+  if (!argv || (redirects && !redirv) || (assigns && !assignv))
+  {
+    perror("Error allocating memory for command args");
+    return ERROR;
+  }
+  memcpy(argv, scratch.args, args * sizeof(char *));
+  argv[args] = NULL;
+  if (redirects)
+    memcpy(redirv, scratch.redirects, redirects * sizeof(Redirect));
+  if (assigns)
+    memcpy(assignv, scratch.assigns, assigns * sizeof(char *));
+  *cmd = (Command){argv[0], argv, args, redirv, redirects, assignv, assigns};
+  return 1;
+}
+
+/**
+ * Parses a pipeline of simple commands, optionally prefixed with the `time` keyword.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the NODE_PIPELINE.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_pipeline(Parser *p, Node **node)
+{
+  // Stages are collected in the scratch vector, whose earlier stages are already in the arena
+  size_t count = 0;
+  p->expand = 0;
+
+  // Only a bare `time` is the keyword; "time" or \time names the command
+  int timed = is_keyword(p, "time");
+  for (;;)
+  {
+    Command cmd;
+    if (parse_simple(p, &cmd) == ERROR)
+      return ERROR;
+    if (reserve((void **)&scratch.commands, &scratch.command_cap, count, sizeof(Command)) == ERROR)
+      return ERROR;
+    scratch.commands[count++] = cmd;
+
+    if (p->token != TOKEN_PIPE)
+      break;
+    if (advance(p) == ERROR || skip_newlines(p) == ERROR)
+      return ERROR;
+  }
+
+  *node = new_node(p, NODE_PIPELINE);
+  Pipeline *pipeline = arena_alloc(p->arena, sizeof(Pipeline));
+  Command *commands = arena_alloc(p->arena, count * sizeof(Command));
+  if (!*node || !pipeline || !commands)
+  {
+    perror("Error allocating memory for pipelines");
+    return ERROR;
+  }
+  memcpy(commands, scratch.commands, count * sizeof(Command));
+  *pipeline = (Pipeline){commands, count, 0, 0, p->expand, 0, 0};
+  (*node)->pipeline = pipeline;
+
+  // A leading `time` keyword times the whole pipeline, unless it is all there is
+  Command *lead = &commands[0];
+  if (timed && lead->arg_count > 1)
+  {
+    pipeline->timed = 1;
+    lead->args++;
+    lead->arg_count--;
+    lead->name = lead->args[0];
+  }
+  return 1;
+}
+
+/**
+ * Parses `if list; then list; [elif list; then list;]... [else list;] fi`,
+ * starting at the `if` or `elif`. An elif becomes an if nested in the else branch.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the NODE_IF.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_if(Parser *p, Node **node)
+{
+  if (!(*node = new_node(p, NODE_IF)))
+    return ERROR;
+  p->depth++;
+  if (advance(p) == ERROR || parse_list(p, &(*node)->left) == ERROR)
+    return ERROR;
+  if (!(*node)->left)
+    return syntax_error(p);
+  if (expect(p, "then") == ERROR || parse_list(p, &(*node)->right) == ERROR)
+    return ERROR;
+  if (!(*node)->right)
+    return syntax_error(p);
+
+  // The nested if of an elif also takes the `fi`
+  if (is_keyword(p, "elif"))
+  {
+    p->depth--;
+    return parse_if(p, &(*node)->orelse);
+  }
+  if (is_keyword(p, "else"))
+  {
+    if (advance(p) == ERROR || parse_list(p, &(*node)->orelse) == ERROR)
+      return ERROR;
+    if (!(*node)->orelse)
+      return syntax_error(p);
+  }
+  p->depth--;
+  return expect(p, "fi");
+}
+
+/**
+ * Parses `while list; do list; done` and `until list; do list; done`.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the NODE_WHILE or NODE_UNTIL.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_loop(Parser *p, Node **node)
+{
+  if (!(*node = new_node(p, is_keyword(p, "while") ? NODE_WHILE : NODE_UNTIL)))
+    return ERROR;
+  p->depth++;
+  if (advance(p) == ERROR || parse_list(p, &(*node)->left) == ERROR)
+    return ERROR;
+  if (!(*node)->left)
+    return syntax_error(p);
+  if (expect(p, "do") == ERROR || parse_list(p, &(*node)->right) == ERROR)
+    return ERROR;
+  if (!(*node)->right)
+    return syntax_error(p);
+  p->depth--;
+  return expect(p, "done");
+}
+
+/**
+ * Parses `for name in words...; do list; done`.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the NODE_FOR.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_for(Parser *p, Node **node)
+{
+  if (!(*node = new_node(p, NODE_FOR)))
+    return ERROR;
+  p->depth++;
+  if (advance(p) == ERROR)
+    return ERROR;
+  if (p->token != TOKEN_WORD)
+    return syntax_error(p);
+
+  char *name = p->word;
+  if (p->lex.quoted || !is_name(name))
+  {
+    parse_error("`%s': not a valid identifier\n", name);
+    return ERROR;
+  }
+  (*node)->name = name;
+
+  if (advance(p) == ERROR || skip_newlines(p) == ERROR || expect(p, "in") == ERROR)
+    return ERROR;
+
+  size_t count = 0;
+  for (; p->token == TOKEN_WORD; count++)
+  {
+    if (reserve((void **)&scratch.args, &scratch.arg_cap, count, sizeof(char *)) == ERROR)
+      return ERROR;
+    scratch.args[count] = p->word;
+    (*node)->expand |= p->lex.expand;
+    if (advance(p) == ERROR)
+      return ERROR;
+  }
+  if (p->token == TOKEN_SEMI && advance(p) == ERROR)
+    return ERROR;
+  if (skip_newlines(p) == ERROR)
+    return ERROR;
+
+  if (count && !((*node)->words = arena_alloc(p->arena, count * sizeof(char *))))
+  {
+    perror("Error allocating memory for syntax tree");
+    return ERROR;
+  }
+  if (count)
+    memcpy((*node)->words, scratch.args, count * sizeof(char *));
+  (*node)->word_count = count;
+
+  if (expect(p, "do") == ERROR || parse_list(p, &(*node)->right) == ERROR)
+    return ERROR;
+  if (!(*node)->right)
+    return syntax_error(p);
+  p->depth--;
+  return expect(p, "done");
+}
+
+/**
+ * Parses a command: a compound command or a pipeline.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the parsed Node.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_command(Parser *p, Node **node)
+{
+  if (is_keyword(p, "if"))
+    return parse_if(p, node);
+  if (is_keyword(p, "while") || is_keyword(p, "until"))
+    return parse_loop(p, node);
+  if (is_keyword(p, "for"))
+    return parse_for(p, node);
+  return parse_pipeline(p, node);
+}
+
+/**
+ * Parses commands joined by `&&` and `||`, which group from the left.
+ *
+ * @param p A pointer to the Parser.
+ * @param node Set to the parsed Node.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_and_or(Parser *p, Node **node)
+{
+  if (parse_command(p, node) == ERROR)
+    return ERROR;
+
+  while (p->token == TOKEN_AND || p->token == TOKEN_OR)
+  {
+    Node *op = new_node(p, p->token == TOKEN_AND ? NODE_AND : NODE_OR);
+    if (!op || advance(p) == ERROR || skip_newlines(p) == ERROR)
+      return ERROR;
+    op->left = *node;
+    if (parse_command(p, &op->right) == ERROR)
+      return ERROR;
+    *node = op;
+  }
+  return 1;
+}
+
+/**
+ * Parses commands separated by `;`, `&` or, inside compound commands, newlines.
+ * The list ends at the end of the line, or at a reserved word such as `then` or `done`.
+ *
+ * @param p A pointer to the Parser.
+ * @param list Set to the first Node of the list, or NULL if it is empty.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parse_list(Parser *p, Node **list)
+{
+  Node **tail = list;
+  *list = NULL;
+  for (;;)
+  {
+    if (p->depth > 0 && skip_newlines(p) == ERROR)
+      return ERROR;
+    if (p->token == TOKEN_END || list_end(p))
+      return 1;
+
+    Node *node;
+    if (parse_and_or(p, &node) == ERROR)
+      return ERROR;
+    *tail = node;
+    tail = &node->next;
+
+    // `&` sends a single pipeline to the background
+    if (p->token == TOKEN_AMP)
+    {
+      if (node->type != NODE_PIPELINE)
+        return syntax_error(p);
+      node->pipeline->background = 1;
+    }
+    if (p->token == TOKEN_AMP || p->token == TOKEN_SEMI)
+    {
+      if (advance(p) == ERROR)
+        return ERROR;
+    }
+    else if (p->token != TOKEN_END)
+      return syntax_error(p);
+  }
+}
+
+/**
+ * Parses a line of input into a syntax tree. Compound commands that are left open
+ * read further lines from the source until they are complete, so a whole loop is
+ * parsed once and its body can run any number of times without being parsed again.
+ *
+ * @param line The line to be parsed. Words are terminated and unquoted in place.
+ * @param src A pointer to the Source further lines are read from.
+ * @param tree Set to the first Node of the parsed list.
+ * @param arena A pointer to the Arena holding the tree.
+ * @return 1 if the line was successfully parsed, otherwise an appropriate status code.
+ */
+int parse_line(char *line, Source *src, Node **tree, Arena *arena)
+{
+  if (!line || !src || !tree || !arena)
+    return ERROR;
+
+  // Lines stay in place, and so stay valid, unless the terminal or a pipe buffer is reused
+  Parser p = {.src = src, .arena = arena};
+  p.copy = src->interactive || src->input->fd != -1;
+  if (load_line(&p, line) == ERROR)
+    return ERROR;
+  if (p.token == TOKEN_END)
+    return EMPTY_ARGS;
+
+  if (parse_list(&p, tree) == ERROR)
+    return p.cancelled ? INTERRUPTED : ERROR;
+  if (p.token != TOKEN_END)
+    return syntax_error(&p);
+  return 1;
+}
+
+/**
+ * Parses every line of a piece of command text into one list, copying the text into
+ * the arena first.
+ *
+ * @param text The command text.
+ * @param len The length of the text.
+ * @param arena A pointer to the Arena holding the tree.
+ * @param tree Set to the first Node of the list, or NULL if there are no commands or errors.
+ * @return 1 on success, otherwise ERROR.
+ */
+int parse_string(const char *text, size_t len, Arena *arena, Node **tree)
+{
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy)
+  {
+    perror("Error allocating memory for command line");
+    return ERROR;
+  }
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+
+  Input input = {-1, NULL, 0, 0, 0, 0, NULL};
+  open_string(&input, copy);
+  Source src = {&input, 0, NULL, 0, 0};
+  Node **tail = tree;
+  *tail = NULL;
+  char *line;
+  int result = 1;
+  while (result == 1 && next_line(&input, &line) >= 0)
+  {
+    int status = parse_line(line, &src, tail, arena);
+    if (status == EMPTY_ARGS)
+      continue;
+    if (status != 1)
+      result = ERROR;
+    while (*tail)
+      tail = &(*tail)->next;
+  }
+  close_input(&input);
+
+  // Nothing of a block with a syntax error is run
+  if (result == ERROR)
+    *tree = NULL;
+  return result;
+}
+
+/**
+ * Allocates memory from an arena. The memory stays valid until the arena is reset.
+ *
+ * @param arena A pointer to the Arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the allocated memory, or NULL if the allocation failed.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if (!arena->base)
+  {
+    arena->size = size > ARENA_INITIAL ? size : ARENA_INITIAL;
+    if (!(arena->base = malloc(arena->size)))
+      return NULL;
+  }
+
+  if (arena->size - arena->used >= size)
+  {
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
+  }
+
+  // Overflow goes to a separate block until the next reset enlarges the arena
+  ArenaSpill *spill = malloc(sizeof(ArenaSpill) + size);
+  if (!spill)
+    return NULL;
+  spill->next = arena->spill;
+  arena->spill = spill;
+  arena->spilled += size;
+  return spill->data;
+}
+
+/**
+ * Resizes the most recent allocation of an arena, in place when there is room.
+ * Other allocations are moved to a fresh block of the new size.
+ *
+ * @param arena A pointer to the Arena the memory came from.
+ * @param ptr The memory to be resized.
+ * @param old_size The size it was allocated with.
+ * @param new_size The size it should have.
+ * @return A pointer to the resized memory, or NULL if the allocation failed.
+ */
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+  old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  new_size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if ((char *)ptr + old_size == arena->base + arena->used &&
+      arena->size - arena->used >= new_size - old_size)
+  {
+    arena->used += new_size - old_size;
+    return ptr;
+  }
+
+  void *grown = arena_alloc(arena, new_size);
+  if (grown)
+    memcpy(grown, ptr, old_size);
+  return grown;
+}
+
+/**
+ * Releases everything allocated from an arena while keeping its memory for reuse.
+ * If the last round spilled over, the main block is grown to fit it in one piece,
+ * so a steady workload stops allocating after the first few lines.
+ *
+ * @param arena A pointer to the Arena to be reset.
+ */
+void arena_reset(Arena *arena)
+{
+  if (arena->spill)
+  {
+    size_t needed = arena->used + arena->spilled;
+    size_t size = arena->size * 2;
+    while (size < needed)
+      size *= 2;
+
+    while (arena->spill)
+    {
+      ArenaSpill *next = arena->spill->next;
+      free(arena->spill);
+      arena->spill = next;
+    }
+
+    free(arena->base);
+    arena->size = size;
+    if (!(arena->base = malloc(size)))
+      arena->size = 0;
+    arena->spilled = 0;
+  }
+  arena->used = 0;
+}
+
+/**
+ * Frees all memory owned by an arena.
+ *
+ * @param arena A pointer to the Arena to be freed.
+ */
+void arena_free(Arena *arena)
+{
+  arena_reset(arena);
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+}
+
+/**
+ * Makes room in a capture buffer.
+ *
+ * @param c A pointer to the Capture.
+ * @param extra The number of bytes about to be added.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int capture_reserve(Capture *c, size_t extra)
+{
+  if (c->len + extra <= c->cap)
+    return 1;
+  size_t cap = c->cap ? c->cap * 2 : 256;
+  while (cap < c->len + extra)
+    cap *= 2;
+  char *grown = c->data ? arena_grow(c->arena, c->data, c->cap, cap) : arena_alloc(c->arena, cap);
+  if (!grown)
+  {
+    perror("Error allocating memory for command output");
+    return ERROR;
+  }
+  c->data = grown;
+  c->cap = cap;
+  return 1;
+}
+
+/**
+ * Receives what builtins write to stdout while their output is being captured.
+ *
+ * @param cookie A pointer to the Capture.
+ * @param data The bytes written.
+ * @param len The number of bytes.
+ * @return The number of bytes taken, or 0 on error.
+ */
+static ssize_t capture_write(void *cookie, const char *data, size_t len)
+{
+  Capture *c = cookie;
+  if (capture_reserve(c, len) == ERROR)
+    return 0;
+  memcpy(c->data + c->len, data, len);
+  c->len += len;
+  return len;
+}
+
+/**
+ * Checks whether commands can run in the shell itself for a command substitution.
+ * That takes builtins which only write output, with no redirections, which would
+ * reach the real stdout, and no for loops, whose variable would outlive them.
+ *
+ * @param list A pointer to the first Node of the list.
+ * @return 1 if they can, otherwise 0.
+ */
+static int runs_in_process(Node *list)
+{
+  for (Node *node = list; node; node = node->next)
+  {
+    if (node->type == NODE_FOR)
+      return 0;
+    if (node->type != NODE_PIPELINE)
+    {
+      if (!runs_in_process(node->left) || !runs_in_process(node->right) || !runs_in_process(node->orelse))
+        return 0;
+      continue;
+    }
+
+    Pipeline *pipeline = node->pipeline;
+    Command *cmd = &pipeline->commands[0];
+    const Builtin *builtin = cmd->name ? find_builtin(cmd->name) : NULL;
+    if (pipeline->count != 1 || pipeline->background || pipeline->timed || cmd->redirect_count ||
+        !builtin || !builtin->pure)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Reads the output of a command substitution whenever the event loop finds it ready.
+ * The descriptor is closed and set to -1 at end of file.
+ *
+ * @param source A pointer to the EventSource of the pipe, whose data is the Capture.
+ * @param events The epoll events that are ready.
+ */
+static void capture_ready(EventSource *source, unsigned int events)
+{
+  (void)events;
+  Capture *out = source->data;
+  ssize_t got = 0;
+  if (capture_reserve(out, 4096) == 1)
+  {
+    got = read(source->fd, out->data + out->len, out->cap - out->len);
+    if (got == -1 && errno == EINTR)
+      return;
+  }
+  if (got > 0)
+  {
+    out->len += got;
+    return;
+  }
+  event_remove(source);
+  close(source->fd);
+  source->fd = -1;
+}
+
+/**
+ * Runs commands in a child process, reading what they write to stdout from a pipe.
+ * The pipe and the child's exit are both waited for in the event loop.
+ *
+ * @param tree A pointer to the first Node of the commands.
+ * @param arena A pointer to the Arena their pipelines are run from.
+ * @param out A pointer to the Capture receiving the output.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int capture_child(Node *tree, Arena *arena, Capture *out)
+{
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1)
+  {
+    perror("pipe");
+    return ERROR;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return ERROR;
+  }
+  if (pid == 0)
+  {
+    // A subshell: it stays in the shell's job, where ^C ends it
+    event_init();
+    job_control = 0;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    dup2(fds[1], STDOUT_FILENO);
+    mark_exec(tree);
+    execute_list(tree, arena);
+    fflush(stdout);
+    _exit(last_status);
+  }
+
+  // The child is a foreground job of its own, so it is recorded wherever it is reaped
+  close(fds[1]);
+  Process proc = {pid, JOB_RUNNING, 0};
+  Job job = {.procs = &proc, .count = 1};
+  foreground_job = &job;
+  EventSource pipe_source = {fds[0], capture_ready, out};
+  if (event_add(&pipe_source, EPOLLIN) == ERROR)
+  {
+    close(fds[0]);
+    pipe_source.fd = -1;
+  }
+  while (pipe_source.fd != -1)
+  {
+    if (event_wait(-1) == ERROR)
+      capture_ready(&pipe_source, 0);
+  }
+  wait_job(&job);
+  return interrupted ? ERROR : 1;
+}
+
+/**
+ * Runs the command text of a `$(...)` and captures its output, without its trailing
+ * newlines. Builtins that only write output run in the shell itself, writing into
+ * an arena buffer through a stdio cookie instead of a pipe; anything else runs in a
+ * forked subshell.
+ *
+ * @param text The command text.
+ * @param len The length of the text.
+ * @param out A pointer to the Capture receiving the output, in the substitution's own arena.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int substitute(const char *text, size_t len, Capture *out)
+{
+  if (substitution_depth == SUBSTITUTION_DEPTH_MAX)
+  {
+    fprintf(stderr, "command substitution nested too deeply\n");
+    last_status = 2;
+    return ERROR;
+  }
+
+  // Each level of nesting keeps its arenas, so they are only allocated once
+  Arena *tree_arena = &substitution_arenas[substitution_depth][0];
+  Arena *run_arena = &substitution_arenas[substitution_depth][1];
+  arena_reset(tree_arena);
+  *out = (Capture){tree_arena, NULL, 0, 0};
+  Node *tree;
+  if (parse_string(text, len, tree_arena, &tree) == ERROR)
+  {
+    last_status = 2;
+    return ERROR;
+  }
+
+  substitution_depth++;
+  int result = 1;
+  if (!runs_in_process(tree))
+    result = capture_child(tree, run_arena, out);
+  else
+  {
+    fflush(stdout);
+    FILE *capture = fopencookie(out, "w", (cookie_io_functions_t){.write = capture_write});
+    if (!capture)
+    {
+      perror("fopencookie");
+      result = ERROR;
+    }
+    else
+    {
+      FILE *saved = stdout;
+      stdout = capture;
+      execute_list(tree, run_arena);
+      fclose(capture);
+      stdout = saved;
+    }
+  }
+  substitution_depth--;
+
+  while (out->len > 0 && out->data[out->len - 1] == '\n')
+    out->len--;
+  return result;
+}
+
+/**
+ * Appends text to the field being built.
+ *
+ * @param e A pointer to the Expansion.
+ * @param text The text.
+ * @param len The length of the text.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_add(Expansion *e, const char *text, size_t len)
+{
+  if (e->len + len + 1 > e->cap)
+  {
+    size_t cap = e->cap ? e->cap * 2 : 64;
+    while (cap < e->len + len + 1)
+      cap *= 2;
+    char *grown = e->text ? arena_grow(e->arena, e->text, e->cap, cap) : arena_alloc(e->arena, cap);
+    if (!grown)
+    {
+      perror("Error allocating memory for expansion");
+      return ERROR;
+    }
+    e->text = grown;
+    e->cap = cap;
+  }
+  memcpy(e->text + e->len, text, len);
+  e->len += len;
+  return 1;
+}
+
+/**
+ * Adds a finished field to the expanded words.
+ *
+ * @param e A pointer to the Expansion.
+ * @param field The field, which must stay valid as long as the arena.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_push(Expansion *e, char *field)
+{
+  if (e->count + 1 >= e->field_cap)
+  {
+    size_t cap = e->field_cap ? e->field_cap * 2 : INITIAL_ARGS;
+    char **grown = e->fields ? arena_grow(e->arena, e->fields, e->field_cap * sizeof(char *), cap * sizeof(char *))
+                             : arena_alloc(e->arena, cap * sizeof(char *));
+    if (!grown)
+    {
+      perror("Error allocating memory for expansion");
+      return ERROR;
+    }
+    e->fields = grown;
+    e->field_cap = cap;
+  }
+  e->fields[e->count++] = field;
+  e->fields[e->count] = NULL;
+  return 1;
+}
+
+// Bytes that mark unquoted pattern characters in a field
+static const char glob_marks[] = {GLOB_STAR, GLOB_ANY, GLOB_BRACKET, '\0'};
+
+// Listings of the directories globbing has read, by device and inode
+static GlobDir *glob_cache[GLOB_BUCKETS];
+static size_t glob_cached = 0;
+static unsigned long glob_count = 0; // Globs done so far, to tell listings read by the current one
+static char *glob_buffer = NULL;     // getdents64 buffer, allocated on first use
+
+/**
+ * Swaps two string pointers.
+ *
+ * @param names The array of string pointers.
+ * @param i The index of the first pointer.
+ * @param j The index of the second pointer.
+ */
+static void swap_names(char **names, size_t i, size_t j)
+{
+  char *name = names[i];
+  names[i] = names[j];
+  names[j] = name;
+}
+
+/**
+ * Sorts strings into byte order with a multikey quicksort. Strings are partitioned
+ * on one character at a time, so long shared prefixes, as in the names of a large
+ * directory, are not compared over and over again the way qsort with strcmp does.
+ *
+ * @param names The strings.
+ * @param count The number of strings.
+ * @param depth The number of leading characters all the strings are known to share.
+ */
+static void sort_names(char **names, size_t count, size_t depth)
+{
+  while (count > 1)
+  {
+    if (count < SORT_SMALL)
+    {
+      for (size_t i = 1; i < count; i++)
+      {
+        for (size_t j = i; j > 0 && strcmp(names[j - 1] + depth, names[j] + depth) > 0; j--)
+          swap_names(names, j - 1, j);
+      }
+      return;
+    }
+
+    // The pivot is the median of three characters at the current depth
+    unsigned char a = names[0][depth], b = names[count / 2][depth], c = names[count - 1][depth];
+    unsigned char pivot = a < b ? (b < c ? b : a < c ? c : a) : (a < c ? a : b < c ? c : b);
+    size_t lt = 0, i = 0, gt = count;
+    while (i < gt)
+    {
+      unsigned char ch = names[i][depth];
+      if (ch < pivot)
+        swap_names(names, lt++, i++);
+      else if (ch > pivot)
+        swap_names(names, i, --gt);
+      else
+        i++;
+    }
+    sort_names(names, lt, depth);
+    sort_names(names + gt, count - gt, depth);
+
+    // Strings sharing the pivot go on to their next character, unless they all ended here
+    if (pivot == '\0')
+      return;
+    names += lt;
+    count = gt - lt;
+    depth++;
+  }
+}
+
+/**
+ * Empties the cache of directory listings.
+ */
+static void glob_cache_clear(void)
+{
+  for (size_t i = 0; i < GLOB_BUCKETS; i++)
+  {
+    while (glob_cache[i])
+    {
+      GlobDir *dir = glob_cache[i];
+      glob_cache[i] = dir->next;
+      free(dir->names);
+      free(dir->pool);
+      free(dir);
+    }
+  }
+  glob_cached = 0;
+}
+
+/**
+ * Reads the names in a directory with getdents64 into a large buffer, which takes
+ * far fewer system calls than readdir on directories of many thousands of files.
+ * Entries are not stat'ed; their d_type is kept instead.
+ *
+ * @param dir A pointer to the GlobDir receiving the sorted names.
+ * @param path The path of the directory.
+ */
+static void glob_read(GlobDir *dir, const char *path)
+{
+  free(dir->names);
+  free(dir->pool);
+  dir->names = NULL;
+  dir->pool = NULL;
+  dir->count = 0;
+
+  if (!glob_buffer && !(glob_buffer = malloc(GLOB_READ_BUFFER)))
+  {
+    perror("Error allocating memory for glob");
+    return;
+  }
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  Buffer pool = {NULL, 0, 0};
+  size_t count = 0;
+  ssize_t n;
+  while ((n = getdents64(fd, glob_buffer, GLOB_READ_BUFFER)) > 0)
+  {
+    for (ssize_t off = 0; off < n;)
+    {
+      struct dirent64 *ent = (struct dirent64 *)(glob_buffer + off);
+      off += ent->d_reclen;
+      const char *name = ent->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      // The type goes just before the name, so it stays with the name when the names are sorted
+      char type = ent->d_type;
+      if (buffer_add(&pool, &type, 1) == ERROR || buffer_add(&pool, name, strlen(name) + 1) == ERROR)
+      {
+        n = -1;
+        break;
+      }
+      count++;
+    }
+    if (n == -1)
+      break;
+  }
+  close(fd);
+
+  char **names = count ? malloc(count * sizeof(char *)) : NULL;
+  if (n == -1 || (count && !names))
+  {
+    perror("Error reading directory for glob");
+    free(pool.data);
+    free(names);
+    return;
+  }
+  char *name = pool.data;
+  for (size_t i = 0; i < count; i++, name += strlen(name) + 1)
+    names[i] = ++name;
+  sort_names(names, count, 0);
+
+  dir->names = names;
+  dir->pool = pool.data;
+  dir->count = count;
+}
+
+/**
+ * Gets the sorted names in a directory, reading it only if it is not in the cache
+ * yet or its modification time has changed since. A directory changed within the
+ * last second is read again anyway, as it may change once more in the same tick of
+ * its filesystem's clock.
+ *
+ * @param path The path of the directory.
+ * @return A pointer to the listing, or NULL if the path is not a directory.
+ */
+static GlobDir *glob_list(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  size_t bucket = (st.st_ino ^ st.st_dev) % GLOB_BUCKETS;
+  GlobDir *dir = glob_cache[bucket];
+  while (dir && (dir->dev != st.st_dev || dir->ino != st.st_ino))
+    dir = dir->next;
+  if (!dir)
+  {
+    if (!(dir = calloc(1, sizeof(GlobDir))))
+    {
+      perror("Error allocating memory for glob");
+      return NULL;
+    }
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->next = glob_cache[bucket];
+    glob_cache[bucket] = dir;
+    glob_cached++;
+  }
+  // A listing is never replaced during the glob that uses it, as its names may be walked
+  else if (dir->glob == glob_count || (dir->stable && dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                       dir->mtime.tv_nsec == st.st_mtim.tv_nsec))
+  {
+    dir->glob = glob_count;
+    return dir;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  glob_read(dir, path);
+  dir->mtime = st.st_mtim;
+  dir->stable = now.tv_sec > st.st_mtim.tv_sec + 1;
+  dir->glob = glob_count;
+  return dir;
+}
+
+/**
+ * Gets the character a byte of a pattern stands for, undoing the lexer's marks.
+ *
+ * @param c The byte.
+ * @return The character.
+ */
+static unsigned char glob_char(char c)
+{
+  return c == GLOB_STAR ? '*' : c == GLOB_ANY ? '?' : c == GLOB_BRACKET ? '[' : (unsigned char)c;
+}
+
+/**
+ * Compiles a bracket expression such as [a-z], [!0-9] or [[:alpha:]_] into a set of bytes.
+ *
+ * @param p The first character after the [.
+ * @param end The end of the pattern component.
+ * @param set The 256 bit set to be filled.
+ * @return The character after the closing ], or NULL if there is none.
+ */
+static const char *glob_bracket(const char *p, const char *end, unsigned char *set)
+{
+  static const struct
+  {
+    const char *name;
+    int (*is)(int);
+  } classes[] = {{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+                 {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+                 {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+
+  memset(set, 0, 32);
+  int negate = p < end && (*p == '!' || *p == '^');
+  p += negate;
+
+  // A ] right at the start is one of the characters
+  for (const char *start = p; p < end && (*p != ']' || p == start);)
+  {
+    unsigned char c = glob_char(*p);
+    if (c == '[' && p + 1 < end && p[1] == ':')
+    {
+      const char *name = p + 2;
+      const char *close = name;
+      while (close + 1 < end && !(close[0] == ':' && close[1] == ']'))
+        close++;
+      size_t i = 0, count = sizeof(classes) / sizeof(classes[0]);
+      while (i < count && (strlen(classes[i].name) != (size_t)(close - name) ||
+                           strncmp(classes[i].name, name, close - name) != 0))
+        i++;
+      if (close + 1 < end && i < count)
+      {
+        for (int ch = 1; ch < 256; ch++)
+        {
+          if (classes[i].is(ch))
+            set[ch >> 3] |= 1 << (ch & 7);
+        }
+        p = close + 2;
+        continue;
+      }
+    }
+
+    unsigned char last = c;
+    if (p + 2 < end && p[1] == '-' && p[2] != ']')
+    {
+      last = glob_char(p[2]);
+      p += 2;
+    }
+    for (int ch = c; ch <= last; ch++)
+      set[ch >> 3] |= 1 << (ch & 7);
+    p++;
+  }
+  if (p >= end)
+    return NULL;
+
+  if (negate)
+  {
+    for (int i = 0; i < 32; i++)
+      set[i] = ~set[i];
+  }
+  return p + 1;
+}
+
+/**
+ * Compiles one component of a pattern, so it is parsed once however many names it is matched against.
+ *
+ * @param text The component, with its pattern characters marked.
+ * @param len The length of the component.
+ * @param ops The elements of the compiled pattern; there are at most len of them.
+ * @return The number of elements.
+ */
+static size_t glob_compile(const char *text, size_t len, GlobOp *ops)
+{
+  const char *end = text + len;
+  size_t count = 0;
+  for (const char *p = text; p < end;)
+  {
+    GlobOp *op = &ops[count++];
+    const char *next;
+    if (*p == GLOB_STAR)
+    {
+      // Runs of * match the same as one
+      op->type = MATCH_STAR;
+      while (p < end && *p == GLOB_STAR)
+        p++;
+    }
+    else if (*p == GLOB_ANY)
+    {
+      op->type = MATCH_ANY;
+      p++;
+    }
+    else if (*p == GLOB_BRACKET && (next = glob_bracket(p + 1, end, op->set)))
+    {
+      op->type = MATCH_SET;
+      p = next;
+    }
+    else if (*p == GLOB_BRACKET)
+    {
+      // Without a closing ] the [ is an ordinary character
+      op->type = MATCH_TEXT;
+      op->text = "[";
+      op->len = 1;
+      p++;
+    }
+    else
+    {
+      op->type = MATCH_TEXT;
+      op->text = p;
+      while (p < end && *p != GLOB_STAR && *p != GLOB_ANY && *p != GLOB_BRACKET)
+        p++;
+      op->len = p - op->text;
+    }
+  }
+  return count;
+}
+
+/**
+ * Matches a name against a compiled pattern. On a mismatch only the last * seen
+ * takes one more character, which is enough for glob patterns and never backtracks
+ * further than that.
+ *
+ * @param ops The elements of the pattern.
+ * @param count The number of elements.
+ * @param name The name.
+ * @return Whether the name matches.
+ */
+static int glob_match(const GlobOp *ops, size_t count, const char *name)
+{
+  const char *s = name;
+  const char *resume = NULL;
+  size_t i = 0, star = count;
+  for (;;)
+  {
+    if (i < count)
+    {
+      const GlobOp *op = &ops[i];
+      unsigned char c = *s;
+      if (op->type == MATCH_STAR)
+      {
+        star = i++;
+        resume = s;
+        continue;
+      }
+      if (op->type == MATCH_TEXT ? strncmp(s, op->text, op->len) == 0
+                                 : c != '\0' && (op->type == MATCH_ANY || op->set[c >> 3] & (1 << (c & 7))))
+      {
+        s += op->type == MATCH_TEXT ? op->len : 1;
+        i++;
+        continue;
+      }
+    }
+    else if (*s == '\0' || star + 1 == count)
+      return 1;
+
+    if (star == count || *resume == '\0')
+      return 0;
+    s = ++resume;
+    i = star + 1;
+  }
+}
+
+/**
+ * Appends a name to the path being searched.
+ *
+ * @param g A pointer to the Glob.
+ * @param slashes The number of slashes put before the name, unless the path is empty.
+ * @param name The name.
+ * @param len The length of the name.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int glob_join(Glob *g, size_t slashes, const char *name, size_t len)
+{
+  int result = 1;
+  for (size_t i = 0; g->path.len > 0 && i < slashes && result != ERROR; i++)
+    result = buffer_add(&g->path, "/", 1);
+  if (result == ERROR || buffer_add(&g->path, name, len) == ERROR)
+  {
+    perror("Error allocating memory for glob");
+    return ERROR;
+  }
+  return 1;
+}
+
+/**
+ * Finds out whether the path being searched is a directory, stat'ing it only when
+ * its directory entry did not tell.
+ *
+ * @param g A pointer to the Glob.
+ * @param type The d_type of the entry, or DT_UNKNOWN.
+ * @param follow Whether a symbolic link to a directory counts.
+ * @return Whether the path is a directory.
+ */
+static int glob_is_dir(Glob *g, unsigned char type, int follow)
+{
+  struct stat st;
+  if (type == DT_DIR || (type != DT_UNKNOWN && (type != DT_LNK || !follow)))
+    return type == DT_DIR;
+  return (follow ? stat(g->path.data, &st) : lstat(g->path.data, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Adds the path being searched to the fields, as a name the whole pattern matched.
+ *
+ * @param g A pointer to the Glob.
+ * @param type The d_type of its directory entry, or DT_UNKNOWN.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int glob_add(Glob *g, unsigned char type)
+{
+  if (g->dirs && !glob_is_dir(g, type, 1))
+    return 1;
+  char *field = arena_alloc(g->e->arena, g->path.len + g->dirs + 1);
+  if (!field)
+  {
+    perror("Error allocating memory for glob");
+    return ERROR;
+  }
+  memcpy(field, g->path.data, g->path.len);
+  strcpy(field + g->path.len, g->dirs ? "/" : "");
+  return expand_push(g->e, field);
+}
+
+/**
+ * Matches the components of a pattern from one on against what is under the path
+ * being searched. Plain names are just appended; a pattern component reads the
+ * directory, and as its names are sorted, leading text narrows them down to a
+ * single run found by binary search.
+ *
+ * @param g A pointer to the Glob.
+ * @param part The index of the component.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int glob_walk(Glob *g, size_t part)
+{
+  GlobPart *c = &g->parts[part];
+  size_t base = g->path.len;
+  int last = part + 1 == g->count;
+  int result = 1;
+  if (c->tree)
+  {
+    // A trailing ** after a directory also matches the directory itself
+    if (last && base && glob_is_dir(g, DT_UNKNOWN, 1))
+    {
+      if (!g->dirs && glob_join(g, c->slashes, "", 0) == ERROR)
+        return ERROR;
+      result = glob_add(g, DT_DIR);
+      g->path.data[g->path.len = base] = '\0';
+    }
+    return result == ERROR ? ERROR : glob_tree(g, part, c->slashes);
+  }
+
+  if (!c->ops)
+  {
+    struct stat st;
+    if (glob_join(g, c->slashes, c->text, c->len) == ERROR)
+      return ERROR;
+    if (!last)
+      result = glob_walk(g, part + 1);
+    else if (lstat(g->path.data, &st) == 0)
+      result = glob_add(g, S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
+    g->path.data[g->path.len = base] = '\0';
+    return result;
+  }
+
+  GlobDir *dir = glob_list(base ? g->path.data : ".");
+  if (!dir)
+    return 1;
+
+  const GlobOp *first = &c->ops[0];
+  size_t i = 0;
+  if (first->type == MATCH_TEXT)
+  {
+    size_t hi = dir->count;
+    while (i < hi)
+    {
+      size_t mid = i + (hi - i) / 2;
+      if (strncmp(dir->names[mid], first->text, first->len) < 0)
+        i = mid + 1;
+      else
+        hi = mid;
+    }
+  }
+
+  // Hidden names only match a pattern that starts with a dot itself
+  int dots = first->type == MATCH_TEXT && first->text[0] == '.';
+  for (; i < dir->count && result != ERROR; i++)
+  {
+    const char *name = dir->names[i];
+    if (first->type == MATCH_TEXT && strncmp(name, first->text, first->len) != 0)
+      break;
+    if ((name[0] == '.' && !dots) || !glob_match(c->ops, c->count, name))
+      continue;
+    if (glob_join(g, c->slashes, name, strlen(name)) == ERROR)
+      return ERROR;
+    result = last ? glob_add(g, name[-1]) : glob_walk(g, part + 1);
+    g->path.data[g->path.len = base] = '\0';
+  }
+  return result;
+}
+
+/**
+ * Matches a ** component, which stands for the path being searched and every
+ * directory below it. Hidden directories are skipped and symbolic links are not
+ * followed, so no directory is searched twice.
+ *
+ * @param g A pointer to the Glob.
+ * @param part The index of the ** component.
+ * @param slashes The number of slashes put before the names in the path being searched.
+ * @return 1 on success, otherwise ERROR.
+ */
+int glob_tree(Glob *g, size_t part, size_t slashes)
+{
+  int last = part + 1 == g->count;
+  if (!last && glob_walk(g, part + 1) == ERROR)
+    return ERROR;
+
+  size_t base = g->path.len;
+  GlobDir *dir = glob_list(base ? g->path.data : ".");
+  int result = 1;
+  for (size_t i = 0; dir && i < dir->count && result != ERROR; i++)
+  {
+    const char *name = dir->names[i];
+    if (name[0] == '.')
+      continue;
+    if (glob_join(g, slashes, name, strlen(name)) == ERROR)
+      return ERROR;
+
+    // A trailing ** also matches every name on the way down
+    if (last)
+      result = glob_add(g, name[-1]);
+    if (result != ERROR && glob_is_dir(g, name[-1], 0))
+      result = glob_tree(g, part, 1);
+    g->path.data[g->path.len = base] = '\0';
+  }
+  return result;
+}
+
+/**
+ * Expands a field with unquoted pattern characters into the names of the files it matches, sorted.
+ *
+ * @param e A pointer to the Expansion the names are added to.
+ * @param pattern The field, with its pattern characters marked.
+ * @return The number of names found, or ERROR.
+ */
+static int glob_field(Expansion *e, const char *pattern)
+{
+  if (glob_cached >= GLOB_CACHE_DIRS)
+    glob_cache_clear();
+  glob_count++;
+
+  size_t parts = 1;
+  for (const char *p = pattern; *p; p++)
+    parts += *p == '/';
+  Glob g = {e, arena_alloc(e->arena, parts * sizeof(GlobPart)), 0, 0, {NULL, 0, 0}};
+  if (!g.parts)
+  {
+    perror("Error allocating memory for glob");
+    return ERROR;
+  }
+
+  // Leading slashes are the root the search starts from
+  const char *p = pattern + strspn(pattern, "/");
+  if (p > pattern && buffer_add(&g.path, pattern, p - pattern) == ERROR)
+  {
+    perror("Error allocating memory for glob");
+    return ERROR;
+  }
+  while (*p)
+  {
+    size_t slashes = strspn(p, "/");
+    p += slashes;
+    if (*p == '\0')
+    {
+      g.dirs = 1;
+      break;
+    }
+    const char *end = strchrnul(p, '/');
+    size_t len = end - p;
+    GlobPart *c = &g.parts[g.count++];
+    *c = (GlobPart){p, len, NULL, 0, len == 2 && p[0] == GLOB_STAR && p[1] == GLOB_STAR, slashes};
+    if (!c->tree && strcspn(p, glob_marks) < len)
+    {
+      if (!(c->ops = arena_alloc(e->arena, len * sizeof(GlobOp))))
+      {
+        perror("Error allocating memory for glob");
+        free(g.path.data);
+        return ERROR;
+      }
+      c->count = glob_compile(p, len, c->ops);
+    }
+    p = end;
+  }
+
+  size_t start = e->count;
+  int result = glob_walk(&g, 0);
+  free(g.path.data);
+  if (result == ERROR)
+    return ERROR;
+
+  // Names from a single directory come out in order already
+  char **names = e->fields + start;
+  size_t found = e->count - start, i = 1;
+  while (i < found && strcmp(names[i - 1], names[i]) < 0)
+    i++;
+  if (i < found)
+    sort_names(names, found, 0);
+  return found;
+}
+
+/**
+ * Ends the field being built, keeping it if it has any text or quotes. Pathname
+ * expansion happens here, once the field is complete.
+ *
+ * @param e A pointer to the Expansion.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_field(Expansion *e)
+{
+  if (e->len == 0 && !e->keep)
+    return 1;
+  if (expand_add(e, "", 1) == ERROR)
+    return ERROR;
+
+  // With pattern characters the field becomes the files it matches, or stays as it is without any
+  int found = 0;
+  if (strpbrk(e->text, glob_marks))
+  {
+    if (e->split && (found = glob_field(e, e->text)) == ERROR)
+      return ERROR;
+    for (char *p = e->text; !found && (p = strpbrk(p, glob_marks)); p++)
+      *p = glob_char(*p);
+  }
+  if (!found && expand_push(e, e->text) == ERROR)
+    return ERROR;
+
+  // The next field starts after this one in the arena
+  e->text = NULL;
+  e->len = e->cap = 0;
+  e->keep = 0;
+  return 1;
+}
+
+/**
+ * Appends the value of an expansion to the field being built. Unless it was quoted,
+ * blanks in the value split it into separate fields and its pattern characters match file names.
+ *
+ * @param e A pointer to the Expansion.
+ * @param value The value.
+ * @param len The length of the value.
+ * @param quoted Whether the expansion was inside double quotes.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_value(Expansion *e, const char *value, size_t len, int quoted)
+{
+  if (quoted || !e->split)
+    return expand_add(e, value, len);
+
+  const char *end = value + len;
+  while (value < end)
+  {
+    if (*value == ' ' || *value == '\t' || *value == '\n')
+    {
+      if (expand_field(e) == ERROR)
+        return ERROR;
+      value++;
+      continue;
+    }
+    const char *run = value;
+    while (value < end && *value != ' ' && *value != '\t' && *value != '\n')
+      value++;
+    if (expand_add(e, run, value - run) == ERROR)
+      return ERROR;
+
+    // Pattern characters in the value are unquoted as well
+    for (char *p = e->text + e->len - (value - run); p < e->text + e->len; p++)
+      *p = *p == '*' ? GLOB_STAR : *p == '?' ? GLOB_ANY : *p == '[' ? GLOB_BRACKET : *p;
+  }
+  return 1;
+}
+
+/**
+ * Expands a word marked by the lexer into fields: variables, `$?`, `$$`, command
+ * substitutions and file name patterns. Words without expansions are taken as they are.
+ *
+ * @param e A pointer to the Expansion receiving the fields.
+ * @param word The word.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_word(Expansion *e, char *word)
+{
+  static const char marks[] = {EXPAND_MARK, EXPAND_QUOTED, '\0'};
+  const char *p = word;
+  size_t plain = strcspn(p, marks);
+  if (p[plain] == '\0' && !strpbrk(p, glob_marks))
+    return expand_push(e, word);
+
+  while (*p)
+  {
+    if (plain)
+    {
+      if (expand_add(e, p, plain) == ERROR)
+        return ERROR;
+      e->keep = 1;
+      p += plain;
+      plain = strcspn(p, marks);
+      continue;
+    }
+
+    int quoted = *p++ == EXPAND_QUOTED;
+    e->keep |= quoted;
+    if (*p == '(')
+    {
+      const char *close = strchr(p, EXPAND_END);
+      Capture out;
+      int result = substitute(p + 1, close - p - 1, &out);
+      if (result == ERROR || expand_value(e, out.data, out.len, quoted) == ERROR)
+        return ERROR;
+      p = close + 1;
+    }
+    else
+    {
+      int braced = *p == '{';
+      p += braced;
+      char number[24];
+      const char *value = number;
+      if (*p == '?' || *p == '$')
+      {
+        snprintf(number, sizeof(number), "%d", *p == '?' ? last_status : (int)getpid());
+        p++;
+      }
+      else
+      {
+        size_t len = name_length(p);
+        value = env_lookup(p, len);
+        p += len;
+        p += !braced && *p == EXPAND_END;
+      }
+      p += braced;
+      if (value && expand_value(e, value, strlen(value), quoted) == ERROR)
+        return ERROR;
+    }
+    plain = strcspn(p, marks);
+  }
+
+  // Without splitting there is exactly one field, even if it is empty
+  if (!e->split)
+    e->keep = 1;
+  return expand_field(e);
+}
+
+/**
+ * Expands a list of words into fields.
+ *
+ * @param e A pointer to the Expansion receiving the fields.
+ * @param words The words.
+ * @param count The number of words.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int expand_words(Expansion *e, char **words, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (expand_word(e, words[i]) == ERROR)
+      return ERROR;
+  }
+
+  // Even with no fields at all the vector is NULL terminated
+  if (!e->fields)
+  {
+    if (expand_push(e, NULL) == ERROR)
+      return ERROR;
+    e->count = 0;
+  }
+  return 1;
+}
+
+/**
+ * Expands the words of a pipeline into a copy of it, leaving the syntax tree as
+ * it was parsed for its next run.
+ *
+ * @param pipeline A pointer to the Pipeline to be expanded.
+ * @param arena A pointer to the Arena the copy is made in.
+ * @return A pointer to the expanded copy, or NULL if an expansion failed.
+ */
+static Pipeline *expand_pipeline(Pipeline *pipeline, Arena *arena)
+{
+  Pipeline *copy = arena_alloc(arena, sizeof(Pipeline));
+  Command *commands = arena_alloc(arena, pipeline->count * sizeof(Command));
+  if (!copy || !commands)
+  {
+    perror("Error allocating memory for expansion");
+    return NULL;
+  }
+  *copy = *pipeline;
+  copy->commands = commands;
+
+  for (size_t i = 0; i < pipeline->count; i++)
+  {
+    Command *cmd = &pipeline->commands[i];
+    Expansion args = {.arena = arena, .split = 1};
+    if (expand_words(&args, cmd->args, cmd->arg_count) == ERROR)
+      return NULL;
+    commands[i] = (Command){args.fields[0], args.fields, args.count, cmd->redirects, cmd->redirect_count,
+                            cmd->assigns, cmd->assign_count};
+
+    // Assigned values are never split
+    if (cmd->assign_count)
+    {
+      Expansion assigns = {.arena = arena, .split = 0};
+      if (expand_words(&assigns, cmd->assigns, cmd->assign_count) == ERROR)
+        return NULL;
+      commands[i].assigns = assigns.fields;
+    }
+    if (!cmd->redirect_count)
+      continue;
+
+    Redirect *redirects = arena_alloc(arena, cmd->redirect_count * sizeof(Redirect));
+    if (!redirects)
+    {
+      perror("Error allocating memory for expansion");
+      return NULL;
+    }
+    commands[i].redirects = memcpy(redirects, cmd->redirects, cmd->redirect_count * sizeof(Redirect));
+    for (size_t j = 0; j < cmd->redirect_count; j++)
+    {
+      // A here-string is never split, a file name must stay one field
+      Redirect *r = &redirects[j];
+      Expansion target = {.arena = arena, .split = r->type != REDIR_STRING};
+      if (expand_word(&target, r->target) == ERROR)
+        return NULL;
+      if (target.count != 1 || (r->type == REDIR_DUP && strcmp(target.fields[0], "-") != 0 &&
+                                target.fields[0][strspn(target.fields[0], "0123456789")] != '\0'))
+      {
+        fprintf(stderr, "%s: ambiguous redirect\n", target.count ? target.fields[0] : "");
+        last_status = 1;
+        return NULL;
+      }
+      r->target = target.fields[0];
+    }
+  }
+  return copy;
+}
+
+/**
+ * Executes a list of commands in order, stopping early on ^C.
+ *
+ * @param list A pointer to the first Node of the list.
+ * @param arena A pointer to the Arena for per-pipeline data.
+ * @return 1 to keep the shell running, 0 to exit it, or ERROR.
+ */
+int execute_list(Node *list, Arena *arena)
+{
+  int result = 1;
+  for (Node *node = list; node && result && !interrupted; node = node->next)
+    result = execute_node(node, arena);
+  return result;
+}
+
+/**
+ * Executes one node of a syntax tree. The tree is left as it was, so loop bodies
+ * are simply executed again on every iteration.
+ *
+ * @param node A pointer to the Node to be executed.
+ * @param arena A pointer to the Arena for per-pipeline data.
+ * @return 1 to keep the shell running, 0 to exit it, or ERROR.
+ */
+int execute_node(Node *node, Arena *arena)
+{
+  int result = 1;
+  switch (node->type)
+  {
+  case NODE_PIPELINE:
+    // Nothing of the previous pipeline outlives it, so its memory can be reused
+    arena_reset(arena);
+    return execute_pipeline(node->pipeline, arena);
+
+  case NODE_AND:
+  case NODE_OR:
+    if (!(result = execute_node(node->left, arena)) || interrupted)
+      return result;
+    if ((last_status == 0) == (node->type == NODE_AND))
+      result = execute_node(node->right, arena);
+    return result;
+
+  case NODE_IF:
+    if (!(result = execute_list(node->left, arena)) || interrupted)
+      return result;
+    if (last_status == 0)
+      return execute_list(node->right, arena);
+    if (node->orelse)
+      return execute_list(node->orelse, arena);
+    last_status = 0;
+    return 1;
+
+  case NODE_WHILE:
+  case NODE_UNTIL:
+  {
+    // The status is the body's last one, or 0 if it never ran
+    int status = 0;
+    for (;;)
+    {
+      if (!(result = execute_list(node->left, arena)) || interrupted)
+        return result;
+      if ((last_status == 0) != (node->type == NODE_WHILE))
+        break;
+      if (!(result = execute_list(node->right, arena)) || interrupted)
+        return result;
+      status = last_status;
+    }
+    last_status = status;
+    return result;
+  }
+
+  case NODE_FOR:
+  {
+    // Expanded words outlive the pipelines of the body, so they get an arena of their own
+    Arena words_arena = {0};
+    Expansion expanded = {.arena = &words_arena, .split = 1};
+    char **words = node->words;
+    size_t count = node->word_count;
+    if (node->expand)
+    {
+      if (expand_words(&expanded, node->words, node->word_count) == ERROR)
+      {
+        arena_free(&words_arena);
+        return 1;
+      }
+      words = expanded.fields;
+      count = expanded.count;
+    }
+
+    // Variables live in the environment, where commands see them too
+    last_status = 0;
+    for (size_t i = 0; i < count && result && !interrupted; i++)
+    {
+      env_set(node->name, words[i]);
+      result = execute_list(node->right, arena);
+    }
+    arena_free(&words_arena);
+    return result;
+  }
+  }
+  return result;
+}
+
+/**
+ * Executes the given pipeline as a job, starting every stage up front.
+ * Foreground jobs are waited for; background jobs are added to the job table.
+ *
+ * @param pipeline A pointer to the Pipeline to be executed.
+ * @param arena A pointer to the Arena for per-pipeline data.
+ * @return 1 to keep the shell running, 0 to exit it, or ERROR.
+ */
+int execute_pipeline(Pipeline *pipeline, Arena *arena)
+{
+  // Loop bodies and functions of the tree are parsed once and run many times
+  if (pipeline->runs)
+    trace_counts.ast_hits++;
+  else
+    trace_counts.ast_misses++;
+  pipeline->runs = 1;
+
+  struct timespec start;
+  if (pipeline->expand)
+  {
+    trace_begin(&start);
+    pipeline = expand_pipeline(pipeline, arena);
+    trace_end(TRACE_EXPAND, &start);
+    if (!pipeline)
+      return 1;
+  }
+
+  int timed = (pipeline->timed || opt_timing) && !pipeline->background;
+  if (timed)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // A lone foreground builtin runs in the shell itself
+  Command *first = &pipeline->commands[0];
+  if (pipeline->count == 1 && !pipeline->background && (!first->name || runs_builtin(first)))
+  {
+    struct rusage before, after;
+    if (timed)
+      getrusage(RUSAGE_SELF, &before);
+
+    int result = execute_command(first);
+
+    if (timed)
+    {
+      getrusage(RUSAGE_SELF, &after);
+      timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+      timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+      print_timing(first->name ? first->name : "", &start, &after, pipeline->timed);
+    }
+    return result;
+  }
+
+  // Nothing runs after the last command of a script or -c string, so it can replace the shell
+  const char *path;
+  if (pipeline->exec && pipeline->count == 1 && !pipeline->background && !timed &&
+      (path = strchr(first->name, '/') ? first->name : hash_lookup(first->name)))
+    return exec_command(first, path);
+
+  Job *job = arena_alloc(arena, sizeof(Job));
+  Process *procs = arena_alloc(arena, pipeline->count * sizeof(Process));
+  if (!job || !procs)
+  {
+    perror("Error allocating memory for pipeline");
+    return ERROR;
+  }
+  *job = (Job){.procs = procs, .count = pipeline->count, .background = pipeline->background};
+
+  // Optionally enlarge the pipes for high-throughput stages
+  const char *pipe_size_var = env_get(PIPE_SIZE_VAR);
+  int pipe_size = pipe_size_var ? atoi(pipe_size_var) : 0;
+
+  // Builtin output must not be overtaken by the children's, nor copied into forks
+  fflush(stdout);
+
+  // Without job control, background jobs must not compete with the shell for stdin
+  int fd_in = -1;
+  if (job->background && !job_control)
+    fd_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  for (size_t i = 0; i < pipeline->count; i++)
+  {
+    Command *cmd = &pipeline->commands[i];
+
+    // Close-on-exec keeps every other pipe end out of the children
+    int fds[2] = {-1, -1};
+    if (i + 1 < pipeline->count)
+    {
+      if (pipe2(fds, O_CLOEXEC) == -1)
+      {
+        perror("pipe");
+        fds[0] = fds[1] = -1;
+      }
+      else if (pipe_size > 0)
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    // Builtins need shell code in the child, so only they pay for a fork
+    pid_t pid;
+    if (!cmd->name || runs_builtin(cmd))
+      pid = fork_process(cmd, fd_in, fds[1], job);
+    else
+      pid = spawn_process(cmd, fd_in, fds[1], job);
+
+    // A stage that failed to start counts as already finished with its status
+    procs[i] = (Process){pid, pid == -1 ? JOB_DONE : JOB_RUNNING, (last_status & 0xff) << 8};
+    if (pid != -1 && job_control && job->pgid == 0)
+      job->pgid = pid;
+
+    if (fd_in != -1)
+      close(fd_in);
+    if (fds[1] != -1)
+      close(fds[1]);
+    fd_in = fds[0];
+  }
+
+  if (job->background)
+  {
+    Job *adopted = adopt_job(job, pipeline);
+    if (adopted && job_control)
+      fprintf(stderr, "[%d] %d\n", adopted->id, (int)procs[pipeline->count - 1].pid);
+    last_status = 0;
+    return 1;
+  }
+
+  wait_job(job);
+
+  if (timed)
+  {
+    char *text = pipeline->timed ? NULL : describe_pipeline(pipeline);
+    print_timing(text ? text : "", &start, &job->usage, pipeline->timed);
+    free(text);
+  }
+
+  // A stopped foreground job stays around for `fg` and `bg`
+  if (job_state(job) == JOB_STOPPED)
+  {
+    Job *adopted = adopt_job(job, pipeline);
+    if (adopted)
+      fprintf(stderr, "\n[%d]+  Stopped                 %s\n", adopted->id, adopted->text);
+  }
+  return 1;
+}
+
+/**
+ * Runs a builtin inside the shell with its prefix assignments in effect, then puts
+ * the variables back as they were.
+ *
+ * @param cmd A pointer to the Command to be run.
+ * @return The result of run_builtin.
+ */
+static int run_assigned(Command *cmd)
+{
+  char **saved = calloc(cmd->assign_count, sizeof(char *));
+  if (!saved)
+  {
+    perror("Error allocating memory for environment");
+    last_status = 1;
+    return 1;
+  }
+  for (size_t i = 0; i < cmd->assign_count; i++)
+  {
+    const char *entry = cmd->assigns[i];
+    int len = strchr(entry, '=') - entry;
+    const char *old = env_lookup(entry, len);
+    if (old && asprintf(&saved[i], "%.*s=%s", len, entry, old) == -1)
+      saved[i] = NULL;
+  }
+
+  int result = env_assign(cmd) == ERROR ? (last_status = 1, 1) : run_builtin(cmd);
+
+  // Undone last to first, so a name assigned twice gets its first old value back
+  for (size_t i = cmd->assign_count; i-- > 0;)
+  {
+    const char *entry = cmd->assigns[i];
+    char *name = saved[i] ? NULL : strndup(entry, strchr(entry, '=') - entry);
+    if (saved[i])
+      env_put(saved[i]);
+    else if (name)
+      env_unset(name);
+    free(name);
+  }
+  free(saved);
+  return result;
+}
+
+/**
+ * Executes the given builtin, or bare redirections and assignments, inside the shell.
+ * The command's redirections are applied around it and then undone; assignments
+ * without a command stay.
+ *
+ * @param cmd A pointer to a Command that contains the details of the command to be executed.
+ * @return 1 if the command was successfully executed, 0 to exit the shell, otherwise ERROR.
+ */
+int execute_command(Command *cmd)
+{
+  if (apply_redirects(cmd) == ERROR)
+    return 1;
+  int result = 1;
+  if (cmd->assign_count && cmd->name)
+    result = run_assigned(cmd);
+  else if (cmd->name)
+    result = run_builtin(cmd);
+  else
+    last_status = env_assign(cmd) == ERROR;
+  restore_redirects(cmd);
+  return result;
+}
+
+/**
+ * Runs an external command by replacing the shell with it, which spares a fork
+ * and a wait. The shell must have nothing left to do. If the exec fails, the
+ * redirections, signals and environment are put back and the error is reported
+ * as spawn_process does.
+ *
+ * @param cmd A pointer to the Command to be run.
+ * @param path The path of the program.
+ * @return 1 with last_status set, if the redirections or the exec failed.
+ */
+int exec_command(Command *cmd, const char *path)
+{
+  if (apply_redirects(cmd) == ERROR)
+    return 1;
+  fflush(stdout);
+
+  struct sigaction saved[NSIG];
+  sigset_t mask;
+  for (int sig = 1; sig < NSIG; sig++)
+    sigaction(sig, NULL, &saved[sig]);
+  sigprocmask(SIG_SETMASK, NULL, &mask);
+  Job job = {0};
+  restore_signals(&job);
+
+  char **envp = env_overlay(cmd);
+  int err = ENOMEM;
+  if (envp)
+  {
+    execve(path, cmd->args, envp);
+    err = errno;
+  }
+
+  // The cached binary went away, so forget it and search PATH again
+  if (envp && err == ENOENT && !strchr(cmd->name, '/'))
+  {
+    hash_forget(cmd->name);
+    if (!(path = hash_lookup(cmd->name)))
+      err = -1;
+    else
+    {
+      execve(path, cmd->args, envp);
+      err = errno;
+    }
+  }
+  env_restore(cmd);
+
+  for (int sig = 1; sig < NSIG; sig++)
+  {
+    if (sig != SIGKILL && sig != SIGSTOP)
+      sigaction(sig, &saved[sig], NULL);
+  }
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  restore_redirects(cmd);
+
+  if (err == -1)
+  {
+    fprintf(stderr, "%s: command not found\n", cmd->name);
+    last_status = 127;
+  }
+  else
+  {
+    fprintf(stderr, "%s: %s\n", cmd->name, strerror(err));
+    last_status = err == ENOENT ? 127 : 126;
+  }
+  return 1;
+}
+
+/**
+ * Checks whether a command name refers to a builtin.
+ *
+ * @param name The command name to be checked.
+ * @return 1 if the command is a builtin, otherwise 0.
+ */
+int is_builtin(const char *name)
+{
+  return find_builtin(name) != NULL;
+}
+
+/**
+ * Checks whether a command is run by a builtin. A builtin may leave forms it does not
+ * handle, such as options it lacks, to the program of the same name in PATH.
+ *
+ * @param cmd A pointer to the Command, which must have a name.
+ * @return 1 if a builtin runs it, otherwise 0.
+ */
+int runs_builtin(Command *cmd)
+{
+  const Builtin *builtin = find_builtin(cmd->name);
+  return builtin && (!builtin->handles || builtin->handles(cmd));
+}
+
+/**
+ * Looks up a builtin by name. A switch on the length and first character picks the
+ * only candidate in constant time, so names of external commands, which are looked
+ * up for every command run, are rejected after at most one comparison. The cases
+ * are generated from the builtins table by tools/builtin_cases.awk.
+ *
+ * @param name The command name to be looked up.
+ * @return A pointer to the Builtin, or NULL if there is none of that name.
+ */
+const Builtin *find_builtin(const char *name)
+{
+  size_t len = strnlen(name, 16);
+  size_t i;
+  switch (len << 8 | (unsigned char)name[0])
+  {
+#include "builtin_cases.h"
+  default:
+    return NULL;
+  }
+  return memcmp(name, builtins[i].name, len + 1) == 0 ? &builtins[i] : NULL;
+}
+
+/**
+ * Runs a builtin inside the current process.
+ *
+ * @param cmd A pointer to the Command naming the builtin.
+ * @return 1 to keep the shell running, or 0 to exit it.
+ */
+int run_builtin(Command *cmd)
+{
+  return find_builtin(cmd->name)->run(cmd);
+}
+
+/**
+ * Opens the files and here-strings of a command's redirections in the shell,
+ * so failures are reported by name before anything is started.
+ * Opened descriptors are moved to REDIR_FD_BASE or above and marked close-on-exec.
+ *
+ * @param cmd A pointer to the Command whose redirections are to be opened.
+ * @return 1 on success, otherwise ERROR with every descriptor already closed.
+ */
+int open_redirects(Command *cmd)
+{
+  for (size_t i = 0; i < cmd->redirect_count; i++)
+  {
+    Redirect *r = &cmd->redirects[i];
+    int fd = -1;
+
+    switch (r->type)
+    {
+    case REDIR_IN:
+      fd = open(r->target, O_RDONLY | O_CLOEXEC);
+      break;
+    case REDIR_OUT:
+      fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      break;
+    case REDIR_APPEND:
+      fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+      break;
+    case REDIR_DUP:
+      r->source = strcmp(r->target, "-") == 0 ? -1 : atoi(r->target);
+      continue;
+    case REDIR_STRING:
+    {
+      // The text and a trailing newline are served from an anonymous memory file
+      size_t len = strlen(r->target);
+      fd = memfd_create("seashell-herestring", MFD_CLOEXEC);
+      if (fd != -1)
+      {
+        r->target[len] = '\n';
+        ssize_t written = write(fd, r->target, len + 1);
+        r->target[len] = '\0';
+        if (written != (ssize_t)len + 1 || lseek(fd, 0, SEEK_SET) == -1)
+        {
+          close(fd);
+          fd = -1;
+        }
+      }
+      break;
+    }
+    }
+
+    if (fd != -1 && fd < REDIR_FD_BASE)
+    {
+      int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FD_BASE);
+      close(fd);
+      fd = moved;
+    }
+    if (fd == -1)
+    {
+      fprintf(stderr, "%s: %s\n", r->type == REDIR_STRING ? "here-string" : r->target, strerror(errno));
+      close_redirects(cmd);
+      last_status = 1;
+      return ERROR;
+    }
+    r->source = fd;
+  }
+  return 1;
+}
+
+/**
+ * Closes the descriptors opened by open_redirects.
+ *
+ * @param cmd A pointer to the Command whose redirections were opened.
+ */
+void close_redirects(Command *cmd)
+{
+  for (size_t i = 0; i < cmd->redirect_count; i++)
+  {
+    Redirect *r = &cmd->redirects[i];
+    if (r->type != REDIR_DUP && r->source != -1)
+      close(r->source);
+    r->source = -1;
+  }
+}
+
+/**
+ * Applies a command's redirections to the shell itself, saving the descriptors they replace.
+ *
+ * @param cmd A pointer to the Command whose redirections are to be applied.
+ * @return 1 on success, otherwise ERROR with nothing applied.
+ */
+int apply_redirects(Command *cmd)
+{
+  if (cmd->redirect_count == 0)
+    return 1;
+  if (open_redirects(cmd) == ERROR)
+    return ERROR;
+
+  fflush(stdout);
+  for (size_t i = 0; i < cmd->redirect_count; i++)
+  {
+    Redirect *r = &cmd->redirects[i];
+    r->saved = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIR_FD_BASE);
+    if (r->source == -1)
+      close(r->fd);
+    else if (dup2(r->source, r->fd) == -1)
+      perror("dup2");
+  }
+  return 1;
+}
+
+/**
+ * Undoes apply_redirects, putting the shell's own descriptors back in reverse order.
+ *
+ * @param cmd A pointer to the Command whose redirections were applied.
+ */
+void restore_redirects(Command *cmd)
+{
+  if (cmd->redirect_count == 0)
+    return;
+
+  fflush(stdout);
+  for (size_t i = cmd->redirect_count; i-- > 0;)
+  {
+    Redirect *r = &cmd->redirects[i];
+    if (r->saved == -1)
+      close(r->fd);
+    else
+    {
+      dup2(r->saved, r->fd);
+      close(r->saved);
+    }
+    r->saved = -1;
+  }
+  close_redirects(cmd);
+}
+
+/**
+ * Fills in the signals whose default disposition a child of the given job gets back.
+ * The shell may ignore them, and ignored signals survive exec. Without job control,
+ * background jobs keep ignoring SIGINT and SIGQUIT.
+ *
+ * @param set The set to be filled.
+ * @param job A pointer to the Job the child belongs to.
+ */
+static void child_signals(sigset_t *set, Job *job)
+{
+  sigemptyset(set);
+  if (job_control || !job->background)
+  {
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGQUIT);
+  }
+  sigaddset(set, SIGTSTP);
+  sigaddset(set, SIGTTIN);
+  sigaddset(set, SIGTTOU);
+  sigaddset(set, SIGPIPE);
+}
+
+/**
+ * Gives the calling process the signal dispositions and mask of a child of the
+ * given job, for a forked child or for the shell about to exec a command.
+ *
+ * @param job A pointer to the Job the process belongs to.
+ */
+void restore_signals(Job *job)
+{
+  sigset_t defaults;
+  child_signals(&defaults, job);
+  for (int sig = 1; sig < NSIG; sig++)
+  {
+    if (sigismember(&defaults, sig) == 1)
+      signal(sig, SIG_DFL);
+  }
+  sigemptyset(&defaults);
+  sigprocmask(SIG_SETMASK, &defaults, NULL);
+}
+
+/**
+ * Returns the spawn attributes shared by every child launched with posix_spawn.
+ * They are built once and reused, so the per-command cost is only the spawn itself;
+ * only the job dependent parts are updated for each child.
+ *
+ * @param job A pointer to the Job the child will belong to.
+ * @return A pointer to the initialized attributes, or NULL if they could not be set up.
+ */
+static posix_spawnattr_t *spawn_attributes(Job *job)
+{
+  static posix_spawnattr_t attr;
+  static int ready = 0;
+
+  if (!ready)
+  {
+    if (posix_spawnattr_init(&attr) != 0)
+      return NULL;
+
+    // SIGCHLD is blocked in the shell for the signalfd, but children start unblocked
+    sigset_t mask;
+    sigemptyset(&mask);
+    if (posix_spawnattr_setsigmask(&attr, &mask) != 0)
+    {
+      posix_spawnattr_destroy(&attr);
+      return NULL;
+    }
+    ready = 1;
+  }
+
+  // Replaces `signal(SIGINT, SIG_DFL)` and friends in the child
+  sigset_t defaults;
+  child_signals(&defaults, job);
+
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  if (job_control)
+  {
+    // Every job gets its own process group, led by its first process
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, job->pgid);
+  }
+
+  if (posix_spawnattr_setsigdefault(&attr, &defaults) != 0 ||
+      posix_spawnattr_setflags(&attr, flags) != 0)
+    return NULL;
+  return &attr;
+}
+
+/**
+ * Starts the given command in a new process using posix_spawnp.
+ *
+ * glibc implements posix_spawn with CLONE_VM | CLONE_VFORK, so the shell's page
+ * tables are never copied no matter how large the shell has grown.
+ *
+ * @param cmd A pointer to the Command to be started.
+ * @param fd_in Descriptor to become the child's stdin, or -1 to inherit it.
+ * @param fd_out Descriptor to become the child's stdout, or -1 to inherit it.
+ * @param job A pointer to the Job the child belongs to.
+ * @return The pid of the new process, or -1 if it could not be started.
+ */
+pid_t spawn_process(Command *cmd, int fd_in, int fd_out, Job *job)
+{
+  posix_spawnattr_t *attr = spawn_attributes(job);
+  if (!attr)
+  {
+    // Without attributes the child would inherit SIG_IGN for SIGINT
+    return fork_process(cmd, fd_in, fd_out, job);
+  }
+
+  // Names containing a slash are never looked up in PATH
+  int hashed = strchr(cmd->name, '/') == NULL;
+  const char *path = hashed ? hash_lookup(cmd->name) : cmd->name;
+  if (!path)
+  {
+    fprintf(stderr, "%s: command not found\n", cmd->name);
+    last_status = 127;
+    return -1;
+  }
+
+  if (open_redirects(cmd) == ERROR)
+    return -1;
+
+  // A foreground job's leader takes the terminal before exec, so it cannot race the shell
+  int take_terminal = job_control && !job->background && job->pgid == 0;
+
+  // Pipe ends and redirections are moved into place by the child itself
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_t *file_actions = NULL;
+  if (fd_in != -1 || fd_out != -1 || cmd->redirect_count > 0 || take_terminal)
+  {
+    file_actions = &actions;
+    posix_spawn_file_actions_init(file_actions);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    if (take_terminal)
+      posix_spawn_file_actions_addtcsetpgrp_np(file_actions, STDIN_FILENO);
+#endif
+    if (fd_in != -1)
+      posix_spawn_file_actions_adddup2(file_actions, fd_in, STDIN_FILENO);
+    if (fd_out != -1)
+      posix_spawn_file_actions_adddup2(file_actions, fd_out, STDOUT_FILENO);
+    for (size_t i = 0; i < cmd->redirect_count; i++)
+    {
+      Redirect *r = &cmd->redirects[i];
+      if (r->source == -1)
+        posix_spawn_file_actions_addclose(file_actions, r->fd);
+      else
+        posix_spawn_file_actions_adddup2(file_actions, r->source, r->fd);
+    }
+  }
+
+  // Prefix assignments are laid over the environment for this spawn only
+  struct timespec start;
+  trace_begin(&start);
+  pid_t pid;
+  char **envp = env_overlay(cmd);
+  int err = envp ? posix_spawn(&pid, path, file_actions, attr, cmd->args, envp) : ENOMEM;
+
+  // The cached binary went away, so forget it and search PATH again
+  if (err == ENOENT && hashed)
+  {
+    hash_forget(cmd->name);
+    if (!(path = hash_lookup(cmd->name)))
+      err = -1;
+    else
+      err = posix_spawn(&pid, path, file_actions, attr, cmd->args, envp);
+  }
+  env_restore(cmd);
+  trace_end(TRACE_SPAWN, &start);
+
+  if (file_actions)
+    posix_spawn_file_actions_destroy(file_actions);
+  close_redirects(cmd);
+
+  // Also done by the parent, in case the child could not do it itself
+  if (err == 0 && take_terminal)
+    tcsetpgrp(STDIN_FILENO, pid);
+
+  if (err == -1)
+  {
+    fprintf(stderr, "%s: command not found\n", cmd->name);
+    last_status = 127;
+    return -1;
+  }
+  if (err != 0)
+  {
+    fprintf(stderr, "%s: %s\n", cmd->name, strerror(err));
+    last_status = err == ENOENT ? 127 : 126;
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * Starts the given command in a new process using fork, running builtins in the
+ * child and exec'ing anything else with execv.
+ *
+ * This copies the shell's page tables, so it is only a fallback for children
+ * that need to run shell code before exec (e.g. subshells, builtins in pipelines).
+ *
+ * @param cmd A pointer to the Command to be started.
+ * @param fd_in Descriptor to become the child's stdin, or -1 to inherit it.
+ * @param fd_out Descriptor to become the child's stdout, or -1 to inherit it.
+ * @param job A pointer to the Job the child belongs to.
+ * @return The pid of the new process, or -1 if it could not be started.
+ */
+pid_t fork_process(Command *cmd, int fd_in, int fd_out, Job *job)
+{
+  // Resolve in the parent so the result stays in the shell's hash table
+  int builtin = !cmd->name || runs_builtin(cmd);
+  const char *path = cmd->name;
+  if (!builtin && !strchr(cmd->name, '/') && !(path = hash_lookup(cmd->name)))
+  {
+    fprintf(stderr, "%s: command not found\n", cmd->name);
+    last_status = 127;
+    return -1;
+  }
+
+  if (open_redirects(cmd) == ERROR)
+    return -1;
+
+  struct timespec start;
+  trace_begin(&start);
+  pid_t pid = fork();
+  if (pid > 0)
+    trace_end(TRACE_SPAWN, &start);
+  if (pid == -1)
+  {
+    perror("fork");
+    close_redirects(cmd);
+    last_status = 126;
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    // Join the job's process group, taking the terminal if leading a foreground job
+    if (job_control)
+    {
+      setpgid(0, job->pgid);
+      if (!job->background && job->pgid == 0)
+        tcsetpgrp(STDIN_FILENO, getpid());
+    }
+
+    restore_signals(job);
+
+    if (fd_in != -1)
+      dup2(fd_in, STDIN_FILENO);
+    if (fd_out != -1)
+      dup2(fd_out, STDOUT_FILENO);
+    for (size_t i = 0; i < cmd->redirect_count; i++)
+    {
+      Redirect *r = &cmd->redirects[i];
+      if (r->source == -1)
+        close(r->fd);
+      else
+        dup2(r->source, r->fd);
+    }
+    env_assign(cmd);
+
+    if (builtin)
+    {
+      // Its own children are reaped through the signalfd, as in the shell
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGCHLD);
+      sigprocmask(SIG_BLOCK, &set, NULL);
+      event_init();
+      last_status = 0;
+      if (cmd->name)
+        run_builtin(cmd);
+      fflush(stdout);
+      _exit(last_status);
+    }
+    execv(path, cmd->args);
+    perror("execv");
+    exit(errno == ENOENT ? 127 : 126);
+  }
+
+  close_redirects(cmd);
+  if (job_control)
+  {
+    setpgid(pid, job->pgid ? job->pgid : pid);
+    if (!job->background && job->pgid == 0)
+      tcsetpgrp(STDIN_FILENO, pid);
+  }
+  return pid;
+}
+
+/**
+ * Reaps children once SIGCHLD has arrived on the signalfd.
+ *
+ * @param source A pointer to the EventSource of the signalfd.
+ * @param events The epoll events that are ready.
+ */
+static void child_ready(EventSource *source, unsigned int events)
+{
+  (void)events;
+  struct signalfd_siginfo info;
+  while (read(source->fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  reap_children(WNOHANG);
+}
+
+/**
+ * Creates the event loop, watching the signalfd for SIGCHLD. A forked child that
+ * goes on running shell code calls it again, since an epoll instance is shared
+ * across fork and the child must not change the parent's.
+ *
+ * @return 1 on success, otherwise ERROR.
+ */
+int event_init(void)
+{
+  if (event_fd != -1)
+    close(event_fd);
+  if ((event_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+  {
+    perror("epoll_create1");
+    return ERROR;
+  }
+  child_source = (EventSource){child_fd, child_ready, NULL};
+  return child_fd == -1 ? 1 : event_add(&child_source, EPOLLIN);
+}
+
+/**
+ * Starts watching a descriptor.
+ *
+ * @param source A pointer to the EventSource, which must stay valid until it is removed.
+ * @param events The epoll events to wait for.
+ * @return 1 on success, otherwise ERROR.
+ */
+int event_add(EventSource *source, unsigned int events)
+{
+  struct epoll_event event = {.events = events, .data.ptr = source};
+  if (epoll_ctl(event_fd, EPOLL_CTL_ADD, source->fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    return ERROR;
+  }
+  return 1;
+}
+
+/**
+ * Stops watching a descriptor.
+ *
+ * @param source A pointer to the EventSource.
+ */
+void event_remove(EventSource *source)
+{
+  epoll_ctl(event_fd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/**
+ * Waits for watched descriptors to become ready and handles them, a batch at a time.
+ *
+ * @param timeout The longest time to wait in milliseconds, or -1 to wait until something happens.
+ * @return The number of descriptors handled, or ERROR.
+ */
+int event_wait(int timeout)
+{
+  struct epoll_event events[EVENT_BATCH];
+  int count = epoll_wait(event_fd, events, EVENT_BATCH, timeout);
+  if (count == -1)
+  {
+    if (errno == EINTR)
+      return 0;
+    perror("epoll_wait");
+    return ERROR;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    EventSource *source = events[i].data.ptr;
+    source->ready(source, events[i].events);
+  }
+  return count;
+}
+
+/**
+ * Notes that the descriptor event_wait_readable waits for is ready.
+ *
+ * @param source A pointer to the EventSource.
+ * @param events The epoll events that are ready.
+ */
+static void readable_ready(EventSource *source, unsigned int events)
+{
+  (void)events;
+  *(int *)source->data = 1;
+}
+
+/**
+ * Waits until a descriptor can be read, handling everything else that happens meanwhile.
+ *
+ * @param fd The descriptor.
+ * @return 1 once it can be read, otherwise ERROR.
+ */
+int event_wait_readable(int fd)
+{
+  int ready = 0;
+  EventSource source = {fd, readable_ready, &ready};
+  if (event_add(&source, EPOLLIN) == ERROR)
+    return ERROR;
+  int result = 1;
+  while (!ready && result != ERROR)
+    result = event_wait(-1);
+  event_remove(&source);
+  return ready ? 1 : ERROR;
+}
+
+/**
+ * Sets up child reaping through a signalfd and, for interactive shells, job control.
+ *
+ * @param interactive Whether the shell reads commands from a terminal.
+ */
+void init_jobs(int interactive)
+{
+  // SIGCHLD stays blocked so it is only ever consumed through the signalfd
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  child_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd == -1)
+    perror("signalfd");
+  event_init();
+
+  if (!interactive)
+    return;
+
+  // Wait until the shell is in the foreground before taking the terminal
+  pid_t pgrp;
+  while (tcgetpgrp(STDIN_FILENO) != (pgrp = getpgrp()))
+    kill(-pgrp, SIGTTIN);
+
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+
+  // A session leader cannot change its group, so keep the one it already leads
+  if (setpgid(0, 0) == -1 && errno != EPERM)
+  {
+    perror("setpgid");
+    return;
+  }
+  shell_pgid = getpgrp();
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  tcgetattr(STDIN_FILENO, &shell_tmodes);
+  job_control = 1;
+}
+
+/**
+ * Computes the state of a job from the states of its processes.
+ *
+ * @param job A pointer to the Job to be inspected.
+ * @return JOB_RUNNING if any process runs, JOB_STOPPED if any is stopped, otherwise JOB_DONE.
+ */
+int job_state(Job *job)
+{
+  int state = JOB_DONE;
+  for (size_t i = 0; i < job->count; i++)
+  {
+    if (job->procs[i].state == JOB_RUNNING)
+      return JOB_RUNNING;
+    if (job->procs[i].state == JOB_STOPPED)
+      state = JOB_STOPPED;
+  }
+  return state;
+}
+
+/**
+ * Converts the raw wait status of a job's last process into an exit status.
+ *
+ * @param job A pointer to the Job to be inspected.
+ * @return The exit status, or 128 plus the signal that stopped or killed it.
+ */
+static int job_status(Job *job)
+{
+  int status = job->procs[job->count - 1].status;
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+/**
+ * Records a state change reported by wait4 in the job owning the process.
+ *
+ * @param pid The process that changed state.
+ * @param status The raw wait status.
+ * @param usage The resources used by the process if it terminated.
+ */
+static void record_child(pid_t pid, int status, const struct rusage *usage)
+{
+  for (size_t slot = 0; slot <= job_slots; slot++)
+  {
+    // The foreground job is checked first, it is not in the table
+    Job *job = slot == 0 ? foreground_job : job_table[slot - 1];
+    if (!job)
+      continue;
+
+    for (size_t i = 0; i < job->count; i++)
+    {
+      Process *proc = &job->procs[i];
+      if (proc->pid != pid)
+        continue;
+
+      if (WIFCONTINUED(status))
+        proc->state = JOB_RUNNING;
+      else
+      {
+        proc->state = WIFSTOPPED(status) ? JOB_STOPPED : JOB_DONE;
+        proc->status = status;
+      }
+
+      if (proc->state == JOB_DONE)
+      {
+        timeradd(&job->usage.ru_utime, &usage->ru_utime, &job->usage.ru_utime);
+        timeradd(&job->usage.ru_stime, &usage->ru_stime, &job->usage.ru_stime);
+        if (usage->ru_maxrss > job->usage.ru_maxrss)
+          job->usage.ru_maxrss = usage->ru_maxrss;
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Reaps every child that has changed state, without blocking when options has WNOHANG.
+ *
+ * @param options Extra waitpid options.
+ */
+void reap_children(int options)
+{
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, options | WUNTRACED | WCONTINUED, &usage)) > 0)
+    record_child(pid, status, &usage);
+}
+
+/**
+ * Reaps finished background children if SIGCHLD arrived, then reports and
+ * forgets the background jobs that are done.
+ */
+void check_jobs(void)
+{
+  if (job_slots == 0)
+    return;
+
+  struct signalfd_siginfo info;
+  int pending = 0;
+  while (read(child_fd, &info, sizeof(info)) == sizeof(info))
+    pending = 1;
+  if (pending)
+    reap_children(WNOHANG);
+
+  for (size_t i = 0; i < job_slots; i++)
+  {
+    Job *job = job_table[i];
+    if (!job || job_state(job) != JOB_DONE)
+      continue;
+
+    if (job_control)
+    {
+      int status = job_status(job);
+      if (status == 0)
+        fprintf(stderr, "[%d]   Done                    %s\n", job->id, job->text);
+      else
+        fprintf(stderr, "[%d]   Exit %-3d                %s\n", job->id, status, job->text);
+    }
+    free_job(job);
+  }
+}
+
+/**
+ * Waits until no process of a job is running, then records its exit status.
+ * Children of other jobs that change state in the meantime are recorded too.
+ * With job control, a foreground job is given the terminal for as long as it runs.
+ *
+ * @param job A pointer to the Job to be waited for.
+ * @return 1 on success, otherwise ERROR.
+ */
+int wait_job(Job *job)
+{
+  int result = 1;
+  if (!job->id)
+    foreground_job = job;
+  fflush(stdout);
+  struct timespec start;
+  trace_begin(&start);
+
+  // Children are reaped as SIGCHLD comes in through the event loop
+  reap_children(WNOHANG);
+  while (job_state(job) == JOB_RUNNING)
+  {
+    if (event_wait(-1) == ERROR)
+    {
+      result = ERROR;
+      break;
+    }
+  }
+  foreground_job = NULL;
+  trace_end(TRACE_WAIT, &start);
+
+  // A ^C that killed the job also stops the rest of the line
+  int status = job->procs[job->count - 1].status;
+  if (job_state(job) == JOB_DONE && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+    interrupted = 1;
+
+  // Take the terminal back from a foreground job
+  if (job_control && !job->background)
+  {
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+
+    // Say why it died, keeping the prompt off the ^C line
+    if (job_state(job) == JOB_DONE && WIFSIGNALED(status))
+    {
+      if (WTERMSIG(status) == SIGINT)
+        fputc('\n', stderr);
+      else if (WTERMSIG(status) != SIGPIPE)
+        fprintf(stderr, "%s%s\n", strsignal(WTERMSIG(status)), WCOREDUMP(status) ? " (core dumped)" : "");
+    }
+  }
+
+  last_status = job_status(job);
+  return result;
+}
+
+/**
+ * Renders a pipeline back into command text for job listings.
+ *
+ * @param pipeline A pointer to the Pipeline to be described.
+ * @return The newly allocated text, or NULL if the allocation failed.
+ */
+char *describe_pipeline(Pipeline *pipeline)
+{
+  static const char *ops[] = {"<", ">", ">>", ">&", "<<<"};
+
+  size_t len = 1;
+  for (size_t i = 0; i < pipeline->count; i++)
+  {
+    Command *cmd = &pipeline->commands[i];
+    for (size_t j = 0; j < cmd->assign_count; j++)
+      len += strlen(cmd->assigns[j]) + 1;
+    for (size_t j = 0; j < cmd->arg_count; j++)
+      len += strlen(cmd->args[j]) + 1;
+    for (size_t j = 0; j < cmd->redirect_count; j++)
+      len += strlen(cmd->redirects[j].target) + 16;
+    len += 3;
+  }
+
+  char *text = malloc(len);
+  if (!text)
+    return NULL;
+
+  char *p = text;
+  for (size_t i = 0; i < pipeline->count; i++)
+  {
+    Command *cmd = &pipeline->commands[i];
+    if (i > 0)
+      p = stpcpy(p, " | ");
+    for (size_t j = 0; j < cmd->assign_count; j++)
+      p += sprintf(p, "%s ", cmd->assigns[j]);
+    for (size_t j = 0; j < cmd->arg_count; j++)
+      p += sprintf(p, j ? " %s" : "%s", cmd->args[j]);
+    for (size_t j = 0; j < cmd->redirect_count; j++)
+    {
+      Redirect *r = &cmd->redirects[j];
+      int implied = r->fd == (r->type == REDIR_IN || r->type == REDIR_STRING ? STDIN_FILENO : STDOUT_FILENO);
+      if (r->type == REDIR_DUP && r->fd == STDIN_FILENO)
+        implied = 0;
+      p += sprintf(p, p == text || p[-1] == ' ' ? "" : " ");
+      if (!implied)
+        p += sprintf(p, "%d", r->fd);
+      p += sprintf(p, "%s%s", ops[r->type], r->target);
+    }
+  }
+  if (p > text && p[-1] == ' ')
+    p--;
+  *p = '\0';
+  return text;
+}
+
+/**
+ * Moves a job out of the per-pipeline arena into the job table, giving it a job number.
+ *
+ * @param job A pointer to the arena allocated Job.
+ * @param pipeline A pointer to the Pipeline the job runs, used for its text.
+ * @return A pointer to the job in the table, or NULL if it could not be added.
+ */
+Job *adopt_job(Job *job, Pipeline *pipeline)
+{
+  Job *copy = malloc(sizeof(Job));
+  Process *procs = malloc(job->count * sizeof(Process));
+  char *text = describe_pipeline(pipeline);
+  if (!copy || !procs || !text)
+  {
+    perror("Error allocating memory for job");
+    free(copy);
+    free(procs);
+    free(text);
+    return NULL;
+  }
+  *copy = *job;
+  memcpy(procs, job->procs, job->count * sizeof(Process));
+  copy->procs = procs;
+  copy->text = text;
+  copy->seq = ++job_seq;
+
+  // Job numbers are reused from the lowest free one
+  size_t slot = 0;
+  while (slot < job_slots && job_table[slot])
+    slot++;
+  if (slot == job_slots)
+  {
+    Job **table = realloc(job_table, (job_slots + 1) * sizeof(Job *));
+    if (!table)
+    {
+      perror("Error allocating memory for job");
+      free(copy->procs);
+      free(copy->text);
+      free(copy);
+      return NULL;
+    }
+    job_table = table;
+    job_slots++;
+  }
+  job_table[slot] = copy;
+  copy->id = slot + 1;
+  return copy;
+}
+
+/**
+ * Removes a job from the job table and frees it.
+ *
+ * @param job A pointer to the Job to be freed.
+ */
+void free_job(Job *job)
+{
+  job_table[job->id - 1] = NULL;
+  while (job_slots > 0 && !job_table[job_slots - 1])
+    job_slots--;
+  free(job->procs);
+  free(job->text);
+  free(job);
+}
+
+/**
+ * Finds the current job, the one most recently started or stopped.
+ *
+ * @param skip A job to be ignored, to find the previous job instead.
+ * @return A pointer to the Job, or NULL if there are no jobs.
+ */
+static Job *current_job(Job *skip)
+{
+  Job *best = NULL;
+  for (size_t i = 0; i < job_slots; i++)
+  {
+    Job *job = job_table[i];
+    if (job && job != skip && (!best || job->seq > best->seq))
+      best = job;
+  }
+  return best;
+}
+
+/**
+ * Resolves a job spec: %n, n, %%, %+ or %-. NULL means the current job.
+ *
+ * @param spec The job spec, or NULL.
+ * @param builtin The builtin name used in error messages.
+ * @return A pointer to the Job, or NULL if there is no such job.
+ */
+Job *find_job(const char *spec, const char *builtin)
+{
+  Job *job = NULL;
+  if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+    job = current_job(NULL);
+  else if (strcmp(spec, "%-") == 0)
+    job = current_job(current_job(NULL));
+  else
+  {
+    const char *digits = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long id = strtol(digits, &end, 10);
+    if (*digits && *end == '\0' && id > 0 && (size_t)id <= job_slots)
+      job = job_table[id - 1];
+  }
+
+  if (!job)
+    fprintf(stderr, "%s: %s: no such job\n", builtin, spec ? spec : "current");
+  return job;
+}
+
+/**
+ * Runs the built-in `jobs` command, listing the job table. `-l` adds pids, `-p` prints only pids.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int jobs_builtin(Command *cmd)
+{
+  int pids_only = cmd->arg_count > 1 && strcmp(cmd->args[1], "-p") == 0;
+  int long_format = cmd->arg_count > 1 && strcmp(cmd->args[1], "-l") == 0;
+
+  // Show current states, not the ones from the last prompt
+  reap_children(WNOHANG);
+
+  Job *current = current_job(NULL);
+  Job *previous = current_job(current);
+  for (size_t i = 0; i < job_slots; i++)
+  {
+    Job *job = job_table[i];
+    if (!job)
+      continue;
+
+    if (pids_only)
+    {
+      printf("%d\n", (int)(job->pgid ? job->pgid : job->procs[0].pid));
+      continue;
+    }
+
+    int state = job_state(job);
+    char mark = job == current ? '+' : job == previous ? '-' : ' ';
+    const char *label = state == JOB_RUNNING ? "Running" : state == JOB_STOPPED ? "Stopped" : "Done";
+    printf("[%d]%c  ", job->id, mark);
+    if (long_format)
+      printf("%d ", (int)job->procs[0].pid);
+    printf("%-22s  %s%s\n", label, job->text, state == JOB_RUNNING ? " &" : "");
+  }
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Runs the built-in `wait` command. Without arguments it waits for every job;
+ * otherwise for each %job or pid given, returning the status of the last one.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int wait_builtin(Command *cmd)
+{
+  last_status = 0;
+  if (cmd->arg_count == 1)
+  {
+    for (size_t i = 0; i < job_slots; i++)
+    {
+      Job *job = job_table[i];
+      if (!job)
+        continue;
+      wait_job(job);
+      if (job_state(job) == JOB_DONE)
+        free_job(job);
+    }
+    last_status = 0;
+    return 1;
+  }
+
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *arg = cmd->args[i];
+    Job *job = NULL;
+    if (arg[0] == '%')
+      job = find_job(arg, "wait");
+    else
+    {
+      pid_t pid = atoi(arg);
+      for (size_t slot = 0; slot < job_slots && !job; slot++)
+      {
+        for (size_t j = 0; job_table[slot] && j < job_table[slot]->count; j++)
+        {
+          if (job_table[slot]->procs[j].pid == pid)
+            job = job_table[slot];
+        }
+      }
+      if (!job)
+        fprintf(stderr, "wait: pid %s is not a child of this shell\n", arg);
+    }
+
+    if (!job)
+    {
+      last_status = 127;
+      continue;
+    }
+    wait_job(job);
+    if (job_state(job) == JOB_DONE)
+      free_job(job);
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `fg` command, continuing a job in the foreground and waiting for it.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int fg_builtin(Command *cmd)
+{
+  last_status = 1;
+  if (!job_control)
+  {
+    fprintf(stderr, "fg: no job control\n");
+    return 1;
+  }
+
+  Job *job = find_job(cmd->arg_count > 1 ? cmd->args[1] : NULL, "fg");
+  if (!job)
+    return 1;
+
+  printf("%s\n", job->text);
+  fflush(stdout);
+
+  job->background = 0;
+  tcsetpgrp(STDIN_FILENO, job->pgid);
+  if (kill(-job->pgid, SIGCONT) == -1)
+    perror("fg");
+  for (size_t i = 0; i < job->count; i++)
+  {
+    if (job->procs[i].state == JOB_STOPPED)
+      job->procs[i].state = JOB_RUNNING;
+  }
+
+  wait_job(job);
+  if (job_state(job) == JOB_STOPPED)
+  {
+    job->seq = ++job_seq;
+    fprintf(stderr, "\n[%d]+  Stopped                 %s\n", job->id, job->text);
+  }
+  else
+    free_job(job);
+  return 1;
+}
+
+/**
+ * Runs the built-in `bg` command, continuing a stopped job in the background.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int bg_builtin(Command *cmd)
+{
+  last_status = 1;
+  if (!job_control)
+  {
+    fprintf(stderr, "bg: no job control\n");
+    return 1;
+  }
+
+  Job *job = find_job(cmd->arg_count > 1 ? cmd->args[1] : NULL, "bg");
+  if (!job)
+    return 1;
+
+  job->background = 1;
+  if (kill(-job->pgid, SIGCONT) == -1)
+  {
+    perror("bg");
+    return 1;
+  }
+  for (size_t i = 0; i < job->count; i++)
+  {
+    if (job->procs[i].state == JOB_STOPPED)
+      job->procs[i].state = JOB_RUNNING;
+  }
+  printf("[%d]+ %s &\n", job->id, job->text);
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Builds the command run by `parallel` for one argument, substituting it for every
+ * `{}` in the template, or appending it when the template has none.
+ *
+ * @param cmd A pointer to the Command to be filled.
+ * @param words The template words, NULL terminated.
+ * @param count The number of template words.
+ * @param arg The argument to be substituted.
+ * @param arena A pointer to the Arena holding the built command.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int parallel_command(Command *cmd, char **words, size_t count, const char *arg, Arena *arena)
+{
+  char **args = arena_alloc(arena, (count + 2) * sizeof(char *));
+  if (!args)
+    return ERROR;
+
+  int substituted = 0;
+  size_t arg_len = strlen(arg);
+  for (size_t i = 0; i < count; i++)
+  {
+    const char *word = words[i];
+    size_t holes = 0;
+    for (const char *p = word; (p = strstr(p, "{}")); p += 2)
+      holes++;
+    if (holes == 0)
+    {
+      args[i] = words[i];
+      continue;
+    }
+
+    char *out = arena_alloc(arena, strlen(word) + holes * arg_len + 1);
+    if (!out)
+      return ERROR;
+    args[i] = out;
+    for (const char *p = word; *p;)
+    {
+      if (p[0] == '{' && p[1] == '}')
+      {
+        out = mempcpy(out, arg, arg_len);
+        p += 2;
+      }
+      else
+        *out++ = *p++;
+    }
+    *out = '\0';
+    substituted = 1;
+  }
+
+  size_t argc = count;
+  if (!substituted)
+    args[argc++] = (char *)arg;
+  args[argc] = NULL;
+  *cmd = (Command){args[0], args, argc, NULL, 0, NULL, 0};
+  return 1;
+}
+
+/**
+ * Runs the built-in `parallel [-j N] command... [::: args...]` command.
+ * The command is run once per argument, read from stdin lines when `:::` is absent,
+ * with up to N children in flight. A new child starts as soon as one exits.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running. The status is the number of failed runs, capped at 101.
+ */
+int parallel_builtin(Command *cmd)
+{
+  long slots = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t first = 1;
+  if (first < cmd->arg_count && strncmp(cmd->args[first], "-j", 2) == 0)
+  {
+    const char *count = cmd->args[first][2] ? cmd->args[first] + 2 : cmd->args[++first];
+    char *end;
+    slots = count ? strtol(count, &end, 10) : -1;
+    if (!count || *end != '\0' || slots < 0)
+    {
+      fprintf(stderr, "parallel: -j: invalid job count\n");
+      last_status = 2;
+      return 1;
+    }
+    first++;
+  }
+
+  // The template runs up to `:::`, and the arguments follow it
+  size_t sep = first;
+  while (sep < cmd->arg_count && strcmp(cmd->args[sep], ":::") != 0)
+    sep++;
+  if (sep == first)
+  {
+    fprintf(stderr, "usage: parallel [-j N] command [args...] [::: args...]\n");
+    last_status = 2;
+    return 1;
+  }
+  int from_stdin = sep == cmd->arg_count;
+  size_t next_arg = sep + 1;
+  if (slots == 0)
+    slots = from_stdin ? sysconf(_SC_NPROCESSORS_ONLN) : (long)(cmd->arg_count - next_arg);
+  if (slots < 1)
+    slots = 1;
+
+  // Children share the shell's process group, so ^C reaches all of them.
+  // Each slot is a process of the job, free while its pid is 0.
+  Process *running = calloc(slots, sizeof(Process));
+  if (!running)
+  {
+    perror("Error allocating memory for parallel");
+    last_status = 1;
+    return 1;
+  }
+
+  Job job = {.pgid = job_control ? shell_pgid : 0, .procs = running, .count = slots};
+  Input input = {STDIN_FILENO, NULL, 0, 0, 0, 0, NULL};
+  Arena arena = {0};
+  long in_flight = 0;
+  long free_slot = 0;
+  long failed = 0;
+  int more = 1;
+
+  fflush(stdout);
+  foreground_job = &job;
+  while (more || in_flight > 0)
+  {
+    // Fill every free slot before waiting
+    while (more && in_flight < slots)
+    {
+      char *arg;
+      if (from_stdin)
+        more = next_line(&input, &arg) >= 0;
+      else if ((more = next_arg < cmd->arg_count))
+        arg = cmd->args[next_arg++];
+      if (!more)
+        break;
+
+      Command child;
+      arena_reset(&arena);
+      if (parallel_command(&child, cmd->args + first, sep - first, arg, &arena) == ERROR)
+      {
+        perror("Error allocating memory for parallel");
+        failed++;
+        continue;
+      }
+
+      pid_t pid = runs_builtin(&child) ? fork_process(&child, -1, -1, &job)
+                                         : spawn_process(&child, -1, -1, &job);
+      if (pid == -1)
+        failed++;
+      else
+      {
+        while (running[free_slot].pid)
+          free_slot = (free_slot + 1) % slots;
+        running[free_slot] = (Process){pid, JOB_RUNNING, 0};
+        in_flight++;
+      }
+    }
+    if (in_flight == 0)
+      break;
+
+    // Children are recorded in their slots as the event loop reaps them
+    reap_children(WNOHANG);
+    long done = 0;
+    for (long i = 0; i < slots; i++)
+      done += running[i].pid && running[i].state == JOB_DONE;
+    if (done == 0 && event_wait(-1) == ERROR)
+    {
+      failed += in_flight;
+      break;
+    }
+
+    for (long i = 0; i < slots; i++)
+    {
+      if (!running[i].pid || running[i].state != JOB_DONE)
+        continue;
+      int status = running[i].status;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed++;
+      running[i].pid = 0;
+      in_flight--;
+    }
+  }
+
+  foreground_job = NULL;
+  close_input(&input);
+  arena_free(&arena);
+  free(running);
+  last_status = failed > PARALLEL_MAX_STATUS ? PARALLEL_MAX_STATUS : (int)failed;
+  return 1;
+}
+
+/**
+ * Reports the time and resources a command used on stderr.
+ * The `time` keyword gets the familiar multi-line report; `set -o timing` gets one
+ * line per command so the slowest ones are easy to pick out of a log.
+ *
+ * @param text The command text shown with `set -o timing`.
+ * @param start When the command was started, from CLOCK_MONOTONIC.
+ * @param usage The user and system time and max RSS used by the command.
+ * @param keyword Whether the report is for the `time` keyword.
+ */
+void print_timing(const char *text, const struct timespec *start, const struct rusage *usage, int keyword)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double real = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+  double user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+  double sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+
+  if (keyword)
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\nmaxrss\t%ld KiB\n",
+            (int)(real / 60), real - 60 * (int)(real / 60), (int)(user / 60), user - 60 * (int)(user / 60),
+            (int)(sys / 60), sys - 60 * (int)(sys / 60), usage->ru_maxrss);
+  else
+    fprintf(stderr, "timing: real %.3fs user %.3fs sys %.3fs maxrss %ld KiB: %s\n",
+            real, user, sys, usage->ru_maxrss, text);
+}
+
+/**
+ * Runs the built-in `set` command. `-o name` enables an option, `+o name` disables it
+ * and `-o` alone lists them.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int set_builtin(Command *cmd)
+{
+  size_t count = sizeof(shell_options) / sizeof(shell_options[0]);
+  last_status = 0;
+
+  if (cmd->arg_count == 1 || (cmd->arg_count == 2 && strcmp(cmd->args[1], "-o") == 0))
+  {
+    for (size_t i = 0; i < count; i++)
+      printf("%-15s\t%s\n", shell_options[i].name, *shell_options[i].flag ? "on" : "off");
+    return 1;
+  }
+
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *flag = cmd->args[i];
+    if ((strcmp(flag, "-o") != 0 && strcmp(flag, "+o") != 0) || i + 1 == cmd->arg_count)
+    {
+      fprintf(stderr, "set: usage: set [-o|+o] option\n");
+      last_status = 2;
+      return 1;
+    }
+
+    const char *name = cmd->args[++i];
+    size_t j = 0;
+    while (j < count && strcmp(shell_options[j].name, name) != 0)
+      j++;
+    if (j == count)
+    {
+      fprintf(stderr, "set: %s: invalid option name\n", name);
+      last_status = 1;
+      continue;
+    }
+    *shell_options[j].flag = flag[0] == '-';
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `exit [n]` command. An argument that is not a number exits with status 2.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 0 to exit the shell.
+ */
+int exit_builtin(Command *cmd)
+{
+  if (cmd->arg_count < 2)
+    return 0;
+
+  const char *arg = cmd->args[1];
+  char *end;
+  errno = 0;
+  long value = strtol(arg, &end, 10);
+  if (!*arg || *end != '\0' || errno)
+  {
+    fprintf(stderr, "exit: %s: numeric argument required\n", arg);
+    last_status = 2;
+  }
+  else
+    last_status = value & 0xff;
+  return 0;
+}
+
+/**
+ * Runs the built-in `cd dir` command.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int cd_builtin(Command *cmd)
+{
+  last_status = 1;
+  if (cmd->arg_count < 2)
+    fprintf(stderr, "cd: missing argument\n");
+  else if (chdir(cmd->args[1]) != 0)
+    perror("cd");
+  else
+  {
+    prompt_cache.cwd_stale = 1;
+    last_status = 0;
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `pwd` command.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int pwd_builtin(Command *cmd)
+{
+  (void)cmd;
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+  {
+    perror("pwd");
+    last_status = 1;
+    return 1;
+  }
+  puts(cwd);
+  free(cwd);
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Runs the built-in `true` and `:` commands.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int true_builtin(Command *cmd)
+{
+  (void)cmd;
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Runs the built-in `false` command.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int false_builtin(Command *cmd)
+{
+  (void)cmd;
+  last_status = 1;
+  return 1;
+}
+
+/**
+ * Decodes the backslash escape at the start of a string, as understood by
+ * `echo -e` and `printf`.
+ *
+ * @param p The character after the backslash.
+ * @param zero_octal Whether octal escapes are written \0nnn, as for `echo -e` and %b, rather than \nnn.
+ * @param ch Set to the decoded character, or -1 for \c, which ends all output.
+ * @return A pointer past the escape.
+ */
+static const char *decode_escape(const char *p, int zero_octal, int *ch)
+{
+  static const char plain[] = "\\abefnrtv";
+  static const char codes[] = "\\\a\b\033\f\n\r\t\v";
+
+  const char *found = *p ? strchr(plain, *p) : NULL;
+  if (found)
+  {
+    *ch = codes[found - plain];
+    return p + 1;
+  }
+  if (*p == 'c')
+  {
+    *ch = -1;
+    return p + 1;
+  }
+
+  int base = 0, digits = 0;
+  if (*p == 'x')
+  {
+    base = 16;
+    digits = 2;
+    p++;
+  }
+  else if (*p >= '0' && *p <= '7')
+  {
+    base = 8;
+    digits = 3;
+    if (zero_octal && *p == '0')
+      p++;
+  }
+  if (!base)
+  {
+    // Unknown escapes are kept as they are
+    *ch = '\\';
+    return p;
+  }
+
+  int value = 0, used = 0;
+  for (; used < digits; used++, p++)
+  {
+    int digit = *p >= '0' && *p <= '9' ? *p - '0' : (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f' ? (*p | 0x20) - 'a' + 10 : 99;
+    if (digit >= base)
+      break;
+    value = value * base + digit;
+  }
+  if (base == 16 && used == 0)
+  {
+    *ch = '\\';
+    return p - 1;
+  }
+  *ch = value & 0xff;
+  return p;
+}
+
+/**
+ * Writes a string to stdout, decoding backslash escapes.
+ *
+ * @param s The string to be written.
+ * @param zero_octal Whether octal escapes are written \0nnn.
+ * @return 0 if a \c ended the output, otherwise 1.
+ */
+static int print_escaped(const char *s, int zero_octal)
+{
+  while (*s)
+  {
+    if (*s != '\\' || s[1] == '\0')
+    {
+      putchar(*s++);
+      continue;
+    }
+    int ch;
+    s = decode_escape(s + 1, zero_octal, &ch);
+    if (ch == -1)
+      return 0;
+    putchar(ch);
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `echo [-neE] [args...]` command.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int echo_builtin(Command *cmd)
+{
+  int newline = 1, escapes = 0;
+  size_t i = 1;
+  for (; i < cmd->arg_count; i++)
+  {
+    const char *flag = cmd->args[i];
+    if (flag[0] != '-' || flag[1] == '\0' || flag[1 + strspn(flag + 1, "neE")] != '\0')
+      break;
+    for (flag++; *flag; flag++)
+    {
+      if (*flag == 'n')
+        newline = 0;
+      else
+        escapes = *flag == 'e';
+    }
+  }
+
+  for (size_t first = i; i < cmd->arg_count; i++)
+  {
+    if (i > first)
+      putchar(' ');
+    if (!escapes)
+      fputs(cmd->args[i], stdout);
+    else if (!print_escaped(cmd->args[i], 1))
+    {
+      newline = 0;
+      break;
+    }
+  }
+  if (newline)
+    putchar('\n');
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Converts a `printf` argument to a number. A leading quote gives the code of the next character.
+ *
+ * @param arg The argument, or NULL if the arguments have run out.
+ * @param failed Set to 1 if the argument is not a valid number.
+ * @return The number.
+ */
+static long long printf_number(const char *arg, int *failed)
+{
+  if (!arg || !*arg)
+    return 0;
+  if (arg[0] == '\'' || arg[0] == '"')
+    return (unsigned char)arg[1];
+
+  char *end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 0);
+  if (*end != '\0' || errno)
+  {
+    // Unsigned values above LLONG_MAX still print as the user wrote them
+    if (*end == '\0' && errno == ERANGE && arg[0] != '-')
+      return (long long)strtoull(arg, NULL, 0);
+    fprintf(stderr, "printf: %s: invalid number\n", arg);
+    *failed = 1;
+  }
+  return value;
+}
+
+/**
+ * Writes one `%` conversion of a `printf` format. Flags, width and precision are
+ * handed to the C library, with `*` replaced by the value of the next argument.
+ *
+ * @param p The `%` starting the conversion.
+ * @param next A pointer to the next unused argument, moved past the ones consumed.
+ * @param failed Set to 1 if an argument is not a valid number.
+ * @return A pointer past the conversion, or NULL if it is invalid or a %b ended all output.
+ */
+static const char *printf_conversion(const char *p, char ***next, int *failed)
+{
+  char spec[64];
+  size_t len = 0;
+  spec[len++] = *p++;
+  while (*p && strchr("#-+ 0", *p) && len < 8)
+    spec[len++] = *p++;
+  for (int part = 0; part < 2; part++)
+  {
+    if (*p == '*')
+    {
+      long long value = printf_number(**next ? *(*next)++ : NULL, failed);
+      len += snprintf(spec + len, 24, "%d", (int)value);
+      p++;
+    }
+    else
+    {
+      while (*p >= '0' && *p <= '9' && len < 40)
+        spec[len++] = *p++;
+    }
+    if (part == 1 || *p != '.')
+      break;
+    spec[len++] = *p++;
+  }
+
+  char conv = *p;
+  if (!conv)
+  {
+    fprintf(stderr, "printf: %%: missing format character\n");
+    *failed = 1;
+    return NULL;
+  }
+  if (!strchr("diouxXcsbeEfFgGaA", conv))
+  {
+    fprintf(stderr, "printf: %%%c: invalid format character\n", conv);
+    *failed = 1;
+    return NULL;
+  }
+  const char *arg = **next ? *(*next)++ : NULL;
+  if (strchr("diouxX", conv))
+  {
+    spec[len++] = 'l';
+    spec[len++] = 'l';
+  }
+  spec[len++] = conv == 'b' ? 's' : conv;
+  spec[len] = '\0';
+
+  // %b decodes the escapes of its argument, which then ignores width and precision
+  if (conv == 'b' && arg && strchr(arg, '\\'))
+    return print_escaped(arg, 1) ? p + 1 : NULL;
+
+  if (conv == 's' || conv == 'b')
+    printf(spec, arg ? arg : "");
+  else if (conv == 'c')
+    printf(spec, arg ? arg[0] : '\0');
+  else if (conv == 'd' || conv == 'i')
+    printf(spec, printf_number(arg, failed));
+  else if (strchr("ouxX", conv))
+    printf(spec, (unsigned long long)printf_number(arg, failed));
+  else
+  {
+    char *end = NULL;
+    double value = arg ? strtod(arg, &end) : 0;
+    if (arg && *end != '\0')
+    {
+      fprintf(stderr, "printf: %s: invalid number\n", arg);
+      *failed = 1;
+    }
+    printf(spec, value);
+  }
+  return p + 1;
+}
+
+/**
+ * Runs the built-in `printf format [args...]` command. The format is reused
+ * until every argument has been consumed.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int printf_builtin(Command *cmd)
+{
+  if (cmd->arg_count < 2)
+  {
+    fprintf(stderr, "printf: usage: printf format [arguments]\n");
+    last_status = 2;
+    return 1;
+  }
+
+  const char *format = cmd->args[1];
+  char **next = cmd->args + 2;
+  int failed = 0;
+  int more = 1;
+  while (more)
+  {
+    char **round = next;
+    // A conversion that ends the output leaves p NULL, so more is tested first
+    for (const char *p = format; more && *p;)
+    {
+      if (*p == '\\')
+      {
+        int ch;
+        p = decode_escape(p + 1, 0, &ch);
+        if ((more = ch != -1))
+          putchar(ch);
+      }
+      else if (*p != '%')
+        putchar(*p++);
+      else if (p[1] == '%')
+      {
+        putchar('%');
+        p += 2;
+      }
+      else
+        more = (p = printf_conversion(p, &next, &failed)) != NULL;
+    }
+
+    // The format is repeated for leftover arguments, unless it consumed none
+    more = more && *next && next != round;
+  }
+
+  last_status = failed;
+  return 1;
+}
+
+// Evaluation state of a `test` expression
+typedef struct
+{
+  char **args;
+  size_t count;
+  size_t pos;
+  int error;   // Set once a syntax error has been reported
+  const char *name;
+} TestExpr;
+
+/**
+ * Checks whether a word is a binary operator of `test`.
+ *
+ * @param op The word to be checked.
+ * @return 1 if it is, otherwise 0.
+ */
+static int test_binary(const char *op)
+{
+  static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+  {
+    if (strcmp(op, ops[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Checks whether a word is a unary operator of `test`.
+ *
+ * @param op The word to be checked.
+ * @return 1 if it is, otherwise 0.
+ */
+static int test_unary(const char *op)
+{
+  return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghkLnprsStuwxzGO", op[1]);
+}
+
+/**
+ * Converts an operand of an integer comparison, reporting it if it is not a number.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @param arg The operand.
+ * @return The value of the operand.
+ */
+static long long test_integer(TestExpr *t, const char *arg)
+{
+  char *end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 10);
+  while (*end == ' ' || *end == '\t')
+    end++;
+  if (end == arg || *end != '\0' || errno)
+  {
+    if (!t->error)
+      fprintf(stderr, "%s: %s: integer expression expected\n", t->name, arg);
+    t->error = 1;
+  }
+  return value;
+}
+
+/**
+ * Evaluates a unary file or string test.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @param op The letter of the operator.
+ * @param arg The operand.
+ * @return 1 if the test is true, otherwise 0.
+ */
+static int test_file(TestExpr *t, char op, const char *arg)
+{
+  struct stat st;
+  if (op == 'z')
+    return arg[0] == '\0';
+  if (op == 'n')
+    return arg[0] != '\0';
+  if (op == 't')
+    return isatty((int)test_integer(t, arg));
+  if (op == 'h' || op == 'L')
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  if (op == 'r' || op == 'w' || op == 'x')
+    return access(arg, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0;
+  if (stat(arg, &st) != 0)
+    return 0;
+
+  switch (op)
+  {
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  case 'k':
+    return (st.st_mode & S_ISVTX) != 0;
+  case 'O':
+    return st.st_uid == geteuid();
+  case 'G':
+    return st.st_gid == getegid();
+  }
+  return 1; // -e
+}
+
+/**
+ * Evaluates a binary string, integer or file comparison.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @param left The left operand.
+ * @param op The operator.
+ * @param right The right operand.
+ * @return 1 if the comparison is true, otherwise 0.
+ */
+static int test_compare(TestExpr *t, const char *left, const char *op, const char *right)
+{
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    return strcmp(left, right) == 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(left, right) != 0;
+  if (strcmp(op, "<") == 0)
+    return strcmp(left, right) < 0;
+  if (strcmp(op, ">") == 0)
+    return strcmp(left, right) > 0;
+
+  // File comparisons, where a missing file is older than any other
+  int newer = strcmp(op, "-nt") == 0, older = strcmp(op, "-ot") == 0;
+  if (newer || older || strcmp(op, "-ef") == 0)
+  {
+    struct stat a, b;
+    int has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+    if (!newer && !older)
+      return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    if (!has_a || !has_b)
+      return newer ? has_a : has_b;
+    long diff = a.st_mtim.tv_sec != b.st_mtim.tv_sec ? (a.st_mtim.tv_sec > b.st_mtim.tv_sec ? 1 : -1)
+                                                     : a.st_mtim.tv_nsec - b.st_mtim.tv_nsec;
+    return newer ? diff > 0 : diff < 0;
+  }
+
+  long long a = test_integer(t, left), b = test_integer(t, right);
+  if (strcmp(op, "-eq") == 0)
+    return a == b;
+  if (strcmp(op, "-ne") == 0)
+    return a != b;
+  if (strcmp(op, "-lt") == 0)
+    return a < b;
+  if (strcmp(op, "-le") == 0)
+    return a <= b;
+  if (strcmp(op, "-gt") == 0)
+    return a > b;
+  return a >= b;
+}
+
+static int test_or(TestExpr *t);
+
+/**
+ * Evaluates a primary: a parenthesized expression, a unary or binary test, or a string.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @return 1 if the expression is true, otherwise 0.
+ */
+static int test_primary(TestExpr *t)
+{
+  size_t left = t->count - t->pos;
+  char **arg = t->args + t->pos;
+  if (left == 0)
+  {
+    if (!t->error)
+      fprintf(stderr, "%s: argument expected\n", t->name);
+    t->error = 1;
+    return 0;
+  }
+
+  // Binary operators win, so `[ -n = -n ]` compares two strings
+  if (left >= 3 && test_binary(arg[1]))
+  {
+    t->pos += 3;
+    return test_compare(t, arg[0], arg[1], arg[2]);
+  }
+  if (left >= 2 && test_unary(arg[0]))
+  {
+    t->pos += 2;
+    return test_file(t, arg[0][1], arg[1]);
+  }
+  if (left >= 3 && strcmp(arg[0], "(") == 0)
+  {
+    t->pos++;
+    int result = test_or(t);
+    if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0)
+    {
+      if (!t->error)
+        fprintf(stderr, "%s: `)' expected\n", t->name);
+      t->error = 1;
+      return 0;
+    }
+    t->pos++;
+    return result;
+  }
+  t->pos++;
+  return arg[0][0] != '\0';
+}
+
+/**
+ * Evaluates negations with `!`.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @return 1 if the expression is true, otherwise 0.
+ */
+static int test_not(TestExpr *t)
+{
+  if (t->count - t->pos >= 2 && strcmp(t->args[t->pos], "!") == 0)
+  {
+    t->pos++;
+    return !test_not(t);
+  }
+  return test_primary(t);
+}
+
+/**
+ * Evaluates conjunctions with `-a`, which bind tighter than `-o`.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @return 1 if the expression is true, otherwise 0.
+ */
+static int test_and(TestExpr *t)
+{
+  int result = test_not(t);
+  while (t->pos + 1 < t->count && strcmp(t->args[t->pos], "-a") == 0)
+  {
+    t->pos++;
+    result = test_not(t) && result;
+  }
+  return result;
+}
+
+/**
+ * Evaluates disjunctions with `-o`.
+ *
+ * @param t A pointer to the TestExpr being evaluated.
+ * @return 1 if the expression is true, otherwise 0.
+ */
+static int test_or(TestExpr *t)
+{
+  int result = test_and(t);
+  while (t->pos + 1 < t->count && strcmp(t->args[t->pos], "-o") == 0)
+  {
+    t->pos++;
+    result = test_and(t) || result;
+  }
+  return result;
+}
+
+/**
+ * Runs the built-in `test expr` and `[ expr ]` commands.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running. The status is 0 if true, 1 if false and 2 on errors.
+ */
+int test_builtin(Command *cmd)
+{
+  size_t count = cmd->arg_count - 1;
+  if (strcmp(cmd->name, "[") == 0)
+  {
+    if (count == 0 || strcmp(cmd->args[count], "]") != 0)
+    {
+      fprintf(stderr, "[: missing `]'\n");
+      last_status = 2;
+      return 1;
+    }
+    count--;
+  }
+
+  TestExpr t = {cmd->args + 1, count, 0, 0, cmd->name};
+  int result = count > 0 && test_or(&t);
+  if (!t.error && t.pos < t.count)
+  {
+    fprintf(stderr, "%s: %s: unexpected argument\n", cmd->name, t.args[t.pos]);
+    t.error = 1;
+  }
+  last_status = t.error ? 2 : !result;
+  return 1;
+}
+
+// Set by a SIGINT while cat or tee run inside the shell, which otherwise ignores it
+static volatile sig_atomic_t copy_interrupted = 0;
+
+/**
+ * Notes a ^C during cat or tee, so the copy stops after the interrupted call.
+ *
+ * @param sig The signal.
+ */
+static void copy_interrupt(int sig)
+{
+  (void)sig;
+  copy_interrupted = 1;
+}
+
+/**
+ * Lets ^C interrupt a builtin that copies data inside the shell, or puts the
+ * shell's dispositions back, ending the line after a ^C as wait_job does. Blocking
+ * reads then fail with EINTR instead of being restarted. A child running the
+ * builtin is simply killed by ^C, so its SIGINT is left alone. SIGPIPE is ignored
+ * either way, so a reader going away makes writes fail with EPIPE instead of
+ * killing the shell.
+ *
+ * @param on Whether the copy is starting.
+ * @param saved The dispositions of SIGINT and SIGPIPE to restore, saved when the copy starts.
+ */
+static void copy_signals(int on, struct sigaction saved[2])
+{
+  if (!on)
+  {
+    sigaction(SIGPIPE, &saved[1], NULL);
+    if (saved[0].sa_handler != SIG_IGN)
+      return;
+    sigaction(SIGINT, &saved[0], NULL);
+    if (copy_interrupted)
+    {
+      interrupted = 1;
+      if (job_control)
+        fputc('\n', stderr);
+    }
+    return;
+  }
+  copy_interrupted = 0;
+  struct sigaction sa = {.sa_handler = SIG_IGN};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPIPE, &sa, &saved[1]);
+  sigaction(SIGINT, NULL, &saved[0]);
+  if (saved[0].sa_handler != SIG_IGN)
+    return;
+  sa.sa_handler = copy_interrupt;
+  sigaction(SIGINT, &sa, NULL);
+}
+
+/**
+ * Writes all of a block to a descriptor.
+ *
+ * @param fd The descriptor.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t wrote = write(fd, data, len);
+    if (wrote == -1 && errno == EINTR && !copy_interrupted)
+      continue;
+    if (wrote <= 0)
+      return ERROR;
+    data += wrote;
+    len -= wrote;
+  }
+  return 1;
+}
+
+/**
+ * Moves everything from one descriptor to another, in the kernel where it can: with
+ * copy_file_range between files, sendfile out of a file, or splice through a pipe.
+ * Whatever the kernel refuses for these descriptors falls through to the next way,
+ * with read and write as the last.
+ *
+ * @param in The descriptor read until end of file.
+ * @param out The descriptor written to.
+ * @return 1 on success, INTERRUPTED after ^C, or ERROR with errno set.
+ */
+static int copy_fd(int in, int out)
+{
+  static char block[COPY_BUFFER];
+
+  // A terminal is read a line at a time, which splice would hold back
+  struct stat st;
+  int method = fstat(in, &st) == 0 && S_ISCHR(st.st_mode) ? COPY_READ : COPY_RANGE;
+  for (;;)
+  {
+    ssize_t moved;
+    if (method == COPY_RANGE)
+      moved = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+    else if (method == COPY_SENDFILE)
+      moved = sendfile(out, in, NULL, COPY_CHUNK);
+    else if (method == COPY_SPLICE)
+      moved = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+    else if ((moved = read(in, block, sizeof(block))) > 0 && write_all(out, block, moved) == ERROR)
+      return copy_interrupted ? INTERRUPTED : ERROR;
+
+    if (moved == 0)
+      return 1;
+    if (moved > 0)
+      continue;
+    if (copy_interrupted)
+      return INTERRUPTED;
+    if (errno == EINTR)
+      continue;
+    if (method == COPY_READ ||
+        (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EBADF))
+      return ERROR;
+    method++;
+  }
+}
+
+/**
+ * Checks whether the kernel can splice into a descriptor: a pipe, or a file not
+ * opened for appending.
+ *
+ * @param fd The descriptor.
+ * @return 1 if it can, otherwise 0.
+ */
+static int can_splice(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return 0;
+  return S_ISFIFO(st.st_mode) || (S_ISREG(st.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND));
+}
+
+/**
+ * Moves bytes from a pipe to a descriptor with splice, until all of them are there.
+ *
+ * @param in The pipe.
+ * @param out The descriptor.
+ * @param len The number of bytes, which the pipe must hold.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int splice_all(int in, int out, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t moved = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINTR && !copy_interrupted)
+      continue;
+    if (moved <= 0)
+      return ERROR;
+    len -= moved;
+  }
+  return 1;
+}
+
+/**
+ * Copies a pipe to stdout and a file within the kernel. tee duplicates what the pipe
+ * holds into stdout, or into a pipe of its own when stdout is not a pipe, and then
+ * the same bytes are spliced out of the input into the file.
+ *
+ * @param in The input pipe.
+ * @param out The descriptor of stdout.
+ * @param file The descriptor of the file.
+ * @return 1 on success, 0 if the kernel cannot do it for these descriptors and
+ *         nothing was copied, INTERRUPTED after ^C, or ERROR.
+ */
+static int tee_splice(int in, int out, int file)
+{
+  struct stat st;
+  if (fstat(in, &st) == -1 || !S_ISFIFO(st.st_mode) || !can_splice(out) || !can_splice(file))
+    return 0;
+
+  int through[2] = {-1, -1};
+  if (fstat(out, &st) == -1 || (!S_ISFIFO(st.st_mode) && pipe2(through, O_CLOEXEC) == -1))
+    return 0;
+
+  int result = 1;
+  int copied = 0;
+  for (;;)
+  {
+    ssize_t len = tee(in, through[1] != -1 ? through[1] : out, COPY_BUFFER, 0);
+    if (len == 0)
+      break;
+    if (len == -1)
+    {
+      if (copy_interrupted)
+        result = INTERRUPTED;
+      else if (errno == EINTR)
+        continue;
+      else
+        result = copied ? ERROR : 0;
+      break;
+    }
+    copied = 1;
+    if ((through[0] != -1 && splice_all(through[0], out, len) == ERROR) || splice_all(in, file, len) == ERROR)
+    {
+      result = copy_interrupted ? INTERRUPTED : ERROR;
+      break;
+    }
+  }
+  if (through[0] != -1)
+  {
+    close(through[0]);
+    close(through[1]);
+  }
+  return result;
+}
+
+/**
+ * Checks whether `cat` runs as a builtin: with no options but -u, which it has no use for.
+ *
+ * @param cmd A pointer to the Command.
+ * @return 1 if the builtin runs it, otherwise 0.
+ */
+int cat_handles(Command *cmd)
+{
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *arg = cmd->args[i];
+    if (arg[0] == '-' && arg[1] != '\0' && strcmp(arg, "-u") != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `cat [file...]` command, where `-` or no files stands for stdin.
+ * The data moves straight from descriptor to descriptor, see copy_fd.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running. The status is 1 if any file could not be copied.
+ */
+int cat_builtin(Command *cmd)
+{
+  struct stat out_st;
+  int out_file = fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode);
+  struct sigaction saved[2];
+  fflush(stdout);
+  copy_signals(1, saved);
+
+  last_status = 0;
+  int files = 0;
+  for (size_t i = 1; i < cmd->arg_count || (files == 0 && i == cmd->arg_count); i++)
+  {
+    const char *name = i < cmd->arg_count ? cmd->args[i] : "-";
+    if (strcmp(name, "-u") == 0)
+      continue;
+    files++;
+
+    int stdin_file = strcmp(name, "-") == 0;
+    int fd = stdin_file ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      last_status = 1;
+      continue;
+    }
+
+    // Copying a file onto itself would never end
+    struct stat st;
+    int result;
+    if (out_file && fstat(fd, &st) == 0 && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino && st.st_size)
+    {
+      fprintf(stderr, "cat: %s: input file is output file\n", name);
+      result = 1;
+      last_status = 1;
+    }
+    else if ((result = copy_fd(fd, STDOUT_FILENO)) == ERROR && errno != EPIPE)
+    {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      last_status = 1;
+    }
+    if (!stdin_file)
+      close(fd);
+    if (result == INTERRUPTED)
+    {
+      last_status = 130;
+      break;
+    }
+
+    // With its reader gone, the status is that of a cat killed by SIGPIPE
+    if (result == ERROR && errno == EPIPE)
+    {
+      last_status = 128 + SIGPIPE;
+      break;
+    }
+  }
+  copy_signals(0, saved);
+  return 1;
+}
+
+/**
+ * Checks whether `tee` runs as a builtin: with no options but -a.
+ *
+ * @param cmd A pointer to the Command.
+ * @return 1 if the builtin runs it, otherwise 0.
+ */
+int tee_handles(Command *cmd)
+{
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *arg = cmd->args[i];
+    if (arg[0] == '-' && arg[1] != '\0' && strcmp(arg, "-a") != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `tee [-a] [file...]` command, copying stdin to stdout and to
+ * every file. With one file and a pipe for stdin, the data stays in the kernel, see
+ * tee_splice; otherwise each block read is written to every output.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running. The status is 1 if any output failed.
+ */
+int tee_builtin(Command *cmd)
+{
+  int append = 0;
+  for (size_t i = 1; i < cmd->arg_count; i++)
+    append |= strcmp(cmd->args[i], "-a") == 0;
+
+  int *fds = malloc(cmd->arg_count * sizeof(int));
+  const char **names = malloc(cmd->arg_count * sizeof(char *));
+  if (!fds || !names)
+  {
+    perror("Error allocating memory for tee");
+    free(fds);
+    free(names);
+    last_status = 1;
+    return 1;
+  }
+  last_status = 0;
+  size_t count = 0;
+  names[count] = "stdout";
+  fds[count++] = STDOUT_FILENO;
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *name = cmd->args[i];
+    if (strcmp(name, "-a") == 0)
+      continue;
+    int fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+    if (fd == -1)
+    {
+      fprintf(stderr, "tee: %s: %s\n", name, strerror(errno));
+      last_status = 1;
+      continue;
+    }
+    names[count] = name;
+    fds[count++] = fd;
+  }
+
+  struct sigaction saved[2];
+  fflush(stdout);
+  copy_signals(1, saved);
+  int result = 0;
+  if (count == 1)
+    result = copy_fd(STDIN_FILENO, STDOUT_FILENO);
+  else if (count == 2)
+    result = tee_splice(STDIN_FILENO, fds[0], fds[1]);
+  if (result == 0)
+  {
+    // Every output gets each block; one that fails is dropped and the rest go on
+    static char block[COPY_BUFFER];
+    size_t open_outputs = count;
+    ssize_t got;
+    result = 1;
+    while (open_outputs > 0 && (got = read(STDIN_FILENO, block, sizeof(block))) != 0)
+    {
+      if (got == -1)
+      {
+        if (errno == EINTR && !copy_interrupted)
+          continue;
+        result = copy_interrupted ? INTERRUPTED : ERROR;
+        break;
+      }
+      for (size_t i = 0; i < count; i++)
+      {
+        if (fds[i] != -1 && write_all(fds[i], block, got) == ERROR)
+        {
+          if (copy_interrupted)
+            break;
+          if (errno == EPIPE)
+          {
+            result = ERROR;
+            break;
+          }
+          fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+          last_status = 1;
+          if (i > 0)
+            close(fds[i]);
+          fds[i] = -1;
+          open_outputs--;
+        }
+      }
+      if (copy_interrupted)
+      {
+        result = INTERRUPTED;
+        break;
+      }
+      if (result == ERROR)
+        break;
+    }
+  }
+  // Like an external tee killed by SIGPIPE, a tee whose reader has gone stops with 141
+  int error = errno;
+  copy_signals(0, saved);
+  if (result == ERROR && error == EPIPE)
+    last_status = 128 + SIGPIPE;
+  else if (result == ERROR)
+  {
+    fprintf(stderr, "tee: %s\n", strerror(error));
+    last_status = 1;
+  }
+  else if (result == INTERRUPTED)
+    last_status = 130;
+
+  for (size_t i = 1; i < count; i++)
+  {
+    if (fds[i] != -1)
+      close(fds[i]);
+  }
+  free(fds);
+  free(names);
+  return 1;
+}
+
+/**
+ * Runs the built-in `export [name[=value]...]` command. Without arguments, or with
+ * -p, the environment is listed. The shell keeps no variables of its own yet, so
+ * naming a variable without a value has nothing to export.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int export_builtin(Command *cmd)
+{
+  last_status = 0;
+  if (cmd->arg_count == 1 || (cmd->arg_count == 2 && strcmp(cmd->args[1], "-p") == 0))
+  {
+    for (char **env = environ; *env; env++)
+    {
+      const char *eq = strchr(*env, '=');
+      if (!eq)
+        continue;
+      printf("export %.*s=\"", (int)(eq - *env), *env);
+      for (const char *p = eq + 1; *p; p++)
+      {
+        if (strchr("\"\\$`", *p))
+          putchar('\\');
+        putchar(*p);
+      }
+      printf("\"\n");
+    }
+    return 1;
+  }
+
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *arg = cmd->args[i];
+    const char *eq = strchr(arg, '=');
+    char *name = eq ? strndup(arg, eq - arg) : (char *)arg;
+    if (!name)
+    {
+      perror("export");
+      last_status = 1;
+      continue;
+    }
+    if (!is_name(name))
+    {
+      fprintf(stderr, "export: `%s': not a valid identifier\n", arg);
+      last_status = 1;
+    }
+    else if (eq && env_set(name, eq + 1) == ERROR)
+      last_status = 1;
+    if (eq)
+      free(name);
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `unset [-v] name...` command.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int unset_builtin(Command *cmd)
+{
+  last_status = 0;
+  size_t i = 1;
+  if (i < cmd->arg_count && strcmp(cmd->args[i], "-v") == 0)
+    i++;
+  for (; i < cmd->arg_count; i++)
+  {
+    if (!is_name(cmd->args[i]))
+    {
+      fprintf(stderr, "unset: `%s': not a valid identifier\n", cmd->args[i]);
+      last_status = 1;
+    }
+    else
+      env_unset(cmd->args[i]);
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `type name...` command, saying how each name would be run.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running. The status is 1 if any name was not found.
+ */
+int type_builtin(Command *cmd)
+{
+  last_status = 0;
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    const char *name = cmd->args[i];
+    const char *path = NULL;
+    struct stat st;
+    if (is_reserved(name))
+      printf("%s is a shell keyword\n", name);
+    else if (find_builtin(name))
+      printf("%s is a shell builtin\n", name);
+    else
+    {
+      if (!strchr(name, '/'))
+        path = hash_lookup(name);
+      else if (access(name, X_OK) == 0 && stat(name, &st) == 0 && S_ISREG(st.st_mode))
+        path = name;
+
+      if (path)
+        printf("%s is %s\n", name, path);
+      else
+      {
+        fprintf(stderr, "type: %s: not found\n", name);
+        last_status = 1;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * Runs the built-in `history [n]` command, listing the last n entries, or all of them.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int history_builtin(Command *cmd)
+{
+  size_t count = history_count();
+  size_t first = 0;
+  if (cmd->arg_count > 1)
+  {
+    char *end;
+    long n = strtol(cmd->args[1], &end, 10);
+    if (*end != '\0' || n < 0)
+    {
+      fprintf(stderr, "history: %s: numeric argument required\n", cmd->args[1]);
+      last_status = 2;
+      return 1;
+    }
+    if ((size_t)n < count)
+      first = count - n;
+  }
+
+  for (size_t i = first; i < count; i++)
+  {
+    size_t len;
+    const char *entry = history_entry(i, &len);
+    printf("%5zu  %.*s\n", i + 1, (int)len, entry);
+  }
+  last_status = 0;
+  return 1;
+}
+
+/**
+ * Runs the built-in `stats [-j] [-r]` command, showing the latencies recorded by
+ * `set -o trace` for each phase of running commands, and the hits and misses of
+ * the PATH and syntax tree caches. With -j they are shown as JSON; with -r they
+ * are cleared afterwards.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int stats_builtin(Command *cmd)
+{
+  int json = 0;
+  int reset = 0;
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    if (strcmp(cmd->args[i], "-j") == 0)
+      json = 1;
+    else if (strcmp(cmd->args[i], "-r") == 0)
+      reset = 1;
+    else
+    {
+      fprintf(stderr, "usage: stats [-j] [-r]\n");
+      last_status = 2;
+      return 1;
+    }
+  }
+  if (!opt_trace && !json)
+    fprintf(stderr, "stats: tracing is off, turn it on with `set -o trace` or %s=1\n", TRACE_VAR);
+
+  const struct
+  {
+    const char *name;
+    unsigned long long hits;
+    unsigned long long misses;
+  } caches[] = {
+      {"path", trace_counts.path_hits, trace_counts.path_misses},
+      {"ast", trace_counts.ast_hits, trace_counts.ast_misses},
+  };
+
+  // Latencies are shown in microseconds
+  if (json)
+    printf("{\"phases\": {");
+  else
+    printf("%-9s %9s %11s %9s %9s %9s %9s %9s\n", "phase", "count", "total ms", "mean us", "p50 us", "p90 us",
+           "p99 us", "max us");
+  for (int i = 0; i < TRACE_PHASES; i++)
+  {
+    const Histogram *h = &trace_phases[i];
+    double mean = h->count ? h->total / 1e3 / h->count : 0;
+    double p50 = trace_percentile(h, 0.5) / 1e3;
+    double p90 = trace_percentile(h, 0.9) / 1e3;
+    double p99 = trace_percentile(h, 0.99) / 1e3;
+    if (json)
+      printf("%s\"%s\": {\"count\": %llu, \"total_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+             "\"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+             i ? ", " : "", trace_names[i], h->count, h->total / 1e3, mean, p50, p90, p99, h->max / 1e3);
+    else
+      printf("%-9s %9llu %11.3f %9.1f %9.1f %9.1f %9.1f %9.1f\n", trace_names[i], h->count, h->total / 1e6, mean,
+             p50, p90, p99, h->max / 1e3);
+  }
+
+  if (json)
+    printf("}, \"caches\": {");
+  else
+    printf("\n%-9s %9s %9s\n", "cache", "hits", "misses");
+  for (size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); i++)
+  {
+    if (json)
+      printf("%s\"%s\": {\"hits\": %llu, \"misses\": %llu}", i ? ", " : "", caches[i].name, caches[i].hits,
+             caches[i].misses);
+    else
+      printf("%-9s %9llu %9llu\n", caches[i].name, caches[i].hits, caches[i].misses);
+  }
+  if (json)
+    printf("}}\n");
+
+  if (reset)
+  {
+    memset(trace_phases, 0, sizeof(trace_phases));
+    memset(&trace_counts, 0, sizeof(trace_counts));
+  }
+  last_status = 0;
+  return 1;
+}
+
+// The environment: variables hashed by name, and the NULL terminated block of their
+// entries that commands are given. The block is updated in place as variables change,
+// so it is never rebuilt for a spawn, and environ points at it for libc.
+static EnvVar *env_table[ENV_BUCKETS];
+static char **env_block = NULL;
+static size_t env_count = 0;
+static size_t env_cap = 0;
+
+/**
+ * Computes the FNV-1a hash of a variable name.
+ *
+ * @param name The start of the name.
+ * @param len The length of the name.
+ * @return The bucket index for the name.
+ */
+static unsigned int env_bucket(const char *name, size_t len)
+{
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h % ENV_BUCKETS;
+}
+
+/**
+ * Finds a variable of the environment.
+ *
+ * @param name The start of the name, which need not be NUL terminated.
+ * @param len The length of the name.
+ * @return A pointer to the EnvVar, or NULL if it is not set.
+ */
+static EnvVar *env_find(const char *name, size_t len)
+{
+  for (EnvVar *var = env_table[env_bucket(name, len)]; var; var = var->next)
+  {
+    if (var->name_len == len && memcmp(var->entry, name, len) == 0)
+      return var;
+  }
+  return NULL;
+}
+
+/**
+ * Makes room in the environment block for more entries than it holds, plus its NULL.
+ *
+ * @param extra The number of entries to make room for.
+ * @return 1 on success, otherwise ERROR.
+ */
+static int env_reserve(size_t extra)
+{
+  if (env_count + extra < env_cap)
+    return 1;
+  size_t cap = env_cap ? env_cap : 64;
+  while (env_count + extra >= cap)
+    cap *= 2;
+  char **grown = realloc(env_block, cap * sizeof(char *));
+  if (!grown)
+  {
+    perror("Error allocating memory for environment");
+    return ERROR;
+  }
+  env_block = environ = grown;
+  env_cap = cap;
+  return 1;
+}
+
+/**
+ * Sets a variable from a NAME=value entry, replacing its old value.
+ *
+ * @param entry The newly allocated entry, which the environment takes over.
+ * @return 1 on success, otherwise ERROR.
+ */
+int env_put(char *entry)
+{
+  size_t len = strchr(entry, '=') - entry;
+  EnvVar *var = env_find(entry, len);
+  if (var)
+  {
+    free(var->entry);
+    var->entry = env_block[var->index] = entry;
+    return 1;
+  }
+
+  unsigned int bucket = env_bucket(entry, len);
+  if (env_reserve(1) == ERROR)
+  {
+    free(entry);
+    return ERROR;
+  }
+  if (!(var = malloc(sizeof(EnvVar))))
+  {
+    perror("Error allocating memory for environment");
+    free(entry);
+    return ERROR;
+  }
+  *var = (EnvVar){entry, len, env_count, env_table[bucket]};
+  env_table[bucket] = var;
+  env_block[env_count++] = entry;
+  env_block[env_count] = NULL;
+  return 1;
+}
+
+/**
+ * Sets a variable of the environment.
+ *
+ * @param name The name.
+ * @param value The value.
+ * @return 1 on success, otherwise ERROR.
+ */
+int env_set(const char *name, const char *value)
+{
+  char *entry;
+  if (asprintf(&entry, "%s=%s", name, value) == -1)
+  {
+    perror("Error allocating memory for environment");
+    return ERROR;
+  }
+  return env_put(entry);
+}
+
+/**
+ * Gets the value of a variable of the environment by a name inside a longer string.
+ *
+ * @param name The start of the name.
+ * @param len The length of the name.
+ * @return The value, or NULL if it is not set.
+ */
+const char *env_lookup(const char *name, size_t len)
+{
+  EnvVar *var = env_find(name, len);
+  return var ? var->entry + len + 1 : NULL;
+}
+
+/**
+ * Gets the value of a variable of the environment.
+ *
+ * @param name The name.
+ * @return The value, or NULL if it is not set.
+ */
+const char *env_get(const char *name)
+{
+  return env_lookup(name, strlen(name));
+}
+
+/**
+ * Removes a variable from the environment. The last entry of the block takes its slot.
+ *
+ * @param name The name.
+ */
+void env_unset(const char *name)
+{
+  size_t len = strlen(name);
+  EnvVar **link = &env_table[env_bucket(name, len)];
+  while (*link && ((*link)->name_len != len || memcmp((*link)->entry, name, len) != 0))
+    link = &(*link)->next;
+  EnvVar *var = *link;
+  if (!var)
+    return;
+  *link = var->next;
+
+  char *last = env_block[--env_count];
+  if (var->index != env_count)
+  {
+    EnvVar *moved = env_find(last, strchr(last, '=') - last);
+    moved->index = var->index;
+    env_block[var->index] = last;
+  }
+  env_block[env_count] = NULL;
+  free(var->entry);
+  free(var);
+}
+
+/**
+ * Takes the environment the shell was started with into the table, so that every
+ * later change goes through it.
+ */
+void env_init(void)
+{
+  char **inherited = environ;
+  if (env_reserve(0) == ERROR)
+    return;
+  env_block[0] = NULL;
+  for (char **env = inherited; *env; env++)
+  {
+    char *entry;
+    if (strchr(*env, '=') && (entry = strdup(*env)))
+      env_put(entry);
+  }
+}
+
+/**
+ * Makes the assignments of a command for good, for a child about to run it or for
+ * an assignment without a command.
+ *
+ * @param cmd A pointer to the Command.
+ * @return 1 on success, otherwise ERROR.
+ */
+int env_assign(Command *cmd)
+{
+  for (size_t i = 0; i < cmd->assign_count; i++)
+  {
+    char *entry = strdup(cmd->assigns[i]);
+    if (!entry)
+    {
+      perror("Error allocating memory for environment");
+      return ERROR;
+    }
+    if (env_put(entry) == ERROR)
+      return ERROR;
+  }
+  return 1;
+}
+
+/**
+ * Lays the assignments of a command over the environment block for one spawn.
+ * Entries of variables it sets are swapped for its own and new ones go after the
+ * last, so nothing is copied; env_restore puts the block back.
+ *
+ * @param cmd A pointer to the Command.
+ * @return The environment for the command, or NULL if there was no room for it.
+ */
+char **env_overlay(Command *cmd)
+{
+  if (cmd->assign_count == 0)
+    return env_block;
+  if (env_reserve(cmd->assign_count) == ERROR)
+    return NULL;
+
+  size_t added = 0;
+  for (size_t i = 0; i < cmd->assign_count; i++)
+  {
+    char *entry = cmd->assigns[i];
+    size_t len = strchr(entry, '=') - entry;
+    EnvVar *var = env_find(entry, len);
+    if (var)
+    {
+      env_block[var->index] = entry;
+      continue;
+    }
+
+    // A name assigned twice keeps the last value
+    size_t j = env_count;
+    while (j < env_count + added && (strncmp(env_block[j], entry, len + 1) != 0))
+      j++;
+    env_block[j] = entry;
+    added += j == env_count + added;
+  }
+  env_block[env_count + added] = NULL;
+  return env_block;
+}
+
+/**
+ * Takes the assignments of a command back off the environment block.
+ *
+ * @param cmd A pointer to the Command that env_overlay was given.
+ */
+void env_restore(Command *cmd)
+{
+  for (size_t i = 0; i < cmd->assign_count; i++)
+  {
+    char *entry = cmd->assigns[i];
+    EnvVar *var = env_find(entry, strchr(entry, '=') - entry);
+    if (var)
+      env_block[var->index] = var->entry;
+  }
+  env_block[env_count] = NULL;
+}
+
+// Command hash table, valid for the PATH value it was filled against
+static HashEntry *command_hash[HASH_BUCKETS];
+static char *hashed_path = NULL;
+
+// Index of the executables in PATH, built on the first completion and dropped along with the hash table
+static PathDir *path_index = NULL;
+static size_t path_index_dirs = 0;
+
+/**
+ * Gets the PATH in effect, first dropping the hash table and the executable index
+ * if it has changed since they were filled.
+ *
+ * @return The PATH value, or NULL if it could not be recorded.
+ */
+static const char *hash_path(void)
+{
+  const char *path = env_get("PATH");
+  if (!path)
+    path = DEFAULT_PATH;
+
+  if (!hashed_path || strcmp(hashed_path, path) != 0)
+  {
+    hash_clear();
+    hashed_path = strdup(path);
+    if (!hashed_path)
+    {
+      perror("Error allocating memory for hash table");
+      return NULL;
+    }
+  }
+  return path;
+}
+
+/**
+ * Computes the FNV-1a hash of a command name.
+ *
+ * @param name The command name to be hashed.
+ * @return The bucket index for the name.
+ */
+static unsigned int hash_bucket(const char *name)
+{
+  unsigned int h = 2166136261u;
+  for (; *name; name++)
+  {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h % HASH_BUCKETS;
+}
+
+/**
+ * Resolves a command name to an absolute path, consulting the hash table first.
+ * The table is dropped whenever PATH has changed since it was filled.
+ *
+ * @param name The command name to be resolved. Must not contain a slash.
+ * @return The path of the executable, owned by the table, or NULL if it was not found.
+ */
+const char *hash_lookup(const char *name)
+{
+  struct timespec start;
+  trace_begin(&start);
+  const char *path = hash_path();
+  if (!path)
+    return NULL;
+
+  unsigned int bucket = hash_bucket(name);
+  for (HashEntry *entry = command_hash[bucket]; entry; entry = entry->next)
+  {
+    if (strcmp(entry->name, name) == 0)
+    {
+      entry->hits++;
+      trace_counts.path_hits++;
+      trace_end(TRACE_RESOLVE, &start);
+      return entry->path;
+    }
+  }
+
+  trace_counts.path_misses++;
+  char *found = path_index_locate(name);
+  if (!found && !(found = search_path(name, path)))
+  {
+    trace_end(TRACE_RESOLVE, &start);
+    return NULL;
+  }
+
+  HashEntry *entry = malloc(sizeof(HashEntry));
+  if (!entry || !(entry->name = strdup(name)))
+  {
+    perror("Error allocating memory for hash table");
+    free(entry);
+    free(found);
+    return NULL;
+  }
+  entry->path = found;
+  entry->hits = 1;
+  entry->next = command_hash[bucket];
+  command_hash[bucket] = entry;
+  trace_end(TRACE_RESOLVE, &start);
+  return entry->path;
+}
+
+/**
+ * Removes a single command from the hash table.
+ *
+ * @param name The command name to be forgotten.
+ */
+void hash_forget(const char *name)
+{
+  HashEntry **link = &command_hash[hash_bucket(name)];
+  while (*link)
+  {
+    HashEntry *entry = *link;
+    if (strcmp(entry->name, name) == 0)
+    {
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+    link = &entry->next;
+  }
+}
+
+/**
+ * Removes every command from the hash table, and drops the executable index with it.
+ */
+void hash_clear(void)
+{
+  for (int i = 0; i < HASH_BUCKETS; i++)
+  {
+    HashEntry *entry = command_hash[i];
+    while (entry)
+    {
+      HashEntry *next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    command_hash[i] = NULL;
+  }
+  free(hashed_path);
+  hashed_path = NULL;
+  path_index_free();
+}
+
+/**
+ * Searches the directories of a PATH string for an executable file.
+ *
+ * @param name The command name to be searched for.
+ * @param path The colon separated list of directories to search.
+ * @return The newly allocated path of the executable, or NULL if it was not found.
+ */
+char *search_path(const char *name, const char *path)
+{
+  size_t name_len = strlen(name);
+
+  while (1)
+  {
+    const char *end = strchrnul(path, ':');
+    size_t dir_len = end - path;
+
+    // An empty entry means the current directory
+    char *candidate = malloc(dir_len + name_len + 3);
+    if (!candidate)
+    {
+      perror("Error allocating memory for path");
+      return NULL;
+    }
+    if (dir_len == 0)
+      candidate[dir_len++] = '.';
+    else
+      memcpy(candidate, path, dir_len);
+    candidate[dir_len] = '/';
+    memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+    struct stat st;
+    if (access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+      return candidate;
+    free(candidate);
+
+    if (*end == '\0')
+      return NULL;
+    path = end + 1;
+  }
+}
+
+/**
+ * Orders strings for qsort and bsearch over arrays of string pointers.
+ *
+ * @param a A pointer to the first string pointer.
+ * @param b A pointer to the second string pointer.
+ * @return The order of the strings, as for strcmp.
+ */
+int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Drops the executable index, as when PATH changes.
+ */
+void path_index_free(void)
+{
+  for (size_t i = 0; i < path_index_dirs; i++)
+  {
+    free(path_index[i].dir);
+    free(path_index[i].names);
+    free(path_index[i].pool);
+  }
+  free(path_index);
+  path_index = NULL;
+  path_index_dirs = 0;
+}
+
+/**
+ * Reads the names of the files in a PATH directory. Entries are not stat'ed one by
+ * one, which is what makes scanning large directories slow on network filesystems;
+ * whether a name is really executable is found out when it is run.
+ *
+ * @param entry A pointer to the PathDir to be scanned.
+ */
+static void path_index_scan(PathDir *entry)
+{
+  free(entry->names);
+  free(entry->pool);
+  entry->names = NULL;
+  entry->pool = NULL;
+  entry->count = 0;
+
+  DIR *dir = opendir(entry->dir);
+  if (!dir)
+    return;
+
+  Buffer pool = {NULL, 0, 0};
+  size_t count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)))
+  {
+    if (ent->d_name[0] == '.' ||
+        (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN))
+      continue;
+    if (buffer_add(&pool, ent->d_name, strlen(ent->d_name) + 1) == ERROR)
+      break;
+    count++;
+  }
+  closedir(dir);
+
+  char **names = count ? malloc(count * sizeof(char *)) : NULL;
+  if (count && !names)
+  {
+    free(pool.data);
+    return;
+  }
+  char *name = pool.data;
+  for (size_t i = 0; i < count; i++, name += strlen(name) + 1)
+    names[i] = name;
+  qsort(names, count, sizeof(char *), compare_names);
+
+  entry->names = names;
+  entry->pool = pool.data;
+  entry->count = count;
+}
+
+/**
+ * Checks whether the indexed names of a PATH directory still match the directory.
+ * A modification time within a second of the scan proves nothing, since a file added
+ * in the same tick leaves it unchanged, so such a directory is never current.
+ *
+ * @param entry A pointer to the PathDir to be checked.
+ * @param st A pointer to the directory's current status.
+ * @return 1 if the names are current, otherwise 0.
+ */
+static int path_index_current(const PathDir *entry, const struct stat *st)
+{
+  return entry->scanned && entry->stable && entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Brings the executable index up to date, building it on first use. A directory
+ * is only read again once its modification time, or the directory itself, has changed,
+ * or if it had changed too recently to be trusted when it was last read.
+ */
+void path_index_refresh(void)
+{
+  const char *path = hash_path();
+  if (!path)
+    return;
+
+  if (!path_index)
+  {
+    size_t dirs = 1;
+    for (const char *p = path; *p; p++)
+      dirs += *p == ':';
+    if (!(path_index = calloc(dirs, sizeof(PathDir))))
+      return;
+    path_index_dirs = dirs;
+
+    // An empty entry means the current directory
+    const char *p = path;
+    for (size_t i = 0; i < dirs; i++)
+    {
+      const char *end = strchrnul(p, ':');
+      path_index[i].dir = end == p ? strdup(".") : strndup(p, end - p);
+      p = *end ? end + 1 : end;
+    }
+  }
+
+  for (size_t i = 0; i < path_index_dirs; i++)
+  {
+    PathDir *entry = &path_index[i];
+    struct stat st;
+    if (!entry->dir || stat(entry->dir, &st) == -1)
+    {
+      entry->count = 0;
+      entry->scanned = 0;
+      continue;
+    }
+    if (path_index_current(entry, &st))
+      continue;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    path_index_scan(entry);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->stable = now.tv_sec > st.st_mtim.tv_sec + 1;
+    entry->scanned = 1;
+  }
+}
+
+/**
+ * Collects the indexed executables whose names start with a prefix.
+ *
+ * @param prefix The prefix to be completed.
+ * @param m A pointer to the Matches the names are added to.
+ */
+void path_index_complete(const char *prefix, Matches *m)
+{
+  size_t len = strlen(prefix);
+  for (size_t i = 0; i < path_index_dirs; i++)
+  {
+    PathDir *entry = &path_index[i];
+
+    // Binary search for the first name not below the prefix
+    size_t lo = 0, hi = entry->count;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (strcmp(entry->names[mid], prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (; lo < entry->count && strncmp(entry->names[lo], prefix, len) == 0; lo++)
+      add_match(m, entry->names[lo], strlen(entry->names[lo]));
+  }
+}
+
+/**
+ * Finds a command through the executable index, when completion has built it,
+ * so the hash table does not have to probe every PATH directory in turn. Each
+ * directory up to the one holding the command must still match its indexed names,
+ * or one that has changed since could hold it first.
+ *
+ * @param name The command name to be found.
+ * @return The newly allocated path of the executable, or NULL if the index does not
+ *         know it or cannot be trusted, in which case PATH is to be searched.
+ */
+char *path_index_locate(const char *name)
+{
+  for (size_t i = 0; i < path_index_dirs; i++)
+  {
+    PathDir *entry = &path_index[i];
+    struct stat st;
+
+    // A directory that has gone cannot hold the command
+    if (!entry->dir || stat(entry->dir, &st) == -1)
+      continue;
+    if (!path_index_current(entry, &st))
+      return NULL;
+    if (!entry->count || !bsearch(&name, entry->names, entry->count, sizeof(char *), compare_names))
+      continue;
+
+    char *candidate;
+    if (asprintf(&candidate, "%s/%s", entry->dir, name) == -1)
+      return NULL;
+    if (access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+      return candidate;
+    free(candidate);
+  }
+  return NULL;
+}
+
+/**
+ * Runs the built-in `hash` command.
+ * With no arguments it lists the table, `-r` empties it and names are looked up and added.
+ *
+ * @param cmd A pointer to the Command holding the arguments.
+ * @return 1 to keep the shell running.
+ */
+int hash_builtin(Command *cmd)
+{
+  last_status = 0;
+  if (cmd->arg_count == 1)
+  {
+    int empty = 1;
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+      for (HashEntry *entry = command_hash[i]; entry; entry = entry->next)
+      {
+        if (empty)
+          printf("hits\tcommand\n");
+        printf("%4u\t%s\n", entry->hits, entry->path);
+        empty = 0;
+      }
+    }
+    if (empty)
+      printf("hash: hash table empty\n");
+    return 1;
+  }
+
+  for (size_t i = 1; i < cmd->arg_count; i++)
+  {
+    if (strcmp(cmd->args[i], "-r") == 0)
+      hash_clear();
+    else if (strchr(cmd->args[i], '/'))
+      continue;
+    else if (!hash_lookup(cmd->args[i]))
+    {
+      fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+      last_status = 1;
+    }
+  }
   return 1;
 }
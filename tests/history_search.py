@@ -0,0 +1,56 @@
+# ^R searches back through the history file for entries holding the typed text,
+# and ^R again goes on to older matches.
+#
+# usage: python3 history_search.py seashell work_dir
+
+import os
+import pty
+import select
+import sys
+import time
+
+shell, work = sys.argv[1], sys.argv[2]
+history = os.path.join(work, "history")
+with open(history, "w") as f:
+    for i in range(2000):
+        f.write("echo filler %d\n" % i)
+    f.write("echo first docker run\necho other\necho second docker run\necho last\n")
+
+env = dict(os.environ, TERM="xterm", HISTFILE=history)
+pid, fd = pty.fork()
+if pid == 0:
+    os.execve(shell, [shell], env)
+
+output = b""
+
+
+def send(data, wait):
+    global output
+    os.write(fd, data)
+    end = time.time() + wait
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                output += os.read(fd, 65536)
+            except OSError:
+                return
+
+
+try:
+    send(b"", 0.3)
+    send(b"\x12docker r\x12\r", 0.5)
+    send(b"\x12filler 17\r", 0.5)
+    send(b"exit\n", 0.3)
+finally:
+    try:
+        os.kill(pid, 9)
+    except OSError:
+        pass
+    os.waitpid(pid, 0)
+
+text = output.decode(errors="replace")
+lines = text.replace("\r", "").split("\n")
+if "first docker run" not in lines or "second docker run" in lines:
+    raise SystemExit("^R did not go on to the older match:\n%s" % text)
+if "filler 1799" not in lines:
+    raise SystemExit("^R did not find the newest match:\n%s" % text)
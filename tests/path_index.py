@@ -0,0 +1,65 @@
+# Completion indexes the executables in PATH; a program added afterwards to an
+# earlier PATH directory must still win over the indexed one in a later directory.
+#
+# usage: python3 path_index.py seashell work_dir
+
+import os
+import pty
+import select
+import sys
+import time
+
+shell, work = sys.argv[1], sys.argv[2]
+first, second = os.path.join(work, "index_a"), os.path.join(work, "index_b")
+
+
+def program(path, text):
+    with open(path, "w") as f:
+        f.write("#!/bin/sh\necho %s\n" % text)
+    os.chmod(path, 0o755)
+
+
+os.mkdir(first)
+os.mkdir(second)
+program(os.path.join(second, "zzcmd"), "second")
+program(os.path.join(second, "zzother"), "other")
+
+env = dict(os.environ, TERM="xterm", PATH="%s:%s:%s" % (first, second, os.environ.get("PATH", "")))
+pid, fd = pty.fork()
+if pid == 0:
+    os.execve(shell, [shell], env)
+
+output = b""
+
+
+def send(data, wait):
+    global output
+    os.write(fd, data)
+    end = time.time() + wait
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                output += os.read(fd, 65536)
+            except OSError:
+                return
+
+
+try:
+    send(b"", 0.3)
+    # Completing builds the index, and the finished line runs without adding zzcmd to the hash table
+    send(b"zzo\t\n", 0.5)
+    program(os.path.join(first, "zzcmd"), "first")
+    send(b"zzcmd\n", 0.5)
+    send(b"exit\n", 0.3)
+finally:
+    try:
+        os.kill(pid, 9)
+    except OSError:
+        pass
+    os.waitpid(pid, 0)
+
+text = output.decode(errors="replace")
+if "other" not in text:
+    raise SystemExit("completion did not run zzother:\n%s" % text)
+if "first" not in text.split("zzcmd", 1)[-1] or "second" in text:
+    raise SystemExit("zzcmd was not found in the first directory:\n%s" % text)
@@ -0,0 +1,337 @@
+#!/bin/sh
+# Runs the regression tests against a seashell binary, printing one line per test
+# and exiting with the number of failures.
+#
+# usage: tests/run.sh [path to seashell]
+
+SHELL_BIN=$(cd "$(dirname "${1:-./seashell}")" && pwd)/$(basename "${1:-./seashell}")
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$DIR/work
+rm -rf "$WORK"
+mkdir -p "$WORK"
+failures=0
+
+# Reports whether a test printed what was expected.
+# usage: report name expected actual
+report() {
+  if [ "$3" = "$2" ]; then
+    echo "ok $1"
+  else
+    echo "FAIL $1"
+    printf 'expected:\n%s\nactual:\n%s\n' "$2" "$3"
+    failures=$((failures + 1))
+  fi
+}
+
+# Compares what a script prints, stdout and stderr together, and its exit status with the expected output.
+# usage: check name expected script
+check() {
+  report "$1" "$2" "$("$SHELL_BIN" -c "$3" 2>&1; echo "status $?")"
+}
+
+# Like check, for a script file read from stdin, so it can hold any quoting. It runs in the work directory.
+# usage: check_script name expected < script
+check_script() {
+  cat > "$WORK/$1.sh"
+  report "$1" "$2" "$(cd "$WORK" && "$SHELL_BIN" "$1.sh" 2>&1; echo "status $?")"
+}
+
+# Runs a test written in Python, when there is a Python to run it.
+# usage: check_python name script
+check_python() {
+  if ! command -v python3 > /dev/null; then
+    echo "skip $1"
+  elif python3 "$DIR/$2" "$SHELL_BIN" "$WORK"; then
+    echo "ok $1"
+  else
+    echo "FAIL $1"
+    failures=$((failures + 1))
+  fi
+}
+
+check_python server_client_disconnect server_disconnect.py
+check_python path_index_order path_index.py
+check_python history_search history_search.py
+
+# A reader that leaves early must not take the shell down with an in-process cat or tee
+head -c 4000000 /dev/zero > "$WORK/big"
+mkfifo "$WORK/cat.fifo" "$WORK/tee.fifo"
+check builtin_copy_sigpipe "cat 141
+tee 141
+survived
+status 0" "cd $WORK; head -c 10 cat.fifo > /dev/null & cat big big big > cat.fifo; echo \"cat \$?\"
+head -c 10 tee.fifo > /dev/null & tee copy < big > tee.fifo; echo \"tee \$?\"; echo survived"
+
+# The last command replaces the shell, and a hashed program that went away is searched for again
+mkdir "$WORK/pa" "$WORK/pb"
+printf '#!/bin/sh\necho %s\n' pa > "$WORK/pa/hx"
+printf '#!/bin/sh\necho %s\n' pb > "$WORK/pb/hx"
+chmod +x "$WORK/pa/hx" "$WORK/pb/hx"
+check exec_hash_retry "pb
+status 0" "export PATH=$WORK/pa:$WORK/pb:\$PATH; hash hx; rm $WORK/pa/hx; hx"
+check exec_hash_missing "hx: command not found
+status 127" "export PATH=$WORK/pa:$WORK/pb:\$PATH; hash hx; rm $WORK/pb/hx; hx"
+
+# Only a bare `time` is the keyword; quoted, it names a command like any other word
+mkdir "$WORK/bin"
+printf '#!/bin/sh\necho "external time $*"\n' > "$WORK/bin/time"
+chmod +x "$WORK/bin/time"
+check time_quoted "external time echo hi
+external time echo hi
+status 0" "export PATH=$WORK/bin:\$PATH; \"time\" echo hi; \\time echo hi"
+
+# Quotes and backslashes are removed in one pass, and operators inside them are plain text
+expected=$(cat <<'EOF'
+single $HOME "x" double 'y' $ " \ \a plain space '
+abcd   e
+tab	in
+<>
+<>
+<a b>
+<a  b>
+# not # comment a#b
+y
+$x $x $x
+; | && a;b > <
+end
+status 0
+EOF
+)
+check_script quoting "$expected" <<'EOF'
+echo 'single $HOME "x"' "double 'y' \$ \" \\ \a" plain\ space \'
+echo a"b"'c'd "" '' e
+echo "tab	in"
+printf '<%s>\n' "" '' a\ b "a  b"
+echo \# 'not # comment' a#b # comment
+echo 2>stderr y; cat stderr
+echo "$"x '$x' \$x
+echo ";" '|' "&&" a\;b \> '<'
+echo -n; echo end
+EOF
+
+# An unterminated quote fails its line only
+expected=$(cat <<'EOF'
+unexpected end of line while looking for matching `"'
+Error parsing command.
+unexpected end of line while looking for matching `''
+Error parsing command.
+still running
+status 0
+EOF
+)
+check_script quoting_unterminated "$expected" <<'EOF'
+echo "open
+echo 'open
+echo still running
+EOF
+
+# A $name ends where the name does, even when quoting joins more text to it
+check expand_joined_text "abd
+abc
+abd
+x-ab-y
+abd
+ab_s
+ab'q'
+abq
+ab\$
+|
+status 0" 'X=ab; echo "$X"d; echo $X"c"; echo $X\d; echo "x-$X"-y; echo ${X}d; Y="$X"_s; echo $Y
+echo "$X'"'q'"'"; echo $X'"'q'"'; echo "$X\$"; echo "$Xz|"'
+check expand_status_pid "0x
+1
+status 0" 'echo "$?"x; false; echo $?; test "$$" -gt 0 || echo no pid'
+check expand_split "<a> <b> <c> 
+<a b  c>
+status 0" 'X="a b  c"; printf "<%s> " $X; echo; printf "<%s>\n" "$X"'
+check expand_command "[hi there]
+status 0" 'echo "[$(echo hi) there]"'
+
+# Braced and unset variables, nested substitutions and the splitting of their output
+expected=$(cat <<'EOF'
+ab abc abd
+[] [] xy
+nested inner
+[a]
+<one><two><three>
+<one two three>
+abz
+
+status 0
+$X ab
+ababab$X
+$ $ $. x$
+status 0
+EOF
+)
+check_script expand_forms "$expected" <<'EOF'
+X=ab
+echo "${X}" ${X}c "${X}"d
+echo "[$UNSET]" [$UNSET] x$UNSET"y"
+echo "$(echo nested $(echo inner))"
+echo "[$(printf 'a\n\n\n')]"
+printf '<%s>' $(echo one two   three); echo
+printf '<%s>' "$(echo one two   three)"; echo
+Y=$(echo $X)z; echo $Y
+echo $(false); echo "status $?"
+echo "$(echo '$X' "$X")"
+echo $X$X"$X"'$X'
+echo $ "$" $. x$
+EOF
+
+# Assignments before a command are laid over the environment for that command only
+expected=$(cat <<'EOF'
+A=1
+after []
+B=2
+B=3
+B still 2
+C=y
+B=[]
+E=5
+status 0
+EOF
+)
+check_script env_overlay "$expected" <<'EOF'
+A=1 sh -c 'echo "A=$A"'
+echo "after [$A]"
+export B=2; sh -c 'echo "B=$B"'
+B=3 sh -c 'echo "B=$B"'; echo "B still $B"
+C=x C=y sh -c 'echo "C=$C"'
+unset B; sh -c 'echo "B=[$B]"'
+PATH=/nonexistent:$PATH E=5 env | grep '^E='
+EOF
+
+# echo, printf and test run inside the shell, as bash's builtins do
+expected=$(cat <<'EOF'
+ab
+x	y
+x\ty
+-- -n
+   ab|ab   |ab
+42 -7 ff 10 z %
+003.1 1.234500e+03
+a
+b
+c
+65
+    42|
+a	b\n
+printf: 12abc: invalid number
+12
+status 1
+gt
+eq
+empty
+nofile
+and
+or
+paren
+status 1
+[: -gt: unexpected argument
+status 2
+status 1
+0
+1
+0
+pwd
+status 0
+EOF
+)
+check_script builtins_in_process "$expected" <<'EOF'
+echo -n a; echo b
+echo -e 'x\ty'; echo -E 'x\ty'; echo -- -n
+printf '%5s|%-5s|%.2s\n' ab ab abcdef
+printf '%d %i %x %o %c %%\n' 42 -7 255 8 zed
+printf '%05.1f %e\n' 3.14159 1234.5
+printf '%s\n' a b c
+printf '%d\n' "'A"
+printf '%*d|\n' 6 42
+printf '%b\n' 'a\tb\\n'
+printf '%d\n' 12abc; echo "status $?"
+test 3 -gt 2 && echo gt; [ abc = abc ] && echo eq; [ -n "" ] || echo empty
+[ ! -f /nonexistent ] && echo nofile; [ 1 -eq 1 -a 2 -ne 3 ] && echo and
+test -d /tmp -o -f /x && echo or; [ \( 1 -lt 2 \) ] && echo paren
+[ 2 -le 1 ]; echo "status $?"
+[ 1 -gt ]; echo "status $?"
+test; echo "status $?"
+true; echo $?; false; echo $?; : ; echo $?
+pwd > /dev/null && echo pwd
+EOF
+
+# A bad printf conversion is reported and ends the output; it must not take the shell down
+check printf_missing_conversion "printf: %: missing format character
+after 1
+status 0" 'printf "%"; echo "after $?"'
+check printf_invalid_conversion "printf: %q: invalid format character
+after 1
+status 0" 'printf "%q\n" x; echo "after $?"'
+check printf_escape_stop "a
+after 0
+status 0" 'printf "%b|\n" "a\cb"; echo; echo "after $?"'
+check printf_reuse "a-3
+b-4
+status 0" 'printf "%s-%d\n" a 3 b 4'
+
+check exit_status "status 3" 'exit 259'
+check exit_not_number "exit: abc: numeric argument required
+status 2" 'exit abc'
+
+# The shell's messages come out behind the output buffered before them
+check diagnostic_order "before
+printf: %q: invalid format character
+after
+status 0" 'echo before; printf "%q"; echo after'
+printf 'echo before\necho "x\necho after\n' > "$WORK/unterminated"
+check diagnostic_order_parse "before
+unexpected end of line while looking for matching \`\"'
+Error parsing command.
+after
+status 0" "$SHELL_BIN $WORK/unterminated"
+
+# Patterns match names in sorted order, hidden files only by an explicit dot, and ** any depth
+mkdir -p "$WORK/g/sub/deep" "$WORK/g/.hid"
+(cd "$WORK/g" && touch a.c b.c B.c x1 x2 x10 c.h .dot.c sub/s.c sub/deep/d.c "sp ace.c")
+expected=$(cat <<'EOF'
+B.c a.c b.c sp ace.c
+a.c b.c B.c B.c
+x1 x2 x1 x2 x2
+a.c b.c c.h
+*.none *.c [ab].c *.c
+.dot.c
+sub/s.c sub/s.c
+B.c a.c b.c sp ace.c sub/deep/d.c sub/s.c
+sub/ sub/deep sub/deep/d.c sub/s.c
+<B.c>
+<a.c>
+<b.c>
+<sp ace.c>
+[ -f a.c ]
+bracket-test
+x[
+status 0
+EOF
+)
+check_script glob "$expected" <<'EOF'
+cd g
+echo *.c
+echo [ab].c [!ab].c [^a-b].c
+echo x? x[0-9] x[!1]* 
+echo [a-c].?
+echo *.none "*.c" '[ab].c' \*.c
+echo .*.c
+echo sub/*.c */*.c
+echo **/*.c
+echo sub/**
+for f in *.c; do echo "<$f>"; done
+echo [ -f a.c ]; [ -f a.c ] && echo bracket-test
+echo x[
+EOF
+
+# Every name in the builtins table must be found by find_builtin
+names=$(sed -n '/^static const Builtin builtins\[\] = {/,/^};/s/^ *{"\([^"]*\)".*/\1/p' "$DIR/../seashell.c")
+expected=$(for name in $names; do echo "$name is a shell builtin"; done; echo "status 0")
+check builtin_lookup "$expected" "type $(echo $names)"
+
+rm -rf "$WORK"
+exit "$failures"
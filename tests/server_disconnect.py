@@ -0,0 +1,60 @@
+# A client that hangs up partway through a large capture reply must not take the
+# server down: later clients still get their requests served.
+#
+# usage: python3 server_disconnect.py seashell work_dir
+
+import os
+import socket
+import subprocess
+import sys
+import time
+
+shell, work = sys.argv[1], sys.argv[2]
+path = os.path.join(work, "server.sock")
+server = subprocess.Popen([shell, "--server", path])
+
+
+def connect():
+    for _ in range(100):
+        try:
+            s = socket.socket(socket.AF_UNIX)
+            s.connect(path)
+            return s
+        except OSError:
+            time.sleep(0.05)
+    raise SystemExit("cannot connect to the server")
+
+
+def request(s, method, text):
+    s.sendall(b"%s %d\n%s" % (method, len(text), text))
+
+
+try:
+    # Far more output than the socket buffers hold, then hang up after the header
+    s = connect()
+    request(s, b"capture", b"cat %s %s %s" % ((shell.encode(),) * 3))
+    header = b""
+    while not header.endswith(b"\n"):
+        header += s.recv(1)
+    if not header.startswith(b"output "):
+        raise SystemExit("unexpected reply %r" % header)
+    s.close()
+
+    time.sleep(0.2)
+    if server.poll() is not None:
+        raise SystemExit("server died with status %d" % server.returncode)
+
+    s = connect()
+    request(s, b"capture", b"echo still here")
+    reply = b""
+    while not reply.endswith(b"status 0\n"):
+        data = s.recv(65536)
+        if not data:
+            break
+        reply += data
+    s.close()
+    if reply != b"output 11\nstill here\nstatus 0\n":
+        raise SystemExit("unexpected reply %r" % reply)
+finally:
+    server.kill()
+    server.wait()
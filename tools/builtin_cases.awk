@@ -0,0 +1,79 @@
+# Generates the cases of find_builtin's switch from the builtins table in seashell.c,
+# so the indices they pick always match the table. Builtins are told apart by their
+# length and first character, and those that share both by the first other character
+# in which they all differ.
+#
+# usage: awk -f tools/builtin_cases.awk seashell.c > builtin_cases.h
+
+# Writes a character as a C character constant.
+function quote(c)
+{
+  return c == "'" || c == "\\" ? "'\\" c "'" : "'" c "'"
+}
+
+BEGIN { count = 0; nkeys = 0 }
+
+/^static const Builtin builtins\[\] = \{/ { table = 1; next }
+table && /^};/ { table = 0 }
+table && match($0, /^ *\{"[^"]*"/) {
+  name = substr($0, RSTART, RLENGTH)
+  sub(/^ *\{"/, "", name)
+  sub(/"$/, "", name)
+  if (length(name) > 15)
+  {
+    print "builtin_cases.awk: " name ": names are looked up by at most 15 characters" > "/dev/stderr"
+    failed = 1
+  }
+  key = length(name) " << 8 | " quote(substr(name, 1, 1))
+  if (!(key in group))
+    keys[nkeys++] = key
+  group[key] = group[key] " " count
+  names[count++] = name
+}
+
+END {
+  if (count == 0)
+  {
+    print "builtin_cases.awk: no builtins table found" > "/dev/stderr"
+    exit 1
+  }
+  print "// Generated from the builtins table by tools/builtin_cases.awk; do not edit."
+  for (k = 0; k < nkeys; k++)
+  {
+    key = keys[k]
+    n = split(substr(group[key], 2), members, " ")
+    print "  case " key ":"
+    if (n == 1)
+      print "    i = " members[1] ";"
+    else
+    {
+      # The first position at which every name of the group has a different character
+      len = length(names[members[1]])
+      for (pos = 2; pos <= len; pos++)
+      {
+        split("", seen)
+        distinct = 1
+        for (m = 1; m <= n; m++)
+        {
+          c = substr(names[members[m]], pos, 1)
+          if (c in seen)
+            distinct = 0
+          seen[c] = 1
+        }
+        if (distinct)
+          break
+      }
+      if (pos > len)
+      {
+        print "builtin_cases.awk: " key ": names differ in no single position" > "/dev/stderr"
+        failed = 1
+      }
+      line = "    i = "
+      for (m = 1; m < n; m++)
+        line = line "name[" pos - 1 "] == " quote(substr(names[members[m]], pos, 1)) " ? " members[m] " : "
+      print line members[n] ";"
+    }
+    print "    break;"
+  }
+  exit failed
+}